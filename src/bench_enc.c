@@ -0,0 +1,168 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Photon encoder benchmark. Checks every kernel this CPU runs against
+   the scalar one, then encodes random packets with each on one core
+   and reports photons/s. "per-photon" is the loop tmif used to have,
+   one bounds check per photon.
+
+   bench_enc                 full packets (244 photons), 1 s per kernel
+   bench_enc -p 10 -s 2      10 photon packets, 2 s per kernel
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tmif_enc.h"
+
+/* CU40MMXS packet, 3 header words and up to 244 photons */
+#define BENCH_PACKET_WORDS 735
+#define BENCH_MAX_PHOTONS ((BENCH_PACKET_WORDS - 3)/3)
+/* Packets cycled through, enough to not all sit in L1 */
+#define BENCH_PACKETS 256
+/* Packets between clock reads */
+#define BENCH_BATCH 1024
+/* DMA buffer the words go to */
+#define BENCH_OUT_WORDS 11760
+
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+/* The encoder as it was in tmif.c, for reference */
+static void enc_per_photon(uint16_t *dst, const uint16_t *src, int n) {
+    uint32_t dma_i = 0;
+    int i = 0;
+
+    for (i = 0; i < 3*n; i += 3) {
+        if (dma_i < (BENCH_OUT_WORDS - 100)) {
+            dst[dma_i] = ((src[i] >> 1) | 0x2000);
+            dma_i++;
+            dst[dma_i] = ((src[i+1] >> 1) | 0x4000);
+            dma_i++;
+            dst[dma_i] = ((src[i+2]) | 0x6000);
+            dma_i++;
+        }
+    }
+}
+
+/* Same words as the scalar kernel for every photon count? */
+static int check(tmif_enc_fn fn, uint16_t (*pkts)[BENCH_PACKET_WORDS]) {
+    static uint16_t want[BENCH_PACKET_WORDS + 8];
+    static uint16_t got[BENCH_PACKET_WORDS + 8];
+    tmif_enc_fn scalar = tmif_enc_kernel(TMIF_ENC_SCALAR);
+    int n = 0;
+    int p = 0;
+
+    for (p = 0; p < BENCH_PACKETS; p++) {
+        for (n = 0; n <= BENCH_MAX_PHOTONS; n++) {
+            /* words past the end must be left alone */
+            memset(want, 0xA5, sizeof(want));
+            memset(got, 0xA5, sizeof(got));
+            scalar(want, &pkts[p][3], n);
+            fn(got, &pkts[p][3], n);
+            if (memcmp(want, got, sizeof(want)) != 0) {
+                printf("mismatch, packet %d, %d photons\n", p, n);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static double run(tmif_enc_fn fn, uint16_t (*pkts)[BENCH_PACKET_WORDS],
+                  uint16_t *out, int photons, double seconds) {
+    uint64_t n_pkts = 0;
+    double t0 = now_s();
+    double t = t0;
+    int i = 0;
+
+    while ((t - t0) < seconds) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            fn(&out[(i % 16)*BENCH_PACKET_WORDS], &pkts[i % BENCH_PACKETS][3], photons);
+        }
+        n_pkts += BENCH_BATCH;
+        t = now_s();
+    }
+
+    return (double)n_pkts*photons/(t - t0);
+}
+
+static void usage(void) {
+    printf("usage: bench_enc [-p photons] [-s seconds]\n");
+    printf("  -p  photons per packet, max %d (default %d)\n",
+           BENCH_MAX_PHOTONS, BENCH_MAX_PHOTONS);
+    printf("  -s  seconds per kernel (default 1)\n");
+}
+
+
+int main(int argc, char **argv) {
+    static uint16_t pkts[BENCH_PACKETS][BENCH_PACKET_WORDS];
+    static uint16_t out[16*BENCH_PACKET_WORDS];
+    tmif_enc_fn fn;
+    double base = 0;
+    double rate = 0;
+    double seconds = 1;
+    int photons = BENCH_MAX_PHOTONS;
+    int level = 0;
+    int opt = 0;
+    int i = 0;
+    int j = 0;
+
+    while ((opt = getopt(argc, argv, "p:s:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            photons = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if ((photons < 1) || (photons > BENCH_MAX_PHOTONS) || (seconds <= 0)) {
+        usage();
+        return -1;
+    }
+
+    srand(1);
+    for (i = 0; i < BENCH_PACKETS; i++) {
+        pkts[i][0] = photons;
+        for (j = 3; j < BENCH_PACKET_WORDS; j++) {
+            pkts[i][j] = rand() & 0xFFFF;
+        }
+    }
+
+    printf("%d photons per packet, %.1f s per kernel, best here: %s\n",
+           photons, seconds, tmif_enc_name(tmif_enc_init(TMIF_ENC_LEVELS)));
+
+    base = run(enc_per_photon, pkts, out, photons, seconds);
+    printf("%-10s %8.1f Mphotons/s  %6.1f ns/packet\n", "per-photon",
+           base*1e-6, photons/base*1e9);
+
+    for (level = 0; level < TMIF_ENC_LEVELS; level++) {
+        fn = tmif_enc_kernel(level);
+        if (!fn) {
+            printf("%-10s not on this CPU\n", tmif_enc_name(level));
+            continue;
+        }
+        if (check(fn, pkts) != 0) {
+            printf("%-10s WRONG OUTPUT\n", tmif_enc_name(level));
+            return -1;
+        }
+        rate = run(fn, pkts, out, photons, seconds);
+        printf("%-10s %8.1f Mphotons/s  %6.1f ns/packet  %5.2fx\n", tmif_enc_name(level),
+               rate*1e-6, photons/rate*1e9, rate/base);
+    }
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Compressed photon frame benchmark. Compresses random packets, checks
+   each decodes to exactly the tagged words of its photons and that a
+   flipped bit is caught, then reports telemetry words per photon and
+   compress/decompress photons/s on one core.
+
+   uniform   x, y, phd spread as pkt_gen makes them (worst case)
+   spectrum  a few lines on a narrow band, phd peaked, like sky data
+
+   bench_frm                 full packets (244 photons)
+   bench_frm -p 20 -s 2      20 photon packets, 2 s per test
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tmif_enc.h"
+#include "tmif_frm.h"
+
+/* CU40MMXS packet, 3 header words and up to 244 photons */
+#define BENCH_PACKET_WORDS 735
+#define BENCH_MAX_PHOTONS ((BENCH_PACKET_WORDS - 3)/3)
+/* Packets cycled through */
+#define BENCH_PACKETS 256
+/* Packets between clock reads */
+#define BENCH_BATCH 256
+/* Spectral lines in the spectrum data */
+#define BENCH_LINES 6
+
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+/* Roughly normal, sum of 4 uniforms */
+static int normal(int mean, int sigma) {
+    int s = 0;
+    int i = 0;
+
+    for (i = 0; i < 4; i++) {
+        s += rand() % (2*sigma + 1) - sigma;
+    }
+    return mean + s/2;
+}
+
+static uint16_t clip(int v, int max) {
+    return (uint16_t)((v < 0) ? 0 : ((v > max) ? max : v));
+}
+
+static void fill(uint16_t (*pkts)[BENCH_PACKET_WORDS], int photons, int spectrum) {
+    int line[BENCH_LINES];
+    uint16_t *p;
+    int i = 0;
+    int j = 0;
+
+    for (j = 0; j < BENCH_LINES; j++) {
+        line[j] = rand() & 0x3FFF;
+    }
+    for (i = 0; i < BENCH_PACKETS; i++) {
+        pkts[i][0] = photons;
+        for (j = 0; j < photons; j++) {
+            p = &pkts[i][3 + 3*j];
+            if (spectrum) {
+                p[0] = clip(normal(line[rand() % BENCH_LINES], 40), 0x3FFF);
+                p[1] = clip(normal(0x2000, 200), 0x3FFF);
+                p[2] = clip(normal(120, 30), 0xFF);
+            } else {
+                p[0] = rand() & 0x3FFF;
+                p[1] = rand() & 0x3FFF;
+                p[2] = rand() & 0xFF;
+            }
+        }
+    }
+}
+
+static int cmp_photon(const void *a, const void *b) {
+    const uint16_t *pa = a;
+    const uint16_t *pb = b;
+
+    if (pa[1] != pb[1]) {
+        return (pa[1] < pb[1]) ? -1 : 1;
+    }
+    if (pa[0] != pb[0]) {
+        return (pa[0] < pb[0]) ? -1 : 1;
+    }
+    return (pa[2] < pb[2]) ? -1 : (pa[2] > pb[2]);
+}
+
+/* Every packet round trips to its tagged words, sorted, and a bit
+   flipped anywhere in a frame makes it fail to parse. Returns the
+   total frame words, -1 on a mismatch. */
+static int64_t check(uint16_t (*pkts)[BENCH_PACKET_WORDS], int photons) {
+    uint16_t frame[BENCH_PACKET_WORDS];
+    uint16_t want[BENCH_PACKET_WORDS];
+    uint16_t got[BENCH_PACKET_WORDS];
+    tmif_frm_t f;
+    int64_t total = 0;
+    int bit = 0;
+    int len = 0;
+    int i = 0;
+
+    for (i = 0; i < BENCH_PACKETS; i++) {
+        len = tmif_frm_photons(frame, BENCH_PACKET_WORDS, &pkts[i][3], photons);
+        if (len < 0) {
+            /* would go out tagged */
+            total += 3*photons;
+            continue;
+        }
+        total += len;
+
+        tmif_enc_photons(want, &pkts[i][3], photons);
+        qsort(want, photons, 3*sizeof(uint16_t), cmp_photon);
+        if ((tmif_frm_parse(frame, len, &f) != len) ||
+            (tmif_frm_unphotons(&f, got) != photons) ||
+            (memcmp(want, got, 3*photons*sizeof(uint16_t)) != 0)) {
+            printf("packet %d doesn't round trip\n", i);
+            return -1;
+        }
+
+        bit = rand() % (16*len);
+        frame[bit/16] ^= (uint16_t)(1 << (bit % 16));
+        if (tmif_frm_parse(frame, len, &f) == len) {
+            printf("packet %d: flipped bit %d not caught\n", i, bit);
+            return -1;
+        }
+    }
+    return total;
+}
+
+static void run(const char *name, uint16_t (*pkts)[BENCH_PACKET_WORDS], int photons,
+                double seconds) {
+    static uint16_t frames[BENCH_PACKETS][BENCH_PACKET_WORDS];
+    uint16_t out[BENCH_PACKET_WORDS];
+    tmif_frm_t f;
+    int64_t words = 0;
+    uint64_t n_pkts = 0;
+    double t0 = 0;
+    double t = 0;
+    double enc = 0;
+    int i = 0;
+
+    words = check(pkts, photons);
+    if (words < 0) {
+        printf("%-9s WRONG OUTPUT\n", name);
+        exit(-1);
+    }
+
+    t0 = t = now_s();
+    while ((t - t0) < seconds) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            tmif_frm_photons(frames[i % BENCH_PACKETS], BENCH_PACKET_WORDS,
+                             &pkts[i % BENCH_PACKETS][3], photons);
+        }
+        n_pkts += BENCH_BATCH;
+        t = now_s();
+    }
+    enc = (double)n_pkts*photons/(t - t0);
+
+    n_pkts = 0;
+    t0 = t = now_s();
+    while ((t - t0) < seconds) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            if (tmif_frm_parse(frames[i % BENCH_PACKETS], BENCH_PACKET_WORDS, &f) > 0) {
+                tmif_frm_unphotons(&f, out);
+            }
+        }
+        n_pkts += BENCH_BATCH;
+        t = now_s();
+    }
+
+    printf("%-9s %5.2f words/photon (%4.1f%% of tagged)  compress %6.1f  decompress %6.1f Mphotons/s\n",
+           name, (double)words/(BENCH_PACKETS*photons),
+           100.0*words/(3.0*BENCH_PACKETS*photons), enc*1e-6,
+           (double)n_pkts*photons/(t - t0)*1e-6);
+}
+
+static void usage(void) {
+    printf("usage: bench_frm [-p photons] [-s seconds]\n");
+    printf("  -p  photons per packet, max %d (default %d)\n",
+           BENCH_MAX_PHOTONS, BENCH_MAX_PHOTONS);
+    printf("  -s  seconds per test (default 1)\n");
+}
+
+
+int main(int argc, char **argv) {
+    static uint16_t pkts[BENCH_PACKETS][BENCH_PACKET_WORDS];
+    double seconds = 1;
+    int photons = BENCH_MAX_PHOTONS;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "p:s:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            photons = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if ((photons < 1) || (photons > BENCH_MAX_PHOTONS) || (seconds <= 0)) {
+        usage();
+        return -1;
+    }
+
+    srand(1);
+    printf("%d photons per packet, %.1f s per test\n", photons, seconds);
+    fill(pkts, photons, 0);
+    run("uniform", pkts, photons, seconds);
+    fill(pkts, photons, 1);
+    run("spectrum", pkts, photons, seconds);
+
+    return 0;
+}
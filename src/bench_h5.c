@@ -0,0 +1,211 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Archive benchmark. Pushes synthetic CU40MMXS packets through the
+   tmif_hdf5 save path as fast as it will take them, flushing the file
+   on the same 500 ms cadence as tmif's heartbeat, and reports the
+   sustained packets/s and MB/s to disk. The writer queue blocks by
+   default so the figure is what the disk sustains.
+
+   bench_h5                         100k packets, 10 per save_packets()
+   bench_h5 -n 500000 -b 20 -f /data/bench.h5
+   bench_h5 -q drop                 what the hot path sees with drop-oldest
+   bench_h5 -z 4 -Z 2               shuffle+deflate on two workers
+   bench_h5 -p 5 -e 0.01            photon events, 1% of packets raw
+   bench_h5 -L /tmp/bench.log       raw append log backend
+   bench_h5 -r 5000 -n 1000000      receive times as if at 5k packets/s
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "tmif_hdf5.h"
+#include "tmif_h5z.h"
+
+#define BENCH_FLUSH_NS 500000000LL
+/* save_packets() takes at most this many per call */
+#define BENCH_MAX_BATCH 255
+/* Distinct packets cycled through, well past deflate's 32k window so
+   compression figures aren't flattered by repeats */
+#define BENCH_POOL 2040
+/* Default photons per packet, x y phd words as pkt_gen makes them */
+#define BENCH_PHOTONS 100
+
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static double cpu_s(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6;
+}
+
+int main(int argc, char **argv) {
+    const char *file = "/tmp/bench_h5.h5";
+    const char *log_file = NULL;
+    long n_packets = 100000;
+    int batch = 10;
+    static uint16_t pkts[BENCH_POOL*CHESS_PACKET_LEN];
+    uint16_t *p;
+    int pool_i = 0;
+    static int64_t rx_ns[BENCH_MAX_BATCH];
+    uint16_t counter = 0;
+    int64_t t0 = 0;
+    int64_t t = 0;
+    int64_t last_flush = 0;
+    double cpu0 = 0;
+    double wall = 0;
+    long done = 0;
+    int errors = 0;
+    tmif_h5_policy_t policy = TMIF_H5_BLOCK;
+    int z_level = 0;
+    int z_workers = TMIF_H5Z_WORKERS_DEFAULT;
+    int n_photons = BENCH_PHOTONS;
+    double rate = 0;
+    double rot_mb = 0;
+    uint64_t rot_rows = 0;
+    int rot_secs = 0;
+    uint64_t seq[BENCH_MAX_BATCH];
+    uint64_t next_seq = 0;
+    int opt = 0;
+    int i = 0;
+    int j = 0;
+
+    while ((opt = getopt(argc, argv, "n:b:f:q:z:Z:p:e:L:RB:N:T:r:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            n_packets = atol(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'q':
+            if (strcmp(optarg, "drop") == 0) {
+                policy = TMIF_H5_DROP_OLDEST;
+            } else if (strcmp(optarg, "spill") == 0) {
+                policy = TMIF_H5_SPILL;
+            } else {
+                policy = TMIF_H5_BLOCK;
+            }
+            break;
+        case 'z':
+            z_level = atoi(optarg);
+            break;
+        case 'Z':
+            z_workers = atoi(optarg);
+            break;
+        case 'p':
+            n_photons = atoi(optarg);
+            break;
+        case 'e':
+            set_packet_save_events(atof(optarg));
+            break;
+        case 'L':
+            log_file = optarg;
+            break;
+        case 'R':
+            set_packet_save_swmr(0);
+            break;
+        case 'B':
+            rot_mb = atof(optarg);
+            break;
+        case 'N':
+            rot_rows = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            rot_secs = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        default:
+            printf("usage: bench_h5 [-n packets] [-b packets per save] [-f file] [-q block|drop|spill]\n");
+            printf("                [-z level] [-Z workers] [-p photons] [-e raw fraction]\n");
+            printf("                [-L log] [-R] [-B MB] [-N packets] [-T seconds]\n");
+            printf("                [-r receive time rate, pkts/s]\n");
+            return -1;
+        }
+    }
+    if ((batch < 1) || (batch > BENCH_MAX_BATCH)) {
+        printf("batch must be 1-%d\n", BENCH_MAX_BATCH);
+        return -1;
+    }
+    if ((n_photons < 1) || (n_photons > (CHESS_PACKET_LEN - 3)/3)) {
+        printf("photons must be 1-%d\n", (CHESS_PACKET_LEN - 3)/3);
+        return -1;
+    }
+
+    /* Start from an empty file every run */
+    unlink(file);
+    set_packet_save_file(file);
+    if (log_file) {
+        unlink(log_file);
+        set_packet_save_log(log_file);
+    }
+    set_packet_save_policy(policy);
+    set_packet_save_compression(z_level, z_workers);
+    set_packet_save_rotation((uint64_t)(rot_mb*1e6), rot_rows, rot_secs);
+    if (init_packet_save(1) != 0) {
+        printf("init_packet_save() failed\n");
+        return -1;
+    }
+
+    memset(pkts, 0, sizeof(pkts));
+    for (i = 0; i < BENCH_POOL; i++) {
+        p = pkts + i*CHESS_PACKET_LEN;
+        p[0] = n_photons;
+        for (j = 0; j < n_photons; j++) {
+            p[3 + 3*j] = (uint16_t)(rand() & 0x3FFF);
+            p[4 + 3*j] = (uint16_t)(rand() & 0x3FFF);
+            p[5 + 3*j] = (uint16_t)(rand() & 0xFF);
+        }
+    }
+
+    cpu0 = cpu_s();
+    t0 = now_ns();
+    last_flush = t0;
+    while (done < n_packets) {
+        t = now_ns();
+        if ((pool_i + batch) > BENCH_POOL) {
+            pool_i = 0;
+        }
+        p = pkts + pool_i*CHESS_PACKET_LEN;
+        for (i = 0; i < batch; i++) {
+            p[i*CHESS_PACKET_LEN + 1] = ++counter;
+            rx_ns[i] = (rate > 0) ? (t0 + (int64_t)(next_seq*1e9/rate)) : t;
+            seq[i] = next_seq++;
+        }
+        errors += save_packets(0, p, rx_ns, seq, (uint8_t)batch);
+        pool_i += batch;
+        done += batch;
+
+        if ((t - last_flush) >= BENCH_FLUSH_NS) {
+            flush_packet_save();
+            last_flush = t;
+        }
+    }
+    errors += close_packet_save();
+    wall = (now_ns() - t0)*1e-9;
+    print_packet_save_stats();
+
+    printf("%ld packets, %d per save, %.3f s: %.0f pkts/s, %.1f MB/s, cpu %.1f%%, errors %d\n",
+           done, batch, wall, done/wall,
+           done*(double)sizeof(chess_word_packet_t)/wall/1e6,
+           100.0*(cpu_s() - cpu0)/wall, errors);
+
+    return 0;
+}
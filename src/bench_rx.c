@@ -0,0 +1,265 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Ingest benchmark. Replays CU40MMXS packets over loopback at fixed
+   rates from a sender thread and drains them with each tmif ingest
+   backend, reporting loss and receiver CPU per packet.
+
+   bench_rx                      recvfrom vs uring at 5k, 50k, 200k pkts/s
+   bench_rx -m mmsg -r 100000    one backend at one rate
+*/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "tmif_net.h"
+
+#define BENCH_PORT (CU40MMXS_PORT + 1)
+#define BENCH_BURST 32
+#define BENCH_MAX_RATES 8
+#define BENCH_MAX_MODES 4
+
+
+typedef struct {
+    double rate;
+    double seconds;
+    uint16_t port;
+    uint64_t sent;
+} sender_args_t;
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+static double thread_cpu_s(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6;
+}
+
+/* Paced sendmmsg() of numbered packets to loopback */
+static void *sender(void *arg) {
+    sender_args_t *a = (sender_args_t *)arg;
+    static uint16_t pkts[BENCH_BURST][CU40MMXS_PACKET_SIZE/2];
+    struct mmsghdr msgs[BENCH_BURST];
+    struct iovec iovs[BENCH_BURST];
+    struct sockaddr_in sin;
+    uint16_t counter = 0;
+    uint64_t due = 0;
+    double t0 = 0;
+    double t = 0;
+    int fd = 0;
+    int burst = 0;
+    int n = 0;
+    int i = 0;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(a->port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    memset(pkts, 0, sizeof(pkts));
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < BENCH_BURST; i++) {
+        pkts[i][0] = 10;
+        iovs[i].iov_base = pkts[i];
+        iovs[i].iov_len = CU40MMXS_PACKET_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &sin;
+        msgs[i].msg_hdr.msg_namelen = sizeof(sin);
+    }
+
+    a->sent = 0;
+    t0 = now_s();
+    while ((t = now_s() - t0) < a->seconds) {
+        due = (uint64_t)(t*a->rate);
+        if (due <= a->sent) {
+            usleep(20);
+            continue;
+        }
+        burst = (due - a->sent) > BENCH_BURST ? BENCH_BURST : (int)(due - a->sent);
+        for (i = 0; i < burst; i++) {
+            pkts[i][1] = ++counter;
+        }
+        n = sendmmsg(fd, msgs, burst, 0);
+        if (n > 0) {
+            a->sent += n;
+            counter -= (burst - n);
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int open_mode(tmif_rx_t *rx, tmif_rx_mode_t mode, uint16_t port) {
+    switch (mode) {
+    case TMIF_RX_RING:
+        return tmif_rx_open_ring(rx, "lo", htonl(INADDR_LOOPBACK), port);
+    case TMIF_RX_URING:
+        return tmif_rx_open_uring(rx, htonl(INADDR_LOOPBACK), port, TMIF_RX_BATCH_DEFAULT);
+    default:
+        return tmif_rx_open(rx, mode, htonl(INADDR_LOOPBACK), port, TMIF_RX_BATCH_DEFAULT, 0);
+    }
+}
+
+static const char *mode_name(tmif_rx_mode_t mode) {
+    switch (mode) {
+    case TMIF_RX_RECVFROM:
+        return "recvfrom";
+    case TMIF_RX_MMSG:
+        return "mmsg";
+    case TMIF_RX_RING:
+        return "ring";
+    case TMIF_RX_URING:
+        return "uring";
+    }
+    return "?";
+}
+
+/* One backend at one rate. Returns 0 on success. */
+static int run(tmif_rx_mode_t mode, double rate, double seconds, uint16_t port) {
+    tmif_rx_t rx;
+    sender_args_t args;
+    pthread_t tid;
+    struct epoll_event ev;
+    int epoll_fd = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    double cpu0 = 0;
+    double cpu = 0;
+    double t_end = 0;
+    int n = 0;
+
+    if (open_mode(&rx, mode, port) != 0) {
+        printf("%-9s %8.0f  failed to open\n", mode_name(mode), rate);
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(0);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = rx.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rx.fd, &ev);
+
+    args.rate = rate;
+    args.seconds = seconds;
+    args.port = port;
+    pthread_create(&tid, NULL, sender, &args);
+
+    cpu0 = thread_cpu_s();
+    /* Drain for a little while after the sender stops */
+    t_end = now_s() + seconds + 0.2;
+    while (now_s() < t_end) {
+        if (epoll_wait(epoll_fd, &ev, 1, 10) <= 0) {
+            continue;
+        }
+        while ((n = tmif_rx_recv(&rx)) > 0) {
+            received += n;
+        }
+    }
+    cpu = thread_cpu_s() - cpu0;
+
+    pthread_join(tid, NULL);
+    lost = (args.sent > received) ? (args.sent - received) : 0;
+
+    printf("%-9s %8.0f %9llu %9llu %7llu %10.2f %9.2f %8.1f%%\n\n",
+           mode_name(rx.mode), rate,
+           (unsigned long long)args.sent, (unsigned long long)received,
+           (unsigned long long)lost,
+           received ? 1e6*cpu/(double)received : 0.0,
+           rx.calls ? (double)rx.packets/(double)rx.calls : 0.0,
+           100.0*cpu/(seconds + 0.2));
+
+    close(epoll_fd);
+    tmif_rx_close(&rx);
+
+    return 0;
+}
+
+static int parse_mode(const char *s, tmif_rx_mode_t *mode) {
+    if (strcmp(s, "recvfrom") == 0) {
+        *mode = TMIF_RX_RECVFROM;
+    } else if (strcmp(s, "mmsg") == 0) {
+        *mode = TMIF_RX_MMSG;
+    } else if (strcmp(s, "ring") == 0) {
+        *mode = TMIF_RX_RING;
+    } else if (strcmp(s, "uring") == 0) {
+        *mode = TMIF_RX_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    tmif_rx_mode_t modes[BENCH_MAX_MODES] = { TMIF_RX_RECVFROM, TMIF_RX_URING };
+    double rates[BENCH_MAX_RATES] = { 5000, 50000, 200000 };
+    int n_modes = 0;
+    int n_rates = 0;
+    double seconds = 2.0;
+    uint16_t port = BENCH_PORT;
+    int opt = 0;
+    int i = 0;
+    int j = 0;
+
+    while ((opt = getopt(argc, argv, "m:r:d:P:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if ((n_modes >= BENCH_MAX_MODES) || (parse_mode(optarg, &modes[n_modes]) < 0)) {
+                printf("bad mode: %s\n", optarg);
+                return -1;
+            }
+            n_modes++;
+            break;
+        case 'r':
+            if (n_rates < BENCH_MAX_RATES) {
+                rates[n_rates++] = atof(optarg);
+            }
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'P':
+            port = (uint16_t)atoi(optarg);
+            break;
+        default:
+            printf("usage: bench_rx [-m recvfrom|mmsg|ring|uring]... [-r pkts/s]... [-d seconds] [-P port]\n");
+            return -1;
+        }
+    }
+    if (n_modes == 0) {
+        n_modes = 2;
+    }
+    if (n_rates == 0) {
+        n_rates = 3;
+    }
+
+    printf("%-9s %8s %9s %9s %7s %10s %9s %9s\n",
+           "mode", "rate", "sent", "received", "lost", "cpu us/pkt", "pkts/call", "cpu");
+    for (i = 0; i < n_modes; i++) {
+        for (j = 0; j < n_rates; j++) {
+            run(modes[i], rates[j], seconds, port);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,618 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Bulk export of a packet table to a flat columnar event file (see
+   tmif_evt.h) for ground analysis. The table is cut into ranges of
+   EXPORT_RANGE_ROWS rows (one table chunk). This thread reads the
+   ranges in order into a ring of buffers, the only caller of HDF5,
+   while a pool of workers unpacks the x, y, phd triples and pwrite()s
+   each range's events straight to their final place in every column.
+   Where a range's events go comes from the photon counts in the packet
+   index (CHESS_INDEX), or from a counting pass over the table for
+   files from before the index.
+
+   Compressed tables (tmif -z, shuffle+deflate in EXPORT_RANGE_ROWS
+   chunks) are read a chunk at a time with H5Dread_chunk(), still
+   compressed, and the workers inflate them, so the reader is only ever
+   waiting on the disk.
+
+   h5export chess_flight_data.h5 chess_flight_data.evt
+   h5export -j 8 -s 1 chess_flight_data.h5 stream1.evt
+*/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <hdf5.h>
+
+#include "tmif_hdf5.h"
+#include "tmif_h5z.h"
+#include "tmif_h5ix.h"
+#include "tmif_evt.h"
+
+/* Table rows per range */
+#define EXPORT_RANGE_ROWS TMIF_H5_CHUNK_RECS
+/* Most worker threads */
+#define EXPORT_MAX_THREADS 64
+/* Read buffers per worker, so the reader can run ahead */
+#define EXPORT_BUFS_PER_THREAD 2
+/* Index rows read at a time */
+#define EXPORT_IX_ROWS 4096
+#define EXPORT_MAX_PHOTONS ((CHESS_PACKET_LEN - 3)/3)
+
+typedef enum {
+    BUF_FREE = 0,
+    BUF_FULL,
+    BUF_BUSY
+} buf_state_t;
+
+/* One range read from the table, waiting for or being decoded. With
+   raw set it's still the filtered chunk, raw_len bytes of raw. */
+typedef struct {
+    buf_state_t state;
+    uint64_t range;
+    size_t n;
+    int raw_set;
+    uint8_t *raw;
+    size_t raw_len;
+    size_t raw_cap;
+    uint32_t filter_mask;
+    chess_word_packet_t recs[EXPORT_RANGE_ROWS];
+} export_buf_t;
+
+/* One worker's decoded columns */
+typedef struct {
+    pthread_t tid;
+    uint16_t x[EXPORT_RANGE_ROWS*EXPORT_MAX_PHOTONS];
+    uint16_t y[EXPORT_RANGE_ROWS*EXPORT_MAX_PHOTONS];
+    uint16_t phd[EXPORT_RANGE_ROWS*EXPORT_MAX_PHOTONS];
+    int64_t rx_ns[EXPORT_RANGE_ROWS*EXPORT_MAX_PHOTONS];
+    uint8_t scratch[EXPORT_RANGE_ROWS*sizeof(chess_word_packet_t)];
+    double cpu_s;
+} export_worker_t;
+
+static export_buf_t *bufs;
+static int n_bufs = 0;
+static export_worker_t *workers;
+static int n_workers = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t full_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+static int reading_done = 0;
+/* Table is tmif's shuffle+deflate layout, read chunks raw */
+static int raw_chunks = 0;
+
+static int out_fd = -1;
+static tmif_evt_header_t hdr;
+/* Events in each range and where the range's events start */
+static uint64_t *range_events;
+static uint64_t *range_first;
+static uint64_t n_ranges = 0;
+
+static struct {
+    double read_s;
+    double wait_s;
+    uint64_t events;
+    uint64_t mismatched;
+    uint64_t bad_chunks;
+    uint64_t raw_reads;
+    uint64_t write_errors;
+} ex_stats;
+
+
+static double mono_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static double thread_cpu_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int photons(uint16_t n) {
+    return (n > EXPORT_MAX_PHOTONS) ? EXPORT_MAX_PHOTONS : n;
+}
+
+/* Events per range from the index's photon counts. Fails (so the
+   table gets counted instead) unless the index covers every row. */
+static int count_from_index(hid_t fid, const char *name, hsize_t n_rows) {
+    static tmif_h5ix_rec_t ix[EXPORT_IX_ROWS];
+    hid_t dset;
+    hid_t space;
+    hid_t tid;
+    hsize_t dims[1] = {0};
+    hsize_t start = 0;
+    hsize_t n = 0;
+    hsize_t i = 0;
+    uint64_t indexed = 0;
+
+    if (H5Lexists(fid, name, H5P_DEFAULT) <= 0) {
+        return -1;
+    }
+    dset = H5Dopen2(fid, name, H5P_DEFAULT);
+    if (dset < 0) {
+        return -1;
+    }
+    space = H5Dget_space(dset);
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+    tid = tmif_h5ix_type();
+
+    for (start = 0; start < dims[0]; start += n) {
+        n = dims[0] - start;
+        if (n > EXPORT_IX_ROWS) {
+            n = EXPORT_IX_ROWS;
+        }
+        if (tmif_h5_read_slab(dset, tid, start, n, ix) < 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if ((ix[i].row >= 0) && ((hsize_t)ix[i].row < n_rows)) {
+                range_events[ix[i].row/EXPORT_RANGE_ROWS] += photons(ix[i].n_photons);
+                indexed++;
+            }
+        }
+    }
+    H5Tclose(tid);
+    H5Dclose(dset);
+
+    if (indexed != n_rows) {
+        printf("%s covers %llu of %llu rows, counting the table instead\n", name,
+               (unsigned long long)indexed, (unsigned long long)n_rows);
+        memset(range_events, 0, n_ranges*sizeof(uint64_t));
+        return -1;
+    }
+    return 0;
+}
+
+/* Events per range the slow way, reading every row */
+static int count_from_table(hid_t dset, hid_t rec_tid, hsize_t n_rows) {
+    static chess_word_packet_t recs[EXPORT_RANGE_ROWS];
+    uint64_t r = 0;
+    hsize_t n = 0;
+    hsize_t i = 0;
+
+    for (r = 0; r < n_ranges; r++) {
+        n = n_rows - r*EXPORT_RANGE_ROWS;
+        if (n > EXPORT_RANGE_ROWS) {
+            n = EXPORT_RANGE_ROWS;
+        }
+        if (tmif_h5_read_slab(dset, rec_tid, r*EXPORT_RANGE_ROWS, n, recs) < 0) {
+            printf("failed to read rows %llu+%llu\n",
+                   (unsigned long long)(r*EXPORT_RANGE_ROWS), (unsigned long long)n);
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            range_events[r] += photons(recs[i].packet[0]);
+        }
+    }
+    return 0;
+}
+
+/* pwrite() all of len, retrying short writes */
+static int write_at(const void *buf, size_t len, off_t off) {
+    const uint8_t *p = buf;
+    ssize_t w = 0;
+
+    while (len > 0) {
+        w = pwrite(out_fd, p, len, off);
+        if (w <= 0) {
+            perror("pwrite() event file");
+            return -1;
+        }
+        p += w;
+        len -= w;
+        off += w;
+    }
+    return 0;
+}
+
+/* Unpack one range into the worker's columns and write them out */
+static void decode_range(export_worker_t *w, export_buf_t *b) {
+    const chess_word_packet_t *rec;
+    uint64_t n = 0;
+    uint64_t first = range_first[b->range];
+    size_t i = 0;
+    int n_photons = 0;
+    int j = 0;
+    int error = 0;
+
+    if (b->raw_set &&
+        (tmif_h5z_unfilter((uint8_t *)b->recs, sizeof(b->recs), b->raw, b->raw_len,
+                           b->filter_mask, sizeof(chess_word_packet_t), w->scratch) < 0)) {
+        __atomic_add_fetch(&ex_stats.bad_chunks, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (i = 0; i < b->n; i++) {
+        rec = &b->recs[i];
+        n_photons = photons(rec->packet[0]);
+        if ((n + n_photons) > range_events[b->range]) {
+            break;
+        }
+        for (j = 0; j < n_photons; j++) {
+            w->x[n] = rec->packet[3 + 3*j];
+            w->y[n] = rec->packet[4 + 3*j];
+            w->phd[n] = rec->packet[5 + 3*j];
+            w->rx_ns[n] = rec->timestamp_ns;
+            n++;
+        }
+    }
+    if ((i < b->n) || (n != range_events[b->range])) {
+        /* The index disagrees with the table, leave the range zeroed
+           rather than spill into the next one */
+        __atomic_add_fetch(&ex_stats.mismatched, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    error += write_at(w->x, n*sizeof(uint16_t), hdr.col_offset[TMIF_EVT_X] + first*sizeof(uint16_t));
+    error += write_at(w->y, n*sizeof(uint16_t), hdr.col_offset[TMIF_EVT_Y] + first*sizeof(uint16_t));
+    error += write_at(w->phd, n*sizeof(uint16_t), hdr.col_offset[TMIF_EVT_PHD] + first*sizeof(uint16_t));
+    error += write_at(w->rx_ns, n*sizeof(int64_t), hdr.col_offset[TMIF_EVT_RX_NS] + first*sizeof(int64_t));
+    if (error) {
+        __atomic_add_fetch(&ex_stats.write_errors, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&ex_stats.events, n, __ATOMIC_RELAXED);
+}
+
+static void *worker_main(void *arg) {
+    export_worker_t *w = arg;
+    export_buf_t *b = NULL;
+    double cpu0 = thread_cpu_s();
+    int i = 0;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        b = NULL;
+        while (!b) {
+            for (i = 0; i < n_bufs; i++) {
+                if (bufs[i].state == BUF_FULL) {
+                    b = &bufs[i];
+                    break;
+                }
+            }
+            if (b || reading_done) {
+                break;
+            }
+            pthread_cond_wait(&full_cond, &lock);
+        }
+        if (!b) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        b->state = BUF_BUSY;
+        pthread_mutex_unlock(&lock);
+
+        decode_range(w, b);
+
+        pthread_mutex_lock(&lock);
+        b->state = BUF_FREE;
+        pthread_cond_signal(&free_cond);
+        pthread_mutex_unlock(&lock);
+    }
+    w->cpu_s = thread_cpu_s() - cpu0;
+
+    return NULL;
+}
+
+/* Does the table have exactly the chunk layout and filters tmif's
+   compression writes (see open_ztable() in tmif_hdf5.c)? */
+static int chunks_are_raw(hid_t dset, hid_t rec_tid) {
+    hsize_t chunk[1] = {0};
+    unsigned int flags = 0;
+    unsigned int cd[4];
+    size_t n_cd = 4;
+    unsigned int fconfig = 0;
+    hid_t dcpl;
+    hid_t dtype;
+    int ok = 0;
+
+    dcpl = H5Dget_create_plist(dset);
+    if (dcpl < 0) {
+        return 0;
+    }
+    ok = (H5Pget_layout(dcpl) == H5D_CHUNKED) &&
+        (H5Pget_chunk(dcpl, 1, chunk) == 1) &&
+        (chunk[0] == EXPORT_RANGE_ROWS) &&
+        (H5Pget_nfilters(dcpl) == 2) &&
+        (H5Pget_filter2(dcpl, 0, &flags, &n_cd, cd, 0, NULL, &fconfig) == H5Z_FILTER_SHUFFLE);
+    n_cd = 4;
+    ok = ok && (H5Pget_filter2(dcpl, 1, &flags, &n_cd, cd, 0, NULL, &fconfig) == H5Z_FILTER_DEFLATE);
+    H5Pclose(dcpl);
+
+    /* Chunk bytes are only records if the file type is the memory one */
+    dtype = H5Dget_type(dset);
+    ok = ok && (H5Tequal(dtype, rec_tid) > 0);
+    H5Tclose(dtype);
+
+    return ok;
+}
+
+/* Read range r as its filtered chunk. -1 (read it the usual way) if
+   the table isn't raw_chunks or the chunk was never written. */
+static int read_chunk(hid_t dset, uint64_t r, export_buf_t *b) {
+    hsize_t off[1];
+    hsize_t size = 0;
+    uint8_t *p;
+
+    b->raw_set = 0;
+    if (!raw_chunks) {
+        return -1;
+    }
+    off[0] = r*EXPORT_RANGE_ROWS;
+    if ((H5Dget_chunk_storage_size(dset, off, &size) < 0) || (size == 0)) {
+        return -1;
+    }
+    if (size > b->raw_cap) {
+        p = realloc(b->raw, size);
+        if (!p) {
+            return -1;
+        }
+        b->raw = p;
+        b->raw_cap = size;
+    }
+    if (H5Dread_chunk(dset, H5P_DEFAULT, off, &b->filter_mask, b->raw) < 0) {
+        return -1;
+    }
+    b->raw_len = size;
+    b->raw_set = 1;
+
+    return 0;
+}
+
+/* Read every range into the buffer ring for the workers */
+static int read_ranges(hid_t dset, hid_t rec_tid, hsize_t n_rows) {
+    export_buf_t *b = NULL;
+    uint64_t r = 0;
+    hsize_t n = 0;
+    double t0 = 0;
+    int i = 0;
+
+    for (r = 0; r < n_ranges; r++) {
+        t0 = mono_s();
+        pthread_mutex_lock(&lock);
+        b = NULL;
+        while (!b) {
+            for (i = 0; i < n_bufs; i++) {
+                if (bufs[i].state == BUF_FREE) {
+                    b = &bufs[i];
+                    break;
+                }
+            }
+            if (!b) {
+                pthread_cond_wait(&free_cond, &lock);
+            }
+        }
+        /* Ours until it's marked full */
+        b->state = BUF_BUSY;
+        pthread_mutex_unlock(&lock);
+        ex_stats.wait_s += mono_s() - t0;
+
+        n = n_rows - r*EXPORT_RANGE_ROWS;
+        if (n > EXPORT_RANGE_ROWS) {
+            n = EXPORT_RANGE_ROWS;
+        }
+        t0 = mono_s();
+        if (read_chunk(dset, r, b) == 0) {
+            ex_stats.raw_reads++;
+        } else if (tmif_h5_read_slab(dset, rec_tid, r*EXPORT_RANGE_ROWS, n, b->recs) < 0) {
+            printf("failed to read rows %llu+%llu\n",
+                   (unsigned long long)(r*EXPORT_RANGE_ROWS), (unsigned long long)n);
+            pthread_mutex_lock(&lock);
+            b->state = BUF_FREE;
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        ex_stats.read_s += mono_s() - t0;
+        b->range = r;
+        b->n = n;
+
+        pthread_mutex_lock(&lock);
+        b->state = BUF_FULL;
+        pthread_cond_signal(&full_cond);
+        pthread_mutex_unlock(&lock);
+    }
+    return 0;
+}
+
+/* Column layout for n events, returns the file size */
+static off_t lay_out(uint64_t n_events, uint64_t n_packets) {
+    const char *names[TMIF_EVT_COLS] = {"x", "y", "phd", "rx_ns"};
+    const uint32_t sizes[TMIF_EVT_COLS] = {sizeof(uint16_t), sizeof(uint16_t),
+                                           sizeof(uint16_t), sizeof(int64_t)};
+    uint64_t off = TMIF_EVT_ALIGN;
+    int col = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TMIF_EVT_MAGIC, sizeof(hdr.magic));
+    hdr.version = TMIF_EVT_VERSION;
+    hdr.n_cols = TMIF_EVT_COLS;
+    hdr.n_events = n_events;
+    hdr.n_packets = n_packets;
+    for (col = 0; col < TMIF_EVT_COLS; col++) {
+        strncpy(hdr.col_name[col], names[col], sizeof(hdr.col_name[col]));
+        hdr.col_size[col] = sizes[col];
+        hdr.col_offset[col] = off;
+        off += n_events*sizes[col];
+        off = (off + TMIF_EVT_ALIGN - 1) & ~((uint64_t)TMIF_EVT_ALIGN - 1);
+    }
+    return (off_t)off;
+}
+
+int main(int argc, char **argv) {
+    static uint8_t hdr_block[TMIF_EVT_ALIGN];
+    char table[64];
+    char index[64];
+    int stream = 0;
+    int threads = 0;
+    hid_t fid;
+    hid_t dset;
+    hid_t space;
+    hid_t rec_tid;
+    hsize_t dims[1] = {0};
+    uint64_t total = 0;
+    uint64_t r = 0;
+    off_t size = 0;
+    double t0 = 0;
+    double t_count = 0;
+    double wall = 0;
+    double cpu = 0;
+    int errors = 0;
+    int opt = 0;
+    int i = 0;
+
+    while ((opt = getopt(argc, argv, "j:s:h")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 's':
+            stream = atoi(optarg);
+            break;
+        default:
+            printf("usage: h5export [-j threads] [-s stream] archive.h5 out.evt\n");
+            return -1;
+        }
+    }
+    if ((argc - optind) != 2) {
+        printf("usage: h5export [-j threads] [-s stream] archive.h5 out.evt\n");
+        return -1;
+    }
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > EXPORT_MAX_THREADS) {
+        threads = EXPORT_MAX_THREADS;
+    }
+    if (stream == 0) {
+        snprintf(table, sizeof(table), "%s", TABLE_NAME);
+        snprintf(index, sizeof(index), "%s", INDEX_TABLE_NAME);
+    } else {
+        snprintf(table, sizeof(table), "%s_%d", TABLE_NAME, stream);
+        snprintf(index, sizeof(index), "%s_%d", INDEX_TABLE_NAME, stream);
+    }
+
+    t0 = mono_s();
+    fid = H5Fopen(argv[optind], H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (fid < 0) {
+        printf("can't open %s\n", argv[optind]);
+        return -1;
+    }
+    dset = H5Dopen2(fid, table, H5P_DEFAULT);
+    if (dset < 0) {
+        printf("no table %s in %s\n", table, argv[optind]);
+        H5Fclose(fid);
+        return -1;
+    }
+    space = H5Dget_space(dset);
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+    rec_tid = tmif_h5_rec_type();
+    raw_chunks = chunks_are_raw(dset, rec_tid);
+
+    /* Where each range's events go */
+    n_ranges = (dims[0] + EXPORT_RANGE_ROWS - 1)/EXPORT_RANGE_ROWS;
+    range_events = calloc(n_ranges + 1, sizeof(uint64_t));
+    range_first = calloc(n_ranges + 1, sizeof(uint64_t));
+    if (!range_events || !range_first) {
+        printf("Failed to allocate range table\n");
+        return -1;
+    }
+    if ((count_from_index(fid, index, dims[0]) < 0) &&
+        (count_from_table(dset, rec_tid, dims[0]) < 0)) {
+        return -1;
+    }
+    for (r = 0; r < n_ranges; r++) {
+        range_first[r] = total;
+        total += range_events[r];
+    }
+    t_count = mono_s() - t0;
+
+    out_fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("open() event file");
+        return -1;
+    }
+    size = lay_out(total, dims[0]);
+    if (ftruncate(out_fd, size) != 0) {
+        perror("ftruncate() event file");
+        return -1;
+    }
+
+    n_workers = threads;
+    n_bufs = threads*EXPORT_BUFS_PER_THREAD + 1;
+    bufs = calloc(n_bufs, sizeof(export_buf_t));
+    workers = calloc(n_workers, sizeof(export_worker_t));
+    if (!bufs || !workers) {
+        printf("Failed to allocate export buffers\n");
+        return -1;
+    }
+    for (i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0) {
+            printf("Failed to start export worker\n");
+            return -1;
+        }
+    }
+
+    if (read_ranges(dset, rec_tid, dims[0]) < 0) {
+        errors++;
+    }
+    pthread_mutex_lock(&lock);
+    reading_done = 1;
+    pthread_cond_broadcast(&full_cond);
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < n_workers; i++) {
+        pthread_join(workers[i].tid, NULL);
+        cpu += workers[i].cpu_s;
+    }
+
+    /* Header last, a file cut short has no magic */
+    if (ex_stats.mismatched || ex_stats.bad_chunks || ex_stats.write_errors) {
+        errors++;
+    }
+    if (errors == 0) {
+        memcpy(hdr_block, &hdr, sizeof(hdr));
+        if ((write_at(hdr_block, sizeof(hdr_block), 0) < 0) || (fsync(out_fd) != 0)) {
+            errors++;
+        }
+    }
+    close(out_fd);
+    wall = mono_s() - t0;
+
+    printf("%s: %llu packets, %llu events to %s (%.1f MB)\n", table,
+           (unsigned long long)dims[0], (unsigned long long)ex_stats.events,
+           argv[optind + 1], size/1e6);
+    printf("%.2f s: %.1f MB/s of packets in, counting %.2f s, reading %.2f s, "
+           "reader waited %.2f s\n", wall, dims[0]*(double)sizeof(chess_word_packet_t)/wall/1e6,
+           t_count, ex_stats.read_s, ex_stats.wait_s);
+    printf("%d workers, %s cpu %.2f s, %llu of %llu ranges read as raw chunks\n",
+           n_workers, raw_chunks ? "inflate+decode+write" : "decode+write", cpu,
+           (unsigned long long)ex_stats.raw_reads, (unsigned long long)n_ranges);
+    printf("ranges not matching the index %llu, bad chunks %llu, write errors %llu\n",
+           (unsigned long long)ex_stats.mismatched, (unsigned long long)ex_stats.bad_chunks,
+           (unsigned long long)ex_stats.write_errors);
+
+    for (i = 0; i < n_bufs; i++) {
+        free(bufs[i].raw);
+    }
+    free(bufs);
+    free(workers);
+    free(range_events);
+    free(range_first);
+    H5Tclose(rec_tid);
+    H5Dclose(dset);
+    H5Fclose(fid);
+
+    return errors ? -1 : 0;
+}
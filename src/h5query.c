@@ -0,0 +1,468 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Pull every photon in a time or sequence range out of tmif archive
+   files. The packet index (CHESS_INDEX) is binary searched for the
+   range, a sequence lookup tries the dense O(1) position first, and
+   only the packet table rows the index points at are read, in
+   hyperslabs of consecutive rows, so a query touches a handful of
+   chunks however big the file is. Files (rotated runs) whose first and
+   last index rows are outside the range are skipped.
+
+   h5query -t 1700000000.5:1700000001.5 chess_flight_data_00*.h5
+   h5query -r 10:12 chess_flight_data.h5        seconds from the first packet
+   h5query -q 5000:5999 -c chess_flight_data.h5 count only
+
+   Output is one photon per line: seq rx_ns x y phd (raw words).
+
+   -b n runs n random queries of -w seconds instead and prints the
+   latency, for the latency vs file size curve:
+
+   for n in 100000 1000000 4000000; do
+       ./bench_h5 -n $n -r 5000 -p 20 -f /tmp/q.h5 && ./h5query -b 200 -w 1 /tmp/q.h5
+   done
+
+   Sequence queries assume one run per file (see tmif_h5ix.h), time
+   queries work across runs.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <hdf5.h>
+
+#include "tmif_hdf5.h"
+#include "tmif_h5ix.h"
+
+/* Index rows read at a time walking a range */
+#define H5QUERY_IX_ROWS 4096
+/* Most packet records read at a time */
+#define H5QUERY_PKT_ROWS 256
+/* Default benchmark query width in seconds */
+#define H5QUERY_BENCH_WIDTH 1.0
+/* Most photons a packet record holds */
+#define H5QUERY_MAX_PHOTONS ((CHESS_PACKET_LEN - 3)/3)
+
+
+/* One open archive file */
+typedef struct {
+    const char *name;
+    hid_t fid;
+    hid_t ix;
+    hid_t pkts;
+    hsize_t n_ix;
+    tmif_h5ix_rec_t first;
+    tmif_h5ix_rec_t last;
+} qfile_t;
+
+/* What's asked for: rows whose key (rx_ns or seq) is in [lo, hi] */
+typedef struct {
+    int by_seq;
+    uint64_t lo;
+    uint64_t hi;
+    /* index only, no packet reads */
+    int count_only;
+    /* read the photons but don't print them */
+    int quiet;
+    uint64_t photons;
+    uint64_t packets;
+    uint64_t lost;
+    uint64_t ix_reads;
+    uint64_t pkt_reads;
+} query_t;
+
+static hid_t ix_tid;
+static hid_t rec_tid;
+
+
+static int64_t mono_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t ix_key(const query_t *q, const tmif_h5ix_rec_t *rec) {
+    return q->by_seq ? rec->seq : (uint64_t)rec->rx_ns;
+}
+
+static int read_ix(qfile_t *f, query_t *q, hsize_t i, tmif_h5ix_rec_t *rec) {
+    q->ix_reads++;
+    return tmif_h5_read_slab(f->ix, ix_tid, i, 1, rec);
+}
+
+/* First index row with key >= key (n_ix if none) */
+static hsize_t lower_bound(qfile_t *f, query_t *q, uint64_t key) {
+    tmif_h5ix_rec_t rec;
+    hsize_t lo = 0;
+    hsize_t hi = f->n_ix;
+    hsize_t mid = 0;
+
+    /* A dense run puts seq s at s - first seq */
+    if (q->by_seq && (key >= f->first.seq) && ((key - f->first.seq) < f->n_ix)) {
+        mid = key - f->first.seq;
+        if ((read_ix(f, q, mid, &rec) == 0) && (rec.seq == key)) {
+            return mid;
+        }
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (read_ix(f, q, mid, &rec) < 0) {
+            return f->n_ix;
+        }
+        if (ix_key(q, &rec) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* A packet's photon count, limited to what fits in it */
+static int photons(uint16_t n) {
+    return (n > H5QUERY_MAX_PHOTONS) ? H5QUERY_MAX_PHOTONS : n;
+}
+
+static void print_photons(const chess_word_packet_t *rec, uint64_t seq) {
+    int n_photons = photons(rec->packet[0]);
+    int i = 0;
+
+    for (i = 0; i < n_photons; i++) {
+        printf("%llu %lld %u %u %u\n", (unsigned long long)seq, (long long)rec->timestamp_ns,
+               rec->packet[3 + 3*i], rec->packet[4 + 3*i], rec->packet[5 + 3*i]);
+    }
+}
+
+/* Read the packet records for n index rows, each run of consecutive
+   rows in one hyperslab */
+static int read_packets(qfile_t *f, query_t *q, tmif_h5ix_rec_t *ix, size_t n) {
+    static chess_word_packet_t recs[H5QUERY_PKT_ROWS];
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+
+    for (i = 0; i < n; i++) {
+        if (ix[i].row == TMIF_H5IX_LOST) {
+            q->lost++;
+        }
+    }
+
+    i = 0;
+    while (i < n) {
+        if (ix[i].row < 0) {
+            i++;
+            continue;
+        }
+        /* Rows with photons are consecutive in the table apart from
+           the odd late packet, extend the run over empty ones */
+        j = i + 1;
+        k = 1;
+        while ((j < n) && (k < H5QUERY_PKT_ROWS)) {
+            if (ix[j].row >= 0) {
+                if (ix[j].row != (ix[i].row + (int64_t)k)) {
+                    break;
+                }
+                k++;
+            }
+            j++;
+        }
+        q->packets += k;
+
+        if (q->count_only) {
+            for (; i < j; i++) {
+                if (ix[i].row >= 0) {
+                    q->photons += photons(ix[i].n_photons);
+                }
+            }
+            continue;
+        }
+
+        q->pkt_reads++;
+        if (tmif_h5_read_slab(f->pkts, rec_tid, ix[i].row, k, recs) < 0) {
+            printf("failed to read rows %lld+%zu of %s\n", (long long)ix[i].row, k, f->name);
+            return -1;
+        }
+        for (k = 0; i < j; i++) {
+            if (ix[i].row < 0) {
+                continue;
+            }
+            q->photons += photons(recs[k].packet[0]);
+            if (!q->quiet) {
+                print_photons(&recs[k], ix[i].seq);
+            }
+            k++;
+        }
+    }
+    return 0;
+}
+
+/* Run the query on one file */
+static int query_file(qfile_t *f, query_t *q) {
+    static tmif_h5ix_rec_t ix[H5QUERY_IX_ROWS];
+    hsize_t start = 0;
+    hsize_t n = 0;
+    size_t m = 0;
+
+    if ((f->n_ix == 0) || (ix_key(q, &f->last) < q->lo) || (ix_key(q, &f->first) > q->hi)) {
+        return 0;
+    }
+
+    start = lower_bound(f, q, q->lo);
+    while (start < f->n_ix) {
+        n = f->n_ix - start;
+        if (n > H5QUERY_IX_ROWS) {
+            n = H5QUERY_IX_ROWS;
+        }
+        q->ix_reads++;
+        if (tmif_h5_read_slab(f->ix, ix_tid, start, n, ix) < 0) {
+            printf("failed to read index of %s\n", f->name);
+            return -1;
+        }
+        for (m = 0; (m < n) && (ix_key(q, &ix[m]) <= q->hi); m++) {
+        }
+        if (read_packets(f, q, ix, m) < 0) {
+            return -1;
+        }
+        if (m < n) {
+            break;
+        }
+        start += n;
+    }
+    return 0;
+}
+
+static int open_file(const char *name, qfile_t *f) {
+    hid_t space;
+    hsize_t dims[1] = {0};
+
+    memset(f, 0, sizeof(*f));
+    f->name = name;
+    f->fid = H5Fopen(name, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (f->fid < 0) {
+        /* Still being written */
+        f->fid = H5Fopen(name, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
+    }
+    if (f->fid < 0) {
+        printf("can't open %s\n", name);
+        return -1;
+    }
+    f->ix = H5Dopen2(f->fid, INDEX_TABLE_NAME, H5P_DEFAULT);
+    f->pkts = H5Dopen2(f->fid, TABLE_NAME, H5P_DEFAULT);
+    if ((f->ix < 0) || (f->pkts < 0)) {
+        printf("%s has no %s (archived before the index?)\n", name, INDEX_TABLE_NAME);
+        H5Fclose(f->fid);
+        return -1;
+    }
+    space = H5Dget_space(f->ix);
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+    f->n_ix = dims[0];
+    if (f->n_ix > 0) {
+        tmif_h5_read_slab(f->ix, ix_tid, 0, 1, &f->first);
+        tmif_h5_read_slab(f->ix, ix_tid, f->n_ix - 1, 1, &f->last);
+    }
+    return 0;
+}
+
+static void close_file(qfile_t *f) {
+    H5Dclose(f->ix);
+    H5Dclose(f->pkts);
+    H5Fclose(f->fid);
+}
+
+static int cmp_ns(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Random time queries of width seconds over the files' span */
+static int bench(qfile_t *files, int n_files, int n_queries, double width) {
+    query_t q;
+    int64_t *lat;
+    int64_t t0 = 0;
+    int64_t span_lo = files[0].first.rx_ns;
+    int64_t span_hi = files[n_files - 1].last.rx_ns;
+    int64_t w = (int64_t)(width*1e9);
+    double sum = 0;
+    uint64_t photons = 0;
+    uint64_t ix_reads = 0;
+    uint64_t pkt_reads = 0;
+    uint64_t indexed = 0;
+    off_t bytes = 0;
+    struct stat st;
+    int i = 0;
+    int j = 0;
+
+    lat = calloc(n_queries, sizeof(int64_t));
+    if (!lat || (span_hi <= span_lo)) {
+        printf("nothing to query\n");
+        free(lat);
+        return -1;
+    }
+    for (j = 0; j < n_files; j++) {
+        if (stat(files[j].name, &st) == 0) {
+            bytes += st.st_size;
+        }
+        indexed += files[j].n_ix;
+    }
+
+    srand(1);
+    for (i = 0; i < n_queries; i++) {
+        memset(&q, 0, sizeof(q));
+        q.quiet = 1;
+        q.lo = span_lo + (int64_t)((span_hi - span_lo - w)*(rand()/(double)RAND_MAX));
+        q.hi = q.lo + w;
+
+        t0 = mono_ns();
+        for (j = 0; j < n_files; j++) {
+            if (query_file(&files[j], &q) < 0) {
+                free(lat);
+                return -1;
+            }
+        }
+        lat[i] = mono_ns() - t0;
+        sum += lat[i];
+        photons += q.photons;
+        ix_reads += q.ix_reads;
+        pkt_reads += q.pkt_reads;
+    }
+    qsort(lat, n_queries, sizeof(int64_t), cmp_ns);
+
+    fprintf(stderr, "%d files, %.1f MB, %llu packets indexed over %.1f s\n", n_files,
+            bytes/1e6, (unsigned long long)indexed,
+            (span_hi - span_lo)*1e-9);
+    fprintf(stderr, "%d queries of %.3f s: mean %.2f ms, p50 %.2f ms, p99 %.2f ms, "
+            "max %.2f ms\n", n_queries, width, sum/n_queries*1e-6,
+            lat[n_queries/2]*1e-6, lat[(n_queries*99)/100]*1e-6, lat[n_queries - 1]*1e-6);
+    fprintf(stderr, "per query: %.0f photons, %.1f index reads, %.1f packet reads\n",
+            (double)photons/n_queries, (double)ix_reads/n_queries,
+            (double)pkt_reads/n_queries);
+    free(lat);
+
+    return 0;
+}
+
+/* "a:b" into two numbers */
+static int parse_range(const char *arg, double *a, double *b) {
+    char *end;
+
+    *a = strtod(arg, &end);
+    if (*end != ':') {
+        return -1;
+    }
+    *b = strtod(end + 1, &end);
+    return (*end == '\0') ? 0 : -1;
+}
+
+static void usage(void) {
+    printf("usage: h5query (-t t0:t1 | -r s0:s1 | -q seq0:seq1) [-c] file...\n");
+    printf("       h5query -b queries [-w seconds] file...\n");
+    printf("  -t  receive time range, seconds since the epoch\n");
+    printf("  -r  receive time range, seconds from the first packet\n");
+    printf("  -q  sequence number range\n");
+    printf("  -c  count photons and packets only\n");
+    printf("  -b  benchmark this many random -w second queries (default %.0f s)\n",
+           H5QUERY_BENCH_WIDTH);
+}
+
+int main(int argc, char **argv) {
+    qfile_t *files;
+    query_t q;
+    double a = 0;
+    double b = 0;
+    double width = H5QUERY_BENCH_WIDTH;
+    int mode = 0;
+    int n_bench = 0;
+    int n_files = 0;
+    int errors = 0;
+    int opt = 0;
+    int i = 0;
+
+    memset(&q, 0, sizeof(q));
+    while ((opt = getopt(argc, argv, "t:r:q:cb:w:h")) != -1) {
+        switch (opt) {
+        case 't':
+        case 'r':
+        case 'q':
+            if (parse_range(optarg, &a, &b) < 0) {
+                usage();
+                return -1;
+            }
+            mode = opt;
+            break;
+        case 'c':
+            q.count_only = 1;
+            break;
+        case 'b':
+            n_bench = atoi(optarg);
+            break;
+        case 'w':
+            width = atof(optarg);
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if ((optind >= argc) || ((mode == 0) && (n_bench <= 0))) {
+        usage();
+        return -1;
+    }
+
+    ix_tid = tmif_h5ix_type();
+    rec_tid = tmif_h5_rec_type();
+    files = calloc(argc - optind, sizeof(qfile_t));
+    if (!files) {
+        return -1;
+    }
+    for (i = optind; i < argc; i++) {
+        if (open_file(argv[i], &files[n_files]) == 0) {
+            n_files++;
+        }
+    }
+    if (n_files == 0) {
+        return -1;
+    }
+
+    if (n_bench > 0) {
+        errors = bench(files, n_files, n_bench, width) ? 1 : 0;
+    } else {
+        if (mode == 'q') {
+            q.by_seq = 1;
+            q.lo = (uint64_t)a;
+            q.hi = (uint64_t)b;
+        } else if (mode == 'r') {
+            q.lo = files[0].first.rx_ns + (int64_t)(a*1e9);
+            q.hi = files[0].first.rx_ns + (int64_t)(b*1e9);
+        } else {
+            q.lo = (int64_t)(a*1e9);
+            q.hi = (int64_t)(b*1e9);
+        }
+        for (i = 0; i < n_files; i++) {
+            if (query_file(&files[i], &q) < 0) {
+                errors++;
+            }
+        }
+        fprintf(stderr, "%llu photons in %llu packets (%llu lost in range), "
+                "%llu index reads, %llu packet reads\n",
+                (unsigned long long)q.photons, (unsigned long long)q.packets,
+                (unsigned long long)q.lost, (unsigned long long)q.ix_reads,
+                (unsigned long long)q.pkt_reads);
+    }
+
+    for (i = 0; i < n_files; i++) {
+        close_file(&files[i]);
+    }
+    H5Tclose(ix_tid);
+    H5Tclose(rec_tid);
+    free(files);
+
+    return errors ? -1 : 0;
+}
@@ -0,0 +1,178 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Quicklook tail of a live tmif archive. Opens the file as an SWMR
+   reader while tmif writes it and prints the rows appended to a
+   packet table as they land, with how far behind the kernel receive
+   time each batch is. Ctrl-C prints the lag seen overall.
+
+   h5tail                           summary line per poll of CHESS_PACKETS
+   h5tail -v                        one line per packet
+   h5tail -f /tmp/bench_h5.h5 -s 1 -i 50
+*/
+
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <hdf5.h>
+
+#include "tmif_hdf5.h"
+
+/* Default poll interval */
+#define H5TAIL_POLL_MS 100
+/* Most rows read at a time */
+#define H5TAIL_READ_ROWS 1024
+
+
+static volatile sig_atomic_t running = 1;
+
+static void on_sigint(int sig) {
+    running = 0;
+}
+
+static int64_t real_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    static chess_word_packet_t recs[H5TAIL_READ_ROWS];
+    const char *file = FILE_NAME;
+    char table[64];
+    int stream = 0;
+    int poll_ms = H5TAIL_POLL_MS;
+    int verbose = 0;
+    int from_start = 0;
+    hid_t fid;
+    hid_t dset;
+    hid_t space;
+    hid_t rec_tid;
+    hsize_t dims[1];
+    hsize_t seen = 0;
+    hsize_t n = 0;
+    int64_t now = 0;
+    int64_t lag = 0;
+    int64_t lag_max = 0;
+    double lag_sum = 0;
+    uint64_t batches = 0;
+    uint64_t rows = 0;
+    hsize_t i = 0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "f:s:i:vah")) != -1) {
+        switch (opt) {
+        case 'f':
+            file = optarg;
+            break;
+        case 's':
+            stream = atoi(optarg);
+            break;
+        case 'i':
+            poll_ms = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'a':
+            from_start = 1;
+            break;
+        default:
+            printf("usage: h5tail [-f file] [-s stream] [-i poll ms] [-v] [-a]\n");
+            printf("  -v  print every packet, -a start from the first row\n");
+            return -1;
+        }
+    }
+    if (stream == 0) {
+        snprintf(table, sizeof(table), "%s", TABLE_NAME);
+    } else {
+        snprintf(table, sizeof(table), "%s_%d", TABLE_NAME, stream);
+    }
+
+    fid = H5Fopen(file, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
+    if (fid < 0) {
+        printf("can't open %s as an SWMR reader (is it an SWMR archive?)\n", file);
+        return -1;
+    }
+    dset = H5Dopen2(fid, table, H5P_DEFAULT);
+    if (dset < 0) {
+        printf("no table %s in %s\n", table, file);
+        H5Fclose(fid);
+        return -1;
+    }
+    rec_tid = tmif_h5_rec_type();
+
+    space = H5Dget_space(dset);
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+    seen = from_start ? 0 : dims[0];
+    printf("tailing %s:%s from row %llu\n", file, table, (unsigned long long)seen);
+
+    signal(SIGINT, on_sigint);
+    signal(SIGTERM, on_sigint);
+    while (running) {
+        if (H5Drefresh(dset) < 0) {
+            break;
+        }
+        space = H5Dget_space(dset);
+        H5Sget_simple_extent_dims(space, dims, NULL);
+        H5Sclose(space);
+
+        while (running && (dims[0] > seen)) {
+            n = dims[0] - seen;
+            if (n > H5TAIL_READ_ROWS) {
+                n = H5TAIL_READ_ROWS;
+            }
+            if (tmif_h5_read_slab(dset, rec_tid, seen, n, recs) < 0) {
+                printf("read of rows %llu+%llu failed\n", (unsigned long long)seen,
+                       (unsigned long long)n);
+                running = 0;
+                break;
+            }
+
+            now = real_ns();
+            if (verbose) {
+                for (i = 0; i < n; i++) {
+                    printf("%llu seq %5u photons %3u rx %lld.%09lld lag %.1f ms\n",
+                           (unsigned long long)(seen + i), recs[i].packet[1], recs[i].packet[0],
+                           (long long)(recs[i].timestamp_ns/1000000000LL),
+                           (long long)(recs[i].timestamp_ns%1000000000LL),
+                           (now - recs[i].timestamp_ns)*1e-6);
+                }
+            }
+
+            /* Lag of the newest row, what a quicklook display would show */
+            lag = now - recs[n - 1].timestamp_ns;
+            if (!verbose) {
+                printf("rows %llu-%llu seq %u-%u lag %.1f ms\n", (unsigned long long)seen,
+                       (unsigned long long)(seen + n - 1), recs[0].packet[1],
+                       recs[n - 1].packet[1], lag*1e-6);
+            }
+            if (!from_start || (seen > 0)) {
+                if (lag > lag_max) {
+                    lag_max = lag;
+                }
+                lag_sum += lag;
+                batches++;
+            }
+            seen += n;
+            rows += n;
+        }
+        fflush(stdout);
+        usleep(poll_ms*1000);
+    }
+
+    printf("h5tail: %llu rows in %llu reads, newest row lag mean %.1f ms max %.1f ms\n",
+           (unsigned long long)rows, (unsigned long long)batches,
+           batches ? lag_sum/batches*1e-6 : 0.0, lag_max*1e-6);
+
+    H5Tclose(rec_tid);
+    H5Dclose(dset);
+    H5Fclose(fid);
+
+    return 0;
+}
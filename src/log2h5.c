@@ -0,0 +1,166 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Convert a tmif archive log (tmif -L) into the usual HDF5 archive,
+   one CHESS_PACKETS table per stream, through the same tmif_hdf5 save
+   path tmif uses. Frames that fail their checksum are skipped and
+   counted, the log ends at the first never-written frame.
+
+   log2h5 chess_flight_data.log chess_flight_data.h5
+   log2h5 -z 4 -e 0.01 chess_flight_data.log events.h5
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmif_hdf5.h"
+#include "tmif_h5z.h"
+#include "tmif_log.h"
+
+/* Frames read per fread() */
+#define LOG2H5_READ_FRAMES 256
+
+
+typedef struct {
+    uint64_t frames;
+    uint64_t bad_crc;
+    uint64_t bad_magic;
+    uint64_t misplaced;
+    int max_stream;
+} scan_t;
+
+static int open_log(const char *path, FILE **fp) {
+    static uint8_t hdr_block[TMIF_LOG_ALIGN];
+    tmif_log_header_t *hdr = (tmif_log_header_t *)hdr_block;
+
+    *fp = fopen(path, "rb");
+    if (!*fp) {
+        perror("fopen() log");
+        return -1;
+    }
+    if ((fread(hdr_block, TMIF_LOG_ALIGN, 1, *fp) != 1) ||
+        (memcmp(hdr->magic, TMIF_LOG_FILE_MAGIC, sizeof(hdr->magic)) != 0)) {
+        printf("%s is not an archive log\n", path);
+        fclose(*fp);
+        return -1;
+    }
+    if ((hdr->version != TMIF_LOG_VERSION) || (hdr->frame_size != TMIF_LOG_FRAME_SIZE)) {
+        printf("%s is version %u with %u byte frames, this log2h5 reads version %d\n",
+               path, hdr->version, hdr->frame_size, TMIF_LOG_VERSION);
+        fclose(*fp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Walk the log, calling save_packets() for every good frame if save */
+static int walk_log(FILE *fp, scan_t *sc, int save) {
+    static tmif_log_frame_t frames[LOG2H5_READ_FRAMES];
+    tmif_log_frame_t *f;
+    int64_t rx_ns = 0;
+    uint64_t seq = 0;
+    uint64_t slot = 0;
+    size_t n = 0;
+    size_t i = 0;
+    int errors = 0;
+
+    memset(sc, 0, sizeof(*sc));
+    while ((n = fread(frames, TMIF_LOG_FRAME_SIZE, LOG2H5_READ_FRAMES, fp)) > 0) {
+        for (i = 0; i < n; i++, slot++) {
+            f = &frames[i];
+            if (f->magic == 0) {
+                /* never written, end of the log */
+                return errors;
+            }
+            if (f->magic != TMIF_LOG_FRAME_MAGIC) {
+                sc->bad_magic++;
+                continue;
+            }
+            if (!tmif_log_frame_ok(f)) {
+                sc->bad_crc++;
+                continue;
+            }
+            if ((f->frame_no != slot) || (f->stream >= TMIF_MAX_STREAMS)) {
+                sc->misplaced++;
+                continue;
+            }
+
+            sc->frames++;
+            if (f->stream > sc->max_stream) {
+                sc->max_stream = f->stream;
+            }
+            if (save) {
+                rx_ns = f->rx_ns;
+                seq = f->seq;
+                errors += save_packets(f->stream, f->packet, &rx_ns, &seq, 1);
+            }
+        }
+    }
+    return errors;
+}
+
+int main(int argc, char **argv) {
+    FILE *fp;
+    scan_t sc;
+    int z_level = 0;
+    int z_workers = TMIF_H5Z_WORKERS_DEFAULT;
+    int errors = 0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "z:Z:e:h")) != -1) {
+        switch (opt) {
+        case 'z':
+            z_level = atoi(optarg);
+            break;
+        case 'Z':
+            z_workers = atoi(optarg);
+            break;
+        case 'e':
+            set_packet_save_events(atof(optarg));
+            break;
+        default:
+            printf("usage: log2h5 [-z level] [-Z workers] [-e raw fraction] log out.h5\n");
+            return -1;
+        }
+    }
+    if ((argc - optind) != 2) {
+        printf("usage: log2h5 [-z level] [-Z workers] [-e raw fraction] log out.h5\n");
+        return -1;
+    }
+
+    /* First pass for the stream count */
+    if (open_log(argv[optind], &fp) < 0) {
+        return -1;
+    }
+    walk_log(fp, &sc, 0);
+    printf("%s: %llu good frames, %d streams, %llu bad checksums, %llu bad magic, "
+           "%llu out of place\n", argv[optind], (unsigned long long)sc.frames,
+           sc.max_stream + 1, (unsigned long long)sc.bad_crc,
+           (unsigned long long)sc.bad_magic, (unsigned long long)sc.misplaced);
+    if (sc.frames == 0) {
+        fclose(fp);
+        return 0;
+    }
+
+    set_packet_save_file(argv[optind + 1]);
+    set_packet_save_policy(TMIF_H5_BLOCK);
+    set_packet_save_compression(z_level, z_workers);
+    if (init_packet_save(sc.max_stream + 1) != 0) {
+        printf("init_packet_save() failed\n");
+        fclose(fp);
+        return -1;
+    }
+
+    fseek(fp, TMIF_LOG_ALIGN, SEEK_SET);
+    errors += walk_log(fp, &sc, 1);
+    fclose(fp);
+
+    errors += close_packet_save();
+    print_packet_save_stats();
+    printf("wrote %llu records to %s, errors %d\n", (unsigned long long)sc.frames,
+           argv[optind + 1], errors);
+
+    return (errors == 0) ? 0 : -1;
+}
@@ -0,0 +1,249 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   CU40MMXS packet generator. Sends synthetic 1470 byte photon packets
+   at a fixed rate so tmif can be exercised on loopback or a veth pair
+   without the detector electronics. Can drop, swap and duplicate
+   packets on the way out to exercise tmif's sequence accounting.
+*/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "tmif_net.h"
+
+/* Datagrams per sendmmsg() call */
+#define GEN_BURST 64
+/* Most photons a 735 word packet can carry */
+#define GEN_MAX_PHOTONS ((CU40MMXS_PACKET_SIZE/2 - 3)/3)
+
+
+static volatile sig_atomic_t loop_switch = 1;
+
+static void signal_handler(int sig) {
+    loop_switch = 0;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+/* Fill one packet with n photons and the given counter */
+static void fill_packet(uint16_t *pkt, uint16_t counter, int n) {
+    int i = 0;
+
+    memset(pkt, 0, CU40MMXS_PACKET_SIZE);
+    pkt[0] = (uint16_t)n;
+    pkt[1] = counter;
+    for (i = 0; i < n; i++) {
+        pkt[3 + 3*i] = (uint16_t)(rand() & 0x3FFF);
+        pkt[4 + 3*i] = (uint16_t)(rand() & 0x3FFF);
+        pkt[5 + 3*i] = (uint16_t)(rand() & 0xFF);
+    }
+}
+
+/* Percent chance, 0-100 */
+static int chance(double pct) {
+    return (pct > 0) && ((rand() % 10000) < (int)(pct*100.0));
+}
+
+/* Lay out one burst of n packets as messages, impaired: packets are
+   dropped (loss), swapped with their successor (swap) or sent twice
+   (dup). Returns the number of messages. */
+static int impair_burst(struct mmsghdr *msgs, struct iovec *iovs, uint16_t pkts[][CU40MMXS_PACKET_SIZE/2],
+                        int n, double loss, double swap, double dup) {
+    struct iovec tmp;
+    int m = 0;
+    int i = 0;
+
+    for (i = 0; i < n; i++) {
+        if (chance(loss)) {
+            continue;
+        }
+        iovs[m].iov_base = pkts[i];
+        m++;
+        if (chance(dup)) {
+            iovs[m].iov_base = pkts[i];
+            m++;
+        }
+    }
+    for (i = 0; i < (m - 1); i++) {
+        if (chance(swap)) {
+            tmp = iovs[i];
+            iovs[i] = iovs[i + 1];
+            iovs[i + 1] = tmp;
+            i++;
+        }
+    }
+    for (i = 0; i < m; i++) {
+        iovs[i].iov_len = CU40MMXS_PACKET_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+    }
+
+    return m;
+}
+
+static void usage(void) {
+    printf("usage: pkt_gen [-H host] [-P port] [-r pkts/s] [-c count] [-p photons]\n");
+    printf("               [-L pct] [-S pct] [-U pct]\n");
+    printf("  -H  destination address (default 127.0.0.1)\n");
+    printf("  -P  destination port (default %d)\n", CU40MMXS_PORT);
+    printf("  -r  packet rate, 0 for as fast as possible (default 1000)\n");
+    printf("  -c  packets to send, 0 for until killed (default 0)\n");
+    printf("  -p  photons per packet, max %d (default 10)\n", GEN_MAX_PHOTONS);
+    printf("  -L  percent of packets to drop\n");
+    printf("  -S  percent of packets to swap with the next one\n");
+    printf("  -U  percent of packets to send twice\n");
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = CU40MMXS_PORT;
+    double rate = 1000.0;
+    uint64_t count = 0;
+    int photons = 10;
+    double loss = 0;
+    double swap = 0;
+    double dup = 0;
+    int opt = 0;
+
+    int sock_fd;
+    struct sockaddr_in sin;
+    static uint16_t pkts[GEN_BURST][CU40MMXS_PACKET_SIZE/2];
+    struct mmsghdr msgs[2*GEN_BURST];
+    struct iovec iovs[2*GEN_BURST];
+    struct sigaction sa_quit;
+
+    uint16_t counter = 0;
+    uint64_t sent = 0;
+    uint64_t due = 0;
+    double t0 = 0;
+    double elapsed = 0;
+    int burst = 0;
+    int n_msgs = 0;
+    int n = 0;
+    int i = 0;
+
+    while ((opt = getopt(argc, argv, "H:P:r:c:p:L:S:U:h")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'P':
+            port = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'c':
+            count = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            photons = atoi(optarg);
+            break;
+        case 'L':
+            loss = atof(optarg);
+            break;
+        case 'S':
+            swap = atof(optarg);
+            break;
+        case 'U':
+            dup = atof(optarg);
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if ((photons < 0) || (photons > GEN_MAX_PHOTONS)) {
+        printf("photons per packet must be 0-%d\n", GEN_MAX_PHOTONS);
+        return -1;
+    }
+
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0) {
+        perror("socket()");
+        return -1;
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+        printf("bad address: %s\n", host);
+        return -1;
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < 2*GEN_BURST; i++) {
+        iovs[i].iov_base = pkts[i % GEN_BURST];
+        iovs[i].iov_len = CU40MMXS_PACKET_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &sin;
+        msgs[i].msg_hdr.msg_namelen = sizeof(sin);
+    }
+
+    memset(&sa_quit, 0, sizeof(sa_quit));
+    sa_quit.sa_handler = &signal_handler;
+    sigaction(SIGINT, &sa_quit, NULL);
+    sigaction(SIGTERM, &sa_quit, NULL);
+
+    t0 = now_s();
+    while (loop_switch && ((count == 0) || (sent < count))) {
+        /* How many packets should be out the door by now */
+        elapsed = now_s() - t0;
+        due = (rate > 0) ? (uint64_t)(elapsed*rate) : (sent + GEN_BURST);
+        if ((count > 0) && (due > count)) {
+            due = count;
+        }
+        if (due <= sent) {
+            usleep(50);
+            continue;
+        }
+
+        burst = (due - sent) > GEN_BURST ? GEN_BURST : (int)(due - sent);
+        for (i = 0; i < burst; i++) {
+            counter++;
+            fill_packet(pkts[i], counter, photons);
+        }
+
+        if ((loss > 0) || (swap > 0) || (dup > 0)) {
+            /* Impaired packets count as sent, losses and all */
+            n_msgs = impair_burst(msgs, iovs, pkts, burst, loss, swap, dup);
+            if ((n_msgs > 0) && (sendmmsg(sock_fd, msgs, n_msgs, 0) < 0)) {
+                perror("sendmmsg()");
+                break;
+            }
+            sent += burst;
+            continue;
+        }
+
+        n = sendmmsg(sock_fd, msgs, burst, 0);
+        if (n < 0) {
+            perror("sendmmsg()");
+            break;
+        }
+        /* Whatever did not go out gets a fresh counter next time */
+        counter -= (burst - n);
+        sent += n;
+    }
+
+    elapsed = now_s() - t0;
+    printf("sent %llu packets in %.3f s (%.0f pkts/s)\n",
+           (unsigned long long)sent, elapsed, elapsed > 0 ? sent/elapsed : 0.0);
+
+    close(sock_fd);
+    return 0;
+}
@@ -0,0 +1,413 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Ground decoder for one telemetry channel's word stream, as captured
+   (16 bit little endian words). Tagged photons, compressed photon
+   frames (tmif -C), packed photons (tmif -P) with the mode frames
+   announcing them, quicklook image and histogram frames (tmif -I) and
+   the zero padding between DMA buffers can be mixed freely. Bad or
+   broken frames and stray words are skipped and counted, decoding
+   picks up at the next good sync.
+
+   tmdecode fifo0.bin                 counts only
+   tmdecode -o photons.bin fifo0.bin  and the photons as tagged words
+
+   The output is the stream as tmif without -C would have sent it,
+   x, y, phd tagged word triples, markers and padding left out, each
+   frame's photons in their (y, x, phd) order. Packed photons come out
+   at the middle of their bins. Packed words before the first mode
+   frame can't be read and are skipped.
+
+   Each quicklook image is summed up on a line, and with -I written
+   out as 6 uint16 (sequence, ms, x bits, y bits, phd shift, 1 if
+   every bin came down), the 2^(x bits + y bits) image bins x fastest
+   and the TMIF_IMG_PHD_BINS histogram bins. Bins that didn't come
+   down are 0.
+
+   tmdecode -I images.bin fifo0.bin
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tmif_enc.h"
+#include "tmif_frm.h"
+#include "tmif_img.h"
+
+/* Photons buffered before a write */
+#define TMDECODE_OUT_PHOTONS 65536
+/* Longest frame there can be */
+#define TMDECODE_MAX_FRAME (0xFFFF + TMIF_FRM_OVERHEAD)
+
+
+typedef struct {
+    uint64_t words;
+    uint64_t photons;
+    uint64_t frames;
+    uint64_t frame_photons;
+    uint64_t frame_words;
+    /* frames with a good CRC that didn't decode, or of other types */
+    uint64_t bad_frames;
+    uint64_t other_frames;
+    uint64_t packed;
+    uint64_t mode_frames;
+    /* packed words with no mode frame before them */
+    uint64_t unannounced;
+    uint64_t img_frames;
+    uint64_t images;
+    uint64_t markers;
+    uint64_t padding;
+    /* words that fit nothing, including failed syncs */
+    uint64_t skipped;
+} tmdecode_stats_t;
+
+static uint16_t out_buf[3*TMDECODE_OUT_PHOTONS];
+static int out_n = 0;
+/* photon mode from the last mode frame, -1 before the first */
+static int mode = -1;
+static tmif_pack_t pack;
+
+/* Quicklook image being put together from its frames */
+typedef struct {
+    int started;
+    uint16_t seq;
+    uint16_t ms;
+    int x_bits;
+    int y_bits;
+    int phd_shift;
+    int got_bins;
+    int got_phd;
+    uint16_t bins[1 << TMIF_IMG_MAX_BITS];
+    uint16_t phd[TMIF_IMG_PHD_BINS];
+} tmdecode_img_t;
+
+static tmdecode_img_t img;
+
+
+static int flush_out(FILE *fp) {
+    if (fp && out_n && (fwrite(out_buf, sizeof(uint16_t), 3*out_n, fp) != (size_t)(3*out_n))) {
+        perror("fwrite()");
+        return -1;
+    }
+    out_n = 0;
+    return 0;
+}
+
+/* Room for n more photons in out_buf */
+static uint16_t *out_photons(FILE *fp, int n) {
+    if ((out_n + n > TMDECODE_OUT_PHOTONS) && (flush_out(fp) < 0)) {
+        return NULL;
+    }
+    out_n += n;
+    return &out_buf[3*(out_n - n)];
+}
+
+/* Sum up the image put together so far and write it to fp */
+static int finish_image(FILE *fp, tmdecode_stats_t *s) {
+    uint16_t hdr[6];
+    uint64_t counts = 0;
+    int n_bins = 1 << (img.x_bits + img.y_bits);
+    int peak = 0;
+    int phd_peak = 0;
+    int i = 0;
+
+    if (!img.started) {
+        return 0;
+    }
+    for (i = 0; i < n_bins; i++) {
+        counts += img.bins[i];
+        if (img.bins[i] > img.bins[peak]) {
+            peak = i;
+        }
+    }
+    for (i = 0; i < TMIF_IMG_PHD_BINS; i++) {
+        if (img.phd[i] > img.phd[phd_peak]) {
+            phd_peak = i;
+        }
+    }
+    printf("image %u: %.3f s, %d x %d, %d of %d bins, %llu counts, peak %u at (%d, %d), "
+           "phd peak bin %d (%d of %d bins)\n", img.seq, img.ms*1e-3,
+           1 << img.x_bits, 1 << img.y_bits, img.got_bins, n_bins,
+           (unsigned long long)counts, img.bins[peak], peak & ((1 << img.x_bits) - 1),
+           peak >> img.x_bits, phd_peak, img.got_phd, TMIF_IMG_PHD_BINS);
+    s->images++;
+
+    hdr[0] = img.seq;
+    hdr[1] = img.ms;
+    hdr[2] = img.x_bits;
+    hdr[3] = img.y_bits;
+    hdr[4] = img.phd_shift;
+    hdr[5] = (img.got_bins == n_bins) && (img.got_phd == TMIF_IMG_PHD_BINS);
+    img.started = 0;
+    if (fp && ((fwrite(hdr, sizeof(hdr), 1, fp) != 1) ||
+               (fwrite(img.bins, sizeof(uint16_t), n_bins, fp) != (size_t)n_bins) ||
+               (fwrite(img.phd, sizeof(img.phd), 1, fp) != 1))) {
+        perror("fwrite() image");
+        return -1;
+    }
+    return 0;
+}
+
+/* Put an image or histogram frame's bins in their image, finishing
+   the one before if this is a new one */
+static int image_part(const tmif_frm_t *f, FILE *fp, tmdecode_stats_t *s) {
+    tmif_img_part_t part;
+
+    if (tmif_img_part(f, &part) < 0) {
+        s->bad_frames++;
+        return 0;
+    }
+    s->img_frames++;
+    if (img.started && ((part.seq != img.seq) ||
+                        ((part.type == TMIF_FRM_IMAGE) &&
+                         ((part.x_bits != img.x_bits) || (part.y_bits != img.y_bits))))) {
+        if (finish_image(fp, s) < 0) {
+            return -1;
+        }
+    }
+    if (!img.started) {
+        memset(&img, 0, sizeof(img));
+        img.started = 1;
+        img.seq = part.seq;
+        img.ms = part.ms;
+        /* until an image frame says */
+        img.x_bits = 1;
+        img.y_bits = 1;
+    }
+    if (part.type == TMIF_FRM_IMAGE) {
+        img.x_bits = part.x_bits;
+        img.y_bits = part.y_bits;
+        memcpy(&img.bins[part.first], part.bins, part.count*sizeof(uint16_t));
+        img.got_bins += part.count;
+    } else {
+        img.phd_shift = part.phd_shift;
+        memcpy(&img.phd[part.first], part.bins, part.count*sizeof(uint16_t));
+        img.got_phd += part.count;
+    }
+    return 0;
+}
+
+/* Decode n words, returns 0 or -1 on a write error */
+static int decode(const uint16_t *w, uint64_t n, FILE *fp, FILE *img_fp,
+                  tmdecode_stats_t *s) {
+    static uint16_t frame_words[3*TMIF_FRM_MAX_PHOTONS];
+    tmif_frm_t f;
+    uint16_t *out;
+    uint64_t i = 0;
+    uint32_t v = 0;
+    int avail = 0;
+    int len = 0;
+    int k = 0;
+
+    s->words += n;
+    while (i < n) {
+        if (w[i] == 0) {
+            s->padding++;
+            i++;
+        } else if ((w[i] & TMIF_TAG_MASK) == TMIF_FRAME) {
+            /* no frame is longer than a 16 bit length allows */
+            avail = ((n - i) > TMDECODE_MAX_FRAME) ? TMDECODE_MAX_FRAME : (int)(n - i);
+            len = tmif_frm_parse(&w[i], avail, &f);
+            if (len < 0) {
+                s->skipped++;
+                i++;
+                continue;
+            }
+            i += len;
+            if (f.type == TMIF_FRM_MODE) {
+                mode = f.count;
+                if ((mode == TMIF_MODE_PACKED) && (tmif_pack_unparam(f.param, &pack) < 0)) {
+                    mode = -1;
+                    s->bad_frames++;
+                } else {
+                    s->mode_frames++;
+                }
+                continue;
+            }
+            if ((f.type == TMIF_FRM_IMAGE) || (f.type == TMIF_FRM_PHD)) {
+                if (image_part(&f, img_fp, s) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (f.type != TMIF_FRM_PHOTONS) {
+                s->other_frames++;
+                continue;
+            }
+            if ((f.count > TMIF_FRM_MAX_PHOTONS) || (tmif_frm_unphotons(&f, frame_words) < 0)) {
+                s->bad_frames++;
+                continue;
+            }
+            out = out_photons(fp, f.count);
+            if (!out) {
+                return -1;
+            }
+            memcpy(out, frame_words, 3*f.count*sizeof(uint16_t));
+            s->frames++;
+            s->frame_photons += f.count;
+            s->frame_words += len;
+            s->photons += f.count;
+        } else if ((w[i] & TMIF_TAG_MASK) == TMIF_TAG_PACK_HI) {
+            if (mode != TMIF_MODE_PACKED) {
+                s->unannounced++;
+                i++;
+                continue;
+            }
+            v = w[i] & ~TMIF_TAG_MASK;
+            if (tmif_pack_words(&pack) == 2) {
+                if ((i + 1 >= n) || ((w[i + 1] & TMIF_TAG_MASK) != TMIF_TAG_PACK_LO)) {
+                    s->skipped++;
+                    i++;
+                    continue;
+                }
+                v = (v << TMIF_WORD_BITS) | (w[i + 1] & ~TMIF_TAG_MASK);
+                i++;
+            }
+            i++;
+            out = out_photons(fp, 1);
+            if (!out) {
+                return -1;
+            }
+            tmif_enc_unpack(out, v, &pack);
+            s->packed++;
+            s->photons++;
+        } else if ((w[i] & TMIF_TAG_MASK) == TMIF_MARKER) {
+            s->markers++;
+            i++;
+        } else if (((w[i] & TMIF_TAG_MASK) == TMIF_TAG_X) && (i + 2 < n) &&
+                   ((w[i + 1] & TMIF_TAG_MASK) == TMIF_TAG_Y) &&
+                   ((w[i + 2] & TMIF_TAG_MASK) == TMIF_TAG_PHD)) {
+            out = out_photons(fp, 1);
+            if (!out) {
+                return -1;
+            }
+            for (k = 0; k < 3; k++) {
+                out[k] = w[i + k];
+            }
+            s->photons++;
+            i += 3;
+        } else {
+            s->skipped++;
+            i++;
+        }
+    }
+
+    if (finish_image(img_fp, s) < 0) {
+        return -1;
+    }
+    return flush_out(fp);
+}
+
+static void usage(void) {
+    printf("usage: tmdecode [-o photons.bin] [-I images.bin] telemetry.bin\n");
+    printf("  -o  write the photons as x, y, phd tagged words\n");
+    printf("  -I  write the quicklook images and histograms\n");
+}
+
+
+int main(int argc, char **argv) {
+    tmdecode_stats_t s;
+    struct stat sb;
+    const uint16_t *map;
+    const char *out_name = NULL;
+    const char *img_name = NULL;
+    FILE *out_fp = NULL;
+    FILE *img_fp = NULL;
+    int fd = -1;
+    int opt = 0;
+    int status = 0;
+
+    while ((opt = getopt(argc, argv, "o:I:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_name = optarg;
+            break;
+        case 'I':
+            img_name = optarg;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return -1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror("open()");
+        return -1;
+    }
+    if (fstat(fd, &sb) < 0) {
+        perror("fstat()");
+        close(fd);
+        return -1;
+    }
+    memset(&s, 0, sizeof(s));
+    if (sb.st_size < (off_t)sizeof(uint16_t)) {
+        printf("%s: no words\n", argv[optind]);
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap()");
+        return -1;
+    }
+    if (out_name) {
+        out_fp = fopen(out_name, "wb");
+        if (!out_fp) {
+            perror("fopen() output");
+            munmap((void *)map, sb.st_size);
+            return -1;
+        }
+    }
+
+    if (img_name) {
+        img_fp = fopen(img_name, "wb");
+        if (!img_fp) {
+            perror("fopen() images");
+            if (out_fp) {
+                fclose(out_fp);
+            }
+            munmap((void *)map, sb.st_size);
+            return -1;
+        }
+    }
+
+    status = decode(map, sb.st_size/sizeof(uint16_t), out_fp, img_fp, &s);
+    munmap((void *)map, sb.st_size);
+    if (out_fp && (fclose(out_fp) != 0)) {
+        perror("fclose() output");
+        status = -1;
+    }
+    if (img_fp && (fclose(img_fp) != 0)) {
+        perror("fclose() images");
+        status = -1;
+    }
+
+    printf("%llu words: %llu photons, %llu of them in %llu frames (%llu words, %.2f per photon)\n",
+           (unsigned long long)s.words, (unsigned long long)s.photons,
+           (unsigned long long)s.frame_photons, (unsigned long long)s.frames,
+           (unsigned long long)s.frame_words,
+           s.frame_photons ? (double)s.frame_words/(double)s.frame_photons : 0.0);
+    printf("%llu packed photons, %llu mode frames, %llu packed words before a mode frame\n",
+           (unsigned long long)s.packed, (unsigned long long)s.mode_frames,
+           (unsigned long long)s.unannounced);
+    printf("%llu quicklook images in %llu frames\n", (unsigned long long)s.images,
+           (unsigned long long)s.img_frames);
+    printf("%llu markers, %llu padding, %llu other frames, %llu bad frames, %llu words skipped\n",
+           (unsigned long long)s.markers, (unsigned long long)s.padding,
+           (unsigned long long)s.other_frames, (unsigned long long)s.bad_frames,
+           (unsigned long long)s.skipped);
+
+    return status;
+}
@@ -15,12 +15,23 @@
 #include <signal.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 
 #include "tmif_hdf5.h"
+#include "tmif_h5z.h"
+#include "tmif_enc.h"
+#include "tmif_frm.h"
+#include "tmif_img.h"
+#include "tmif_log.h"
+#include "tmif_net.h"
+#include "tmif_seq.h"
 
-#define CU40MMXS_PORT 60000
-#define CU40MMXS_PACKET_SIZE 1470
 /* DMA buffer size in bytes */
 #define DMA_BUF_SIZE 1470
 /* Number of DMA buffers */
@@ -29,6 +40,34 @@
 #define DMA_USR_BUF_SIZE (DMA_BUF_SIZE * DMA_BUF_NUM)
 /* Number of 16-bit samples in the DMA buffer */
 #define DMA_NSAMPLES ( DMA_USR_BUF_SIZE / 2 )
+/* Most photons a packet holds */
+#define TMIF_MAX_PHOTONS ((CU40MMXS_PACKET_SIZE/2 - 3)/3)
+/* Number of 16-bit samples in one DMA buffer (245 photons) */
+#define DMA_BUF_WORDS ( DMA_BUF_SIZE / 2 )
+/* Packets encoded before a partly filled buffer is shipped */
+#define TMIF_DMA_PKTS 3
+/* or once its oldest photon has waited this long */
+#define TMIF_DMA_HOLD_MS 2
+/* Ship a partly filled buffer once the board has fewer than this */
+#define TMIF_DMA_LOW_WATER 2
+/* Photon rate window for the packed mode switch */
+#define TMIF_RATE_MS 100
+/* Packed mode off again below this fraction of its -P rate */
+#define TMIF_PACK_HYST 0.75
+/* Default packed photon layout, x:y:phd bits:phd shift (two words) */
+#define TMIF_PACK_DEFAULT "11:10:5:3"
+/* Photon mode frame sent again on a channel this often */
+#define TMIF_MODE_ANNOUNCE_MS 1000
+/* Quicklook image period by default, seconds */
+#define TMIF_IMG_PERIOD_S 10
+/* Quicklook frames only go to a channel with fewer buffers than
+   this waiting, so photons never queue long behind them */
+#define TMIF_IMG_BACKLOG 4
+/* Longest wait for the board at shutdown */
+#define TMIF_DMA_DRAIN_MS 100
+/* Output channels, FIFO 0 on port 0 (strobe 2) and FIFO 1 on port 1
+   (strobe 1) */
+#define TMIF_MAX_CHANNELS 2
 
 /* P2.0 Heartbeat
    P2.1 FIFO Full
@@ -37,29 +76,175 @@
 #define TMIF_STATUS_FIFO_FULL 0x0002
 #define TMIF_STATUS_ERR 0x0004
 
+/* Heartbeat (P2.0) toggle period */
+#define TMIF_HEALTH_MS 500
+/* FIFO underflows are reported at most this often */
+#define TMIF_FIFO_REPORT_MS 10000
+/* Most events handled per epoll_wait() */
+#define TMIF_MAX_EVENTS 8
+/* Most CU40MMXS packet sources (detector heads, redundant feeds) */
+#define TMIF_MAX_SOURCES TMIF_MAX_STREAMS
+/* Receive batches taken from one source before giving the others a turn */
+#define TMIF_DRAIN_BATCHES 4
+
 #define DM7820_Return_Status(status, string) \
   if (status != 0) { printf("ERROR: DM7820 %s FAILED", string); }
 
 
-int init_output_ports(DM7820_Board_Descriptor *);
-int init_output_fifo(DM7820_Board_Descriptor *);
-int init_output_dma(DM7820_Board_Descriptor *);
-void clear_fifo_flags(DM7820_Board_Descriptor *);
+int init_output_ports(DM7820_Board_Descriptor *, int);
+int init_output_fifo(DM7820_Board_Descriptor *, dm7820_fifo_queue);
+int init_output_dma(DM7820_Board_Descriptor *, dm7820_fifo_queue);
+int init_output_irqs(DM7820_Board_Descriptor *, dm7820_fifo_queue);
+void clear_fifo_flags(DM7820_Board_Descriptor *, dm7820_fifo_queue);
 int set_status_bit(DM7820_Board_Descriptor *, int, int, uint16_t *);
 
+/* FIFO state as the ISR last saw it. FULL and EMPTY come from their
+   interrupts, a DMA done after either means words are moving again. */
+#define TMIF_FIFO_FLOWING 0
+#define TMIF_FIFO_EMPTY 1
+#define TMIF_FIFO_FULL 2
+/* not a state, the ISR's underflow event */
+#define TMIF_FIFO_UNDERFLOW 3
+
+/* Output FIFO state kept by the ISR from its interrupts, read by the
+   output scheduler instead of DM7820_FIFO_Get_Status() round trips.
+   Only the ISR writes it. */
+typedef struct {
+    volatile int state;
+    /* DMA buffers completed */
+    volatile uint32_t dma_done;
+    volatile uint32_t empties;
+    volatile uint32_t fulls;
+    /* the strobe clocked the FIFO with nothing in it, a telemetry word
+       slot gone to waste */
+    volatile uint32_t underflows;
+    volatile int64_t last_empty_ns;
+    volatile int64_t last_full_ns;
+    volatile int64_t last_underflow_ns;
+} tmif_fifo_t;
+
+/* One telemetry output channel: an output FIFO, the ring of DMA
+   buffers feeding it and the ISR's view of it */
+typedef struct {
+    dm7820_fifo_queue fifo;
+    tmif_fifo_t *isr;
+    /* DMA buffer, a ring of DMA_BUF_NUM buffers the board cycles
+       through */
+    uint16_t *dma_buf;
+    /* producer index, buffers filled (slot dma_head % DMA_BUF_NUM is
+       being encoded into), and buffers handed to the board. The ISR's
+       dma_done is the consumer index. All free running. */
+    uint32_t dma_head;
+    uint32_t dma_sent;
+    /* DMA index in the buffer being filled */
+    uint32_t dma_i;
+
+    /* packets from all sources since the last DMA write */
+    uint16_t pkts_since_dma;
+    /* kernel rx time of the oldest word waiting in the DMA buffer */
+    int64_t dma_first_rx_ns;
+
+    /* DMA counters */
+    uint64_t dma_xfers;
+    uint64_t dma_bufs;
+    uint64_t dma_padded;
+    uint64_t dma_dropped;
+    uint32_t dma_max_flight;
+    /* sequence markers and words (photons + markers) encoded */
+    uint64_t markers;
+    uint64_t words;
+    /* compressed photon frames, their photons and words */
+    uint64_t frames;
+    uint64_t frame_photons;
+    uint64_t frame_words;
+    /* photon mode last announced on the channel and when, photons
+       sent packed */
+    int mode_sent;
+    int64_t mode_ns;
+    uint64_t mode_frames;
+    uint64_t packed;
+    /* quicklook frames and their words, and times one found the ring
+       full and waited */
+    uint64_t img_frames;
+    uint64_t img_words;
+    uint64_t img_full;
+    /* FIFO underflows seen so far, those with photons waiting here,
+       and the count at the last report */
+    uint32_t underflows_seen;
+    uint64_t underflows_held;
+    uint32_t underflows_reported;
+} tmif_chan_t;
+
+/* Everything the per-packet path touches */
+typedef struct {
+    DM7820_Board_Descriptor *board;
+    /* output channels, FIFO 0 and with -c 2 FIFO 1 */
+    tmif_chan_t chan[TMIF_MAX_CHANNELS];
+    int n_chan;
+    /* next channel sequence marker */
+    uint16_t out_seq;
+    /* -C, photons go out in compressed frames where that is shorter */
+    int compress;
+    uint16_t frm_buf[DMA_BUF_WORDS];
+    /* -P, photons go out packed (or with -b image not at all,
+       high_mode) while the rate is over pack_on photons/s, until it
+       drops under pack_off */
+    int mode;
+    int high_mode;
+    tmif_pack_t pack;
+    int pack_words;
+    double pack_on;
+    double pack_off;
+    uint32_t mode_switches;
+    /* photons since rate_ns, the start of the rate window */
+    uint64_t rate_photons;
+    int64_t rate_ns;
+    /* -I, quicklook image and histogram sent every img_period_ns */
+    int image;
+    tmif_img_t img;
+    int64_t img_period_ns;
+    uint16_t status_bits;
+    int64_t report_ns;
+
+    /* rx-to-DMA latency, from the kernel timestamp */
+    uint64_t lat_n;
+    int64_t lat_min_ns;
+    int64_t lat_max_ns;
+    int64_t lat_sum_ns;
+} tmif_state_t;
+
+/* One CU40MMXS packet source: its own socket, sequence state and
+   archive stream */
+typedef struct {
+    tmif_rx_t rx;
+    /* puts the packet counter back in order */
+    tmif_seq_t seq;
+    /* archive stream (packet table) */
+    int stream;
+    tmif_state_t *st;
+
+    /* packets waiting to be archived */
+    uint16_t psave_buf[735*10];
+    /* and their kernel receive times and sequence numbers */
+    int64_t psave_ns[10];
+    uint64_t psave_seq[10];
+    uint16_t pbuf_ind;
+
+    uint32_t tot_pkt_count;
+    uint16_t packet_counter;
+    uint16_t packet_counter_h5;
+} tmif_source_t;
+
+/* by TMIF_MODE_* */
+static const char *mode_names[] = {"tagged photons", "packed photons", "quicklook only"};
+
 /* global loop control */
 static volatile sig_atomic_t loop_switch = 1;
-static volatile uint8_t dma_flag = 0;
-//static volatile uint8_t fifo_full_flag = 0;
-/* global health bit */
-static volatile uint8_t g_health_bit = 0;
+/* per output FIFO, indexed by channel */
+static tmif_fifo_t fifo_isr[TMIF_MAX_CHANNELS];
 
-static void health_handler(int sig) {
-    /* flip health bit */
-    g_health_bit = (g_health_bit + 1)%2;
-}
-
-static void signal_handler(int sig) {
+/* Called for every signal read off the signalfd */
+static void handle_signal(int sig) {
     switch(sig) {
     case SIGHUP:
         //syslog(LOG_WARNING, "Caught signal SIGHUP! (tmif_server)");
@@ -80,6 +265,40 @@ static void signal_handler(int sig) {
     }
 }
 
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+
+/* Account one FIFO interrupt */
+static void fifo_event(tmif_fifo_t *f, int event) {
+    switch (event) {
+    case TMIF_FIFO_FLOWING:
+        /* count the dma writes done */
+        f->dma_done++;
+        f->state = TMIF_FIFO_FLOWING;
+        break;
+    case TMIF_FIFO_FULL:
+        f->last_full_ns = now_ns();
+        f->fulls++;
+        f->state = TMIF_FIFO_FULL;
+        break;
+    case TMIF_FIFO_EMPTY:
+        f->last_empty_ns = now_ns();
+        f->empties++;
+        f->state = TMIF_FIFO_EMPTY;
+        break;
+    case TMIF_FIFO_UNDERFLOW:
+        f->last_underflow_ns = now_ns();
+        f->underflows++;
+        break;
+    default:
+        break;
+    }
+}
 
 static void ISR(dm7820_interrupt_info interrupt_status) {
     /* If this ISR is called that means an input DMA transfer has completed. */
@@ -88,20 +307,28 @@ static void ISR(dm7820_interrupt_info interrupt_status) {
     
     switch (interrupt_status.source) {
     case DM7820_INTERRUPT_FIFO_0_DMA_DONE:
-        /* flag number of dma writes */
-        dma_flag++;
+        fifo_event(&fifo_isr[0], TMIF_FIFO_FLOWING);
         break;
     case DM7820_INTERRUPT_FIFO_1_DMA_DONE:
+        fifo_event(&fifo_isr[1], TMIF_FIFO_FLOWING);
         break;
     case DM7820_INTERRUPT_FIFO_0_FULL:
-        //fifo_full_flag = 1;
-        //printf("FIFO 0 FULL!\n");
+        fifo_event(&fifo_isr[0], TMIF_FIFO_FULL);
+        break;
+    case DM7820_INTERRUPT_FIFO_1_FULL:
+        fifo_event(&fifo_isr[1], TMIF_FIFO_FULL);
         break;
     case DM7820_INTERRUPT_FIFO_0_EMPTY:
-        //printf("FIFO 0 empty!\n");
+        fifo_event(&fifo_isr[0], TMIF_FIFO_EMPTY);
+        break;
+    case DM7820_INTERRUPT_FIFO_1_EMPTY:
+        fifo_event(&fifo_isr[1], TMIF_FIFO_EMPTY);
         break;
     case DM7820_INTERRUPT_FIFO_0_UNDERFLOW:
-        //printf("FIFO 0 underflow!\n");
+        fifo_event(&fifo_isr[0], TMIF_FIFO_UNDERFLOW);
+        break;
+    case DM7820_INTERRUPT_FIFO_1_UNDERFLOW:
+        fifo_event(&fifo_isr[1], TMIF_FIFO_UNDERFLOW);
         break;
     default:
         break;
@@ -120,55 +347,794 @@ static void get_fifo_status(DM7820_Board_Descriptor *board,
 }
 
 
-int main(void) {
+/* DMA buffers handed to the board it hasn't finished with */
+static uint32_t dma_in_flight(tmif_chan_t *ch) {
+    return (ch->dma_sent - ch->isr->dma_done);
+}
+
+/* Words in the ring the board hasn't taken yet, for picking the
+   channel with the least to send */
+static uint32_t dma_backlog(tmif_chan_t *ch) {
+    return (ch->dma_head - ch->isr->dma_done)*DMA_BUF_WORDS + ch->dma_i;
+}
+
+/* Hand the filled buffers not handed over yet to the board, one
+   DM7820_FIFO_DMA_Write() per run of ring slots. DMA stays enabled,
+   the board picks them up behind the ones it is sending. */
+static void write_dma(tmif_state_t *st, tmif_chan_t *ch) {
+    DM7820_Error dm7820_status;
+    uint32_t slot = 0;
+    uint32_t n = 0;
+    int64_t lat = 0;
+
+    while (ch->dma_sent != ch->dma_head) {
+        slot = ch->dma_sent % DMA_BUF_NUM;
+        n = ch->dma_head - ch->dma_sent;
+        if (slot + n > DMA_BUF_NUM) {
+            n = DMA_BUF_NUM - slot;
+        }
+
+        /* DMA write to output FIFOs */
+        dm7820_status = DM7820_FIFO_DMA_Write(st->board, ch->fifo,
+                                              ch->dma_buf + slot*DMA_BUF_WORDS, n);
+        DM7820_Return_Status(dm7820_status, "DM7820_FIFO_DMA_Write");
+        if (dm7820_status != 0) {
+            /* Give the slots back, their words are lost */
+            printf("Didn't start xfer due to dma write failure \n");
+            ch->dma_head = ch->dma_sent;
+            ch->dma_i = 0;
+            return;
+        }
+        ch->dma_sent += n;
+        ch->dma_xfers++;
+        ch->dma_bufs += n;
+    }
+
+    lat = tmif_rx_now_ns() - ch->dma_first_rx_ns;
+    if ((st->lat_n == 0) || (lat < st->lat_min_ns)) {
+        st->lat_min_ns = lat;
+    }
+    if (lat > st->lat_max_ns) {
+        st->lat_max_ns = lat;
+    }
+    st->lat_sum_ns += lat;
+    st->lat_n++;
+}
+
+/* Close the buffer being filled, zero padded, and move the producer
+   index on. Returns -1 if the next slot is still in flight (the ring
+   is full) and the buffer stays where it is. */
+static int close_dma_buf(tmif_chan_t *ch) {
+    uint16_t *buf = ch->dma_buf + (ch->dma_head % DMA_BUF_NUM)*DMA_BUF_WORDS;
+
+    if ((ch->dma_head + 1 - ch->isr->dma_done) >= DMA_BUF_NUM) {
+        return -1;
+    }
+    memset(buf + ch->dma_i, 0, sizeof(uint16_t)*(DMA_BUF_WORDS - ch->dma_i));
+    ch->dma_head++;
+    ch->dma_i = 0;
+    return 0;
+}
+
+/* Where the next n words go, closing the buffer being filled if they
+   don't fit in it (photons and markers don't straddle buffers). NULL
+   if the ring is full. */
+static uint16_t *dma_words(tmif_state_t *st, tmif_chan_t *ch, uint32_t n) {
+    if (((ch->dma_i + n) > DMA_BUF_WORDS) && (close_dma_buf(ch) < 0)) {
+        if (!(st->status_bits & TMIF_STATUS_FIFO_FULL)) {
+            set_status_bit(st->board, 2, 1, &st->status_bits);
+            printf("FIFO FULL!\n");
+        }
+        return NULL;
+    }
+    ch->words += n;
+    ch->dma_i += n;
+    return ch->dma_buf + (ch->dma_head % DMA_BUF_NUM)*DMA_BUF_WORDS + ch->dma_i - n;
+}
+
+/* Encode a packet's photons into the ring, tagged or packed as the
+   photon mode says, as many in one go as fit in the buffer being
+   filled. Full buffers are closed as they fill, photons that find the
+   ring full are dropped and counted. */
+static void put_photons(tmif_state_t *st, tmif_chan_t *ch, const uint16_t *p, int n) {
+    int words = (st->mode == TMIF_MODE_PACKED) ? st->pack_words : 3;
+    uint16_t *buf;
+    int fit = 0;
+
+    while (n > 0) {
+        fit = (DMA_BUF_WORDS - ch->dma_i)/words;
+        if (fit == 0) {
+            /* a whole new buffer */
+            fit = DMA_BUF_WORDS/words;
+        }
+        if (fit > n) {
+            fit = n;
+        }
+        buf = dma_words(st, ch, words*fit);
+        if (!buf) {
+            ch->dma_dropped += n;
+            return;
+        }
+        if (st->mode == TMIF_MODE_PACKED) {
+            tmif_enc_pack(buf, p, fit, &st->pack);
+            ch->packed += fit;
+        } else {
+            tmif_enc_photons(buf, p, fit);
+        }
+        p += 3*fit;
+        n -= fit;
+    }
+}
+
+/* Compress a packet's photons into one TMIF_FRM_PHOTONS frame, or
+   encode them tagged if that wouldn't be shorter. A frame goes whole
+   into one buffer, so it can be found and decoded on its own. */
+static void put_frame(tmif_state_t *st, tmif_chan_t *ch, const uint16_t *p, int n) {
+    uint16_t *buf;
+    int len = 0;
+
+    len = tmif_frm_photons(st->frm_buf, DMA_BUF_WORDS, p, n);
+    if (len < 0) {
+        put_photons(st, ch, p, n);
+        return;
+    }
+    buf = dma_words(st, ch, len);
+    if (!buf) {
+        ch->dma_dropped += n;
+        return;
+    }
+    memcpy(buf, st->frm_buf, len*sizeof(uint16_t));
+    ch->frames++;
+    ch->frame_photons += n;
+    ch->frame_words += len;
+}
+
+/* Tell the ground which photon mode the words after this are in */
+static void put_mode(tmif_state_t *st, tmif_chan_t *ch, int64_t rx_ns) {
+    uint16_t *buf = dma_words(st, ch, TMIF_FRM_OVERHEAD);
+
+    if (!buf) {
+        return;
+    }
+    tmif_frm_close(buf, TMIF_FRM_MODE, st->mode,
+                   (st->mode == TMIF_MODE_PACKED) ? tmif_pack_param(&st->pack) : 0, 0);
+    ch->mode_sent = st->mode;
+    ch->mode_ns = rx_ns;
+    ch->mode_frames++;
+}
+
+/* Send the quicklook snapshot's frames, each about a DMA buffer, to
+   the channel with the least waiting while that is under
+   TMIF_IMG_BACKLOG buffers. Called per packet and from the main loop
+   until they are all gone, a frame that finds the ring full waits
+   for the next call. */
+static void put_image(tmif_state_t *st) {
+    tmif_chan_t *ch;
+    uint16_t *buf;
+    int len = 0;
+    int c = 0;
+
+    while (st->img.snap_next >= 0) {
+        ch = &st->chan[0];
+        for (c = 1; c < st->n_chan; c++) {
+            if (dma_backlog(&st->chan[c]) < dma_backlog(ch)) {
+                ch = &st->chan[c];
+            }
+        }
+        if (dma_backlog(ch) >= TMIF_IMG_BACKLOG*DMA_BUF_WORDS) {
+            return;
+        }
+        len = tmif_img_frame(&st->img, st->frm_buf, DMA_BUF_WORDS);
+        if (len == 0) {
+            return;
+        }
+        if ((ch->dma_i == 0) && (ch->dma_head == ch->dma_sent)) {
+            ch->dma_first_rx_ns = tmif_rx_now_ns();
+        }
+        buf = dma_words(st, ch, len);
+        if (!buf) {
+            /* the frame stays with the snapshot for next time */
+            ch->img_full++;
+            return;
+        }
+        memcpy(buf, st->frm_buf, len*sizeof(uint16_t));
+        tmif_img_sent(&st->img, st->frm_buf);
+        ch->img_frames++;
+        ch->img_words += len;
+        /* don't wait on packets to ship it */
+        ch->pkts_since_dma = TMIF_DMA_PKTS;
+    }
+}
+
+/* Photon rate over the last TMIF_RATE_MS of packets (by their rx
+   times) and the photon mode that goes with it: high_mode from pack_on
+   photons/s, tagged again under pack_off */
+static void update_mode(tmif_state_t *st, int64_t rx_ns, int photons) {
+    double rate = 0;
+    int mode = st->mode;
+
+    st->rate_photons += photons;
+    if ((rx_ns - st->rate_ns) < TMIF_RATE_MS*1000000LL) {
+        return;
+    }
+    rate = (double)st->rate_photons*1e9/(double)(rx_ns - st->rate_ns);
+    st->rate_photons = 0;
+    st->rate_ns = rx_ns;
+
+    if ((mode == TMIF_MODE_TAGGED) && (rate >= st->pack_on)) {
+        mode = st->high_mode;
+    } else if ((mode != TMIF_MODE_TAGGED) && (rate < st->pack_off)) {
+        mode = TMIF_MODE_TAGGED;
+    }
+    if (mode != st->mode) {
+        printf("photon rate %.0f/s, %s\n", rate, mode_names[mode]);
+        st->mode = mode;
+        st->mode_switches++;
+    }
+}
+
+/* With more than one channel each packet's photons are preceded by a
+   TMIF_MARKER word carrying the low bits of a sequence number common
+   to all channels, the ground merges the channels back in that
+   order. */
+static void put_marker(tmif_state_t *st, tmif_chan_t *ch) {
+    uint16_t *buf = dma_words(st, ch, 1);
+
+    if (buf) {
+        buf[0] = TMIF_MARKER | (st->out_seq & TMIF_MARKER_MASK);
+        ch->markers++;
+    }
+    st->out_seq++;
+}
+
+/* Keep one channel's FIFO fed without waiting on the board. Full
+   buffers go to the board straight away, a partly filled one once
+   TMIF_DMA_PKTS packets went into it (or it is TMIF_DMA_HOLD_MS old)
+   and the board is down to its last TMIF_DMA_LOW_WATER buffers, so
+   the FIFO doesn't run dry between bursts while there are photons to
+   send. Going by the ISR's FIFO state, a partly filled buffer goes at
+   once if the FIFO has run empty and not at all while it is full.
+   Returns whether the FIFO (or the ring behind it) is full. */
+static int poll_chan(tmif_state_t *st, tmif_chan_t *ch) {
+    int fifo_state = ch->isr->state;
+    uint32_t underflows = ch->isr->underflows;
+
+    /* Slots wasted while there were photons here to send */
+    if (underflows != ch->underflows_seen) {
+        if ((ch->dma_i > 0) || (ch->dma_sent != ch->dma_head)) {
+            ch->underflows_held += underflows - ch->underflows_seen;
+        }
+        ch->underflows_seen = underflows;
+    }
+
+    if ((ch->dma_i > 0) && (ch->dma_head == ch->dma_sent) &&
+        (ch->pkts_since_dma < TMIF_DMA_PKTS) &&
+        ((fifo_state == TMIF_FIFO_EMPTY) ||
+         ((tmif_rx_now_ns() - ch->dma_first_rx_ns) >= TMIF_DMA_HOLD_MS*1000000LL))) {
+        ch->pkts_since_dma = TMIF_DMA_PKTS;
+    }
+    if ((ch->dma_i > 0) && (ch->pkts_since_dma >= TMIF_DMA_PKTS) &&
+        (fifo_state != TMIF_FIFO_FULL) &&
+        (dma_in_flight(ch) < TMIF_DMA_LOW_WATER) &&
+        (close_dma_buf(ch) == 0)) {
+        ch->pkts_since_dma = 0;
+        ch->dma_padded++;
+    }
+    if (ch->dma_sent != ch->dma_head) {
+        write_dma(st, ch);
+    }
+    if (dma_in_flight(ch) > ch->dma_max_flight) {
+        ch->dma_max_flight = dma_in_flight(ch);
+    }
+
+    return (fifo_state == TMIF_FIFO_FULL) ||
+        ((ch->dma_i == DMA_BUF_WORDS) && ((ch->dma_head + 1 - ch->isr->dma_done) >= DMA_BUF_NUM));
+}
+
+/* Feed every channel, called per packet and from the main loop */
+static void poll_dma(tmif_state_t *st) {
+    int full = 0;
+    int c = 0;
+
+    for (c = 0; c < st->n_chan; c++) {
+        if (poll_chan(st, &st->chan[c])) {
+            full = 1;
+        }
+    }
+
+    /* FIFO full status line, any channel */
+    if (full != ((st->status_bits & TMIF_STATUS_FIFO_FULL) != 0)) {
+        set_status_bit(st->board, 2, full, &st->status_bits);
+    }
+}
+
+/* Has a ring got photons waiting on the board (or are quicklook
+   frames waiting to go)? The main loop wakes up for those instead of
+   sleeping on the sockets. With in_flight count the ones the board
+   has too. */
+static int dma_pending(tmif_state_t *st, int in_flight) {
+    tmif_chan_t *ch;
+    int c = 0;
+
+    if (st->image && (st->img.snap_next >= 0)) {
+        return 1;
+    }
+    for (c = 0; c < st->n_chan; c++) {
+        ch = &st->chan[c];
+        if ((ch->dma_i > 0) || (ch->dma_sent != ch->dma_head) ||
+            (in_flight && dma_in_flight(ch))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Send what is left at shutdown, waiting at most TMIF_DMA_DRAIN_MS */
+static void finish_dma(tmif_state_t *st) {
+    int64_t end = now_ns() + (int64_t)TMIF_DMA_DRAIN_MS*1000000;
+    int c = 0;
+
+    for (c = 0; c < st->n_chan; c++) {
+        st->chan[c].pkts_since_dma = TMIF_DMA_PKTS;
+    }
+    while (dma_pending(st, 1) && (now_ns() < end)) {
+        if (st->image) {
+            put_image(st);
+        }
+        poll_dma(st);
+        usleep(5);
+    }
+    for (c = 0; c < st->n_chan; c++) {
+        if ((st->chan[c].dma_i > 0) || dma_in_flight(&st->chan[c])) {
+            printf("DMA still in flight on FIFO %d at shutdown, %u buffers\n",
+                   c, dma_in_flight(&st->chan[c]));
+        }
+    }
+}
+
+/* Account, archive and encode one 735 word CU40MMXS packet from src,
+   in sequence order out of the reorder window. Photons from every
+   source are merged into the one telemetry stream. */
+static void handle_packet(tmif_state_t *st, tmif_source_t *src, tmif_pkt_t *pkt, uint64_t seq) {
+    uint16_t *packet_buf = pkt->data;
+    uint16_t num_photons = 0;
+    tmif_chan_t *ch;
+    int status = 0;
+    int c = 0;
+
+    src->tot_pkt_count++;
+    src->packet_counter = packet_buf[1];
+
+    /* If enough packets have been read, save what we have */
+    if ((((uint16_t)(src->packet_counter - src->packet_counter_h5)) >= 10) ||
+        (src->pbuf_ind == 10)) {
+        status = save_packets(src->stream, src->psave_buf, src->psave_ns, src->psave_seq,
+                              src->pbuf_ind);
+        if (status != 0) {
+            printf("save_packets() failed! %d\n", status);
+        }
+        /* Reset packet buffer index */
+        src->pbuf_ind = 0;
+        memset(src->psave_buf, 0, sizeof(src->psave_buf));
+        src->packet_counter_h5 = src->packet_counter;
+    }
+
+    /* Every packet goes to the archive, empty ones only make its index
+       (so quiet periods aren't mistaken for lost packets) */
+    memcpy(&src->psave_buf[src->pbuf_ind*735], packet_buf, CU40MMXS_PACKET_SIZE);
+    src->psave_ns[src->pbuf_ind] = pkt->rx_ns;
+    src->psave_seq[src->pbuf_ind] = seq;
+    src->pbuf_ind += 1;
+
+    /* If there are photons in the packet do work. The whole packet
+       goes out the channel with the least waiting to be sent, taking
+       turns when they're even. */
+    num_photons = packet_buf[0];
+    if (num_photons > TMIF_MAX_PHOTONS) {
+        num_photons = TMIF_MAX_PHOTONS;
+    }
+    if (st->pack_on > 0) {
+        update_mode(st, pkt->rx_ns, num_photons);
+    }
+    if (st->image) {
+        tmif_img_add(&st->img, &packet_buf[3], num_photons);
+    }
+    if (num_photons > 0) {
+        ch = &st->chan[st->out_seq % st->n_chan];
+        for (c = 0; c < st->n_chan; c++) {
+            if (dma_backlog(&st->chan[c]) < dma_backlog(ch)) {
+                ch = &st->chan[c];
+            }
+        }
+        if ((ch->dma_i == 0) && (ch->dma_head == ch->dma_sent)) {
+            ch->dma_first_rx_ns = pkt->rx_ns;
+            /* underflows up to now had nothing waiting on them */
+            ch->underflows_seen = ch->isr->underflows;
+        }
+
+        if ((st->n_chan > 1) && (st->mode != TMIF_MODE_IMAGE)) {
+            put_marker(st, ch);
+        }
+        if ((st->pack_on > 0) && ((ch->mode_sent != st->mode) ||
+                                  ((pkt->rx_ns - ch->mode_ns) >= TMIF_MODE_ANNOUNCE_MS*1000000LL))) {
+            put_mode(st, ch, pkt->rx_ns);
+        }
+        if (st->mode == TMIF_MODE_IMAGE) {
+            /* only in the quicklook */
+        } else if (st->compress && (st->mode == TMIF_MODE_TAGGED)) {
+            put_frame(st, ch, &packet_buf[3], num_photons);
+        } else {
+            put_photons(st, ch, &packet_buf[3], num_photons);
+        }
+    }
+    if (st->image) {
+        put_image(st);
+    }
+
+    /* Write DMA after 3 packets have been processed */
+    for (c = 0; c < st->n_chan; c++) {
+        if (st->chan[c].pkts_since_dma < TMIF_DMA_PKTS) {
+            st->chan[c].pkts_since_dma++;
+        }
+    }
+    poll_dma(st);
+}
+
+/* Reorder window release callback */
+static void release_packet(void *ctx, tmif_pkt_t *pkt, uint64_t seq) {
+    tmif_source_t *src = (tmif_source_t *)ctx;
+
+    handle_packet(src->st, src, pkt, seq);
+}
+
+
+/* Read what is waiting on one source, at most TMIF_DRAIN_BATCHES
+   batches so a busy source can't starve the others (epoll is level
+   triggered and brings us straight back). With a busy-poll window,
+   keep spinning on the socket for that long after the last packet
+   before going back to sleep in epoll_wait(). Packets go through the
+   source's reorder window on their way to handle_packet(). */
+static void drain_source(tmif_source_t *src, int busy_poll_us) {
+    tmif_rx_t *rx = &src->rx;
+    int64_t last_ns = 0;
+    int n_pkts = 0;
+    int batches = 0;
+    int i = 0;
+
+    while(loop_switch && (batches < TMIF_DRAIN_BATCHES)) {
+        n_pkts = tmif_rx_recv(rx);
+        if (n_pkts <= 0) {
+            if ((busy_poll_us > 0) &&
+                ((now_ns() - last_ns) < (int64_t)busy_poll_us*1000)) {
+                continue;
+            }
+            break;
+        }
+
+        for (i = 0; i < n_pkts; i++) {
+            tmif_seq_push(&src->seq, &rx->pkts[i]);
+        }
+        if (busy_poll_us > 0) {
+            last_ns = now_ns();
+        }
+        batches++;
+    }
+
+    if (src->seq.n_held) {
+        tmif_seq_expire(&src->seq, tmif_rx_now_ns());
+    }
+}
+
+/* epoll timeout: 1 ms while the board has photons waiting, else up to
+   the soonest deadline of a held packet (rounded up), -1 for none */
+static int wait_ms(tmif_state_t *st, tmif_source_t *sources, int n_sources) {
+    int64_t first = -1;
+    int64_t t = 0;
+    int i = 0;
+
+    if (dma_pending(st, 0)) {
+        return 1;
+    }
+    for (i = 0; i < n_sources; i++) {
+        t = tmif_seq_deadline(&sources[i].seq);
+        if ((t >= 0) && ((first < 0) || (t < first))) {
+            first = t;
+        }
+    }
+    if (first < 0) {
+        return -1;
+    }
+    t = first - tmif_rx_now_ns();
+    return (t <= 0) ? 0 : (int)((t + 999999)/1000000);
+}
+
+/* Parse a "[addr:]port" packet source */
+static int parse_source(const char *arg, uint32_t *addr, uint16_t *port) {
+    char host[64];
+    const char *colon = strrchr(arg, ':');
+    struct in_addr in;
+    int p = 0;
+
+    *addr = INADDR_ANY;
+    if (colon) {
+        if ((size_t)(colon - arg) >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, arg, colon - arg);
+        host[colon - arg] = '\0';
+        if (inet_pton(AF_INET, host, &in) != 1) {
+            return -1;
+        }
+        *addr = in.s_addr;
+        arg = colon + 1;
+    }
+
+    p = atoi(arg);
+    if ((p <= 0) || (p > 65535)) {
+        return -1;
+    }
+    *port = (uint16_t)p;
+
+    return 0;
+}
+
+/* Print each output FIFO's underflows of the last
+   TMIF_FIFO_REPORT_MS, if there were any. Each one is a telemetry word
+   slot that went out empty. */
+static void report_fifo(tmif_state_t *st) {
+    int64_t now = now_ns();
+    tmif_chan_t *ch;
+    uint32_t underflows = 0;
+    int c = 0;
+
+    if ((now - st->report_ns) < (int64_t)TMIF_FIFO_REPORT_MS*1000000) {
+        return;
+    }
+    for (c = 0; c < st->n_chan; c++) {
+        ch = &st->chan[c];
+        underflows = ch->isr->underflows;
+        if (underflows != ch->underflows_reported) {
+            printf("FIFO %d: %u underflows in the last %.1f s, %llu in all with photons waiting\n",
+                   c, underflows - ch->underflows_reported, (now - st->report_ns)*1e-9,
+                   (unsigned long long)ch->underflows_held);
+            ch->underflows_reported = underflows;
+        }
+    }
+    st->report_ns = now;
+}
+
+/* Toggle the heartbeat line, called off the health timerfd */
+static void heartbeat(int timer_fd, tmif_state_t *st, uint8_t *l_health_bit) {
+    uint64_t expirations = 0;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    /* set status bit*/
+    set_status_bit(st->board, 1, *l_health_bit, &st->status_bits);
+    *l_health_bit = (*l_health_bit + 1)%2;
+
+    report_fifo(st);
+
+    /* Quicklook period over (to the nearest tick), send it */
+    if (st->image) {
+        if ((now_ns() - st->img.start_ns + TMIF_HEALTH_MS*500000LL) >= st->img_period_ns) {
+            tmif_img_snap(&st->img, now_ns());
+        }
+        put_image(st);
+    }
+}
+
+static int open_health_timer(void) {
+    int timer_fd;
+    struct itimerspec health_timer;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("timerfd_create()");
+        return -1;
+    }
+
+    /* repeat half second intervals */
+    health_timer.it_value.tv_sec = 0;
+    health_timer.it_value.tv_nsec = TMIF_HEALTH_MS*1000000L;
+    health_timer.it_interval = health_timer.it_value;
+
+    if (timerfd_settime(timer_fd, 0, &health_timer, NULL) < 0) {
+        perror("timerfd_settime()");
+        close(timer_fd);
+        return -1;
+    }
+
+    return timer_fd;
+}
+
+static int epoll_add(int epoll_fd, int fd) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl()");
+        return -1;
+    }
+    return 0;
+}
+
+static void print_usage_stats(tmif_state_t *st, int64_t start_ns) {
+    struct rusage ru;
+    tmif_chan_t *ch;
+    int c = 0;
+    double wall = (double)(now_ns() - start_ns)*1e-9;
+    double user = 0;
+    double sys = 0;
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6;
+        sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6;
+        printf("CPU: user %.3f s, sys %.3f s over %.3f s (%.1f%% of a core)\n",
+               user, sys, wall, (wall > 0) ? 100.0*(user + sys)/wall : 0.0);
+    }
+
+    if (st->lat_n) {
+        printf("rx-to-DMA latency: n %llu, min %.1f us, mean %.1f us, max %.1f us\n",
+               (unsigned long long)st->lat_n, st->lat_min_ns*1e-3,
+               (double)st->lat_sum_ns/(double)st->lat_n*1e-3, st->lat_max_ns*1e-3);
+    }
+    if (st->pack_on > 0) {
+        printf("photon mode: %u switches, %s at exit\n", st->mode_switches,
+               mode_names[st->mode]);
+    }
+    if (st->image) {
+        printf("quicklook: %llu images sent, %llu frames, %llu photons in the last\n",
+               (unsigned long long)st->img.snaps, (unsigned long long)st->img.frames,
+               (unsigned long long)st->img.snap_photons);
+    }
+    for (c = 0; c < st->n_chan; c++) {
+        ch = &st->chan[c];
+        printf("FIFO %d DMA: %llu writes (%llu buffers, %llu partly filled), most in flight %u of %d, "
+               "%llu words, %llu markers, %llu photons dropped with the ring full\n",
+               c, (unsigned long long)ch->dma_xfers, (unsigned long long)ch->dma_bufs,
+               (unsigned long long)ch->dma_padded, ch->dma_max_flight, DMA_BUF_NUM,
+               (unsigned long long)ch->words, (unsigned long long)ch->markers,
+               (unsigned long long)ch->dma_dropped);
+        if (ch->frames) {
+            printf("FIFO %d: %llu photons in %llu compressed frames, %llu words (%.2f per photon)\n",
+                   c, (unsigned long long)ch->frame_photons, (unsigned long long)ch->frames,
+                   (unsigned long long)ch->frame_words,
+                   (double)ch->frame_words/(double)ch->frame_photons);
+        }
+        if (ch->img_frames || ch->img_full) {
+            printf("FIFO %d: %llu quicklook frames, %llu words, ring full %llu times\n", c,
+                   (unsigned long long)ch->img_frames, (unsigned long long)ch->img_words,
+                   (unsigned long long)ch->img_full);
+        }
+        if (ch->mode_frames) {
+            printf("FIFO %d: %llu photons packed, %llu mode frames\n", c,
+                   (unsigned long long)ch->packed, (unsigned long long)ch->mode_frames);
+        }
+        printf("FIFO %d: %u underflows (%llu with photons waiting), empty %u, full %u",
+               c, ch->isr->underflows, (unsigned long long)ch->underflows_held,
+               ch->isr->empties, ch->isr->fulls);
+        if (ch->isr->underflows) {
+            printf(", last underflow %.3f s before exit",
+                   (now_ns() - ch->isr->last_underflow_ns)*1e-9);
+        }
+        printf("\n");
+    }
+}
+
+
+static void usage(void) {
+    printf("usage: tmif [-m recvfrom|mmsg|ring|uring] [-n batch] [-g] [-p usec] [-i ifname]\n");
+    printf("            [-s [addr:]port]... [-w depth] [-l usec] [-q block|drop|spill]\n");
+    printf("            [-z level] [-Z workers] [-e raw fraction] [-L log] [-R]\n");
+    printf("            [-B MB] [-N packets] [-T seconds] [-c channels]\n");
+    printf("            [-E scalar|sse2|avx2] [-C] [-P photons/s[:photons/s]]\n");
+    printf("            [-b x:y:phd[:phd shift]|image] [-I x:y[:seconds[:phd shift]]]\n");
+    printf("  -m  ingest mode (default mmsg), ring is an AF_PACKET mmap ring,\n");
+    printf("      uring is io_uring multishot recv (falls back to mmsg)\n");
+    printf("  -n  datagrams per recvmmsg() call (1-%d, default %d)\n",
+           TMIF_RX_BATCH_MAX, TMIF_RX_BATCH_DEFAULT);
+    printf("  -g  enable UDP_GRO coalescing\n");
+    printf("  -p  busy-poll window in usec after the last packet (default 0)\n");
+    printf("  -i  interface for the ring ingest mode (default lo)\n");
+    printf("  -s  [addr:]port packet source, repeat for up to %d sources\n",
+           TMIF_MAX_SOURCES);
+    printf("      (default port %d on all interfaces)\n", CU40MMXS_PORT);
+    printf("  -w  reorder window depth in packets, 0 for none (0-%d, default %d)\n",
+           TMIF_SEQ_WINDOW_MAX, TMIF_SEQ_DEPTH_DEFAULT);
+    printf("  -l  longest a packet waits on a missing one in usec (default %d)\n",
+           TMIF_SEQ_HOLD_US_DEFAULT);
+    printf("  -q  archive queue full policy: block, drop (oldest, default) or\n");
+    printf("      spill (archive log next to the archive, log2h5 reads it)\n");
+    printf("  -z  shuffle+deflate archive compression level (1-9, default 0 off)\n");
+    printf("  -Z  compression worker threads (1-%d, default %d)\n",
+           TMIF_H5Z_MAX_WORKERS, TMIF_H5Z_WORKERS_DEFAULT);
+    printf("  -e  archive photon events (x, y, phd, seq, rx time) instead of whole\n");
+    printf("      packets, keeping this fraction of packets raw as well (0-1)\n");
+    printf("  -L  archive to a crash-safe raw append log instead of HDF5\n");
+    printf("      (e.g. %s, convert with log2h5)\n", LOG_FILE_NAME);
+    printf("  -R  no SWMR, old HDF5 file format (no live readers, h5tail)\n");
+    printf("  -B, -N, -T  start a new numbered archive file after this many MB,\n");
+    printf("      packets or seconds (whichever comes first, default one file)\n");
+    printf("  -c  telemetry output channels, 2 adds FIFO 1 on port 1 (strobe 1) with\n");
+    printf("      packets split between them by load and sequence markers (default 1)\n");
+    printf("  -E  best photon encoder to use, if the CPU has it (default avx2)\n");
+    printf("  -C  compressed photon frames, lossless, where shorter than tagged\n");
+    printf("      words (decode with tmdecode)\n");
+    printf("  -P  lossy packed photons while the photon rate is over this, back to\n");
+    printf("      full resolution under the second rate (default %.0f%% of the first)\n",
+           100*TMIF_PACK_HYST);
+    printf("  -b  packed photon layout, x, y and phd bits kept and phd shifted down\n");
+    printf("      (max 26 bits, 13 or fewer pack in one word, default %s), or image\n",
+           TMIF_PACK_DEFAULT);
+    printf("      for no photons at all over the -P rate, only the -I quicklook\n");
+    printf("  -I  quicklook image of x and y binned to this many bits and phd\n");
+    printf("      histogram, sent every so many seconds (default %d)\n", TMIF_IMG_PERIOD_S);
+}
+
+
+int main(int argc, char **argv) {
     /* DM9820 items */
     DM7820_Error dm7820_status;
     DM7820_Board_Descriptor *output_board;
     uint8_t fifo_status = 0x00;
-    /* DMA buffer */
-    uint16_t *dma_buf = NULL;
-    /* DMA index */
-    uint32_t dma_i = 0;
-    uint16_t dma_chk = 0;
 
     /* Socket items */
-    int sock_fd;
-    int sock_status = 0;
-    struct sockaddr_in sin;
-    int sock_opts = 0;
-    struct sockaddr_storage from_addr;
-    socklen_t addr_len;
-    int opt_status = 0;
-    int sock_nbytes = 0;
-    int sock_so_rcvbuf = 0;
-    socklen_t optlen = sizeof(sock_so_rcvbuf);
-
-    /* buffers */
-    uint16_t packet_buf[735];
-    uint16_t psave_buf[735*10];
-    //uint16_t 
-    //char s[100];
-    uint16_t *pbufptr = packet_buf;
-    uint16_t *psaveptr = psave_buf;
-    uint16_t pbuf_ind = 0;
+    static tmif_source_t sources[TMIF_MAX_SOURCES];
+    uint32_t src_addr[TMIF_MAX_SOURCES];
+    uint16_t src_port[TMIF_MAX_SOURCES];
+    int n_sources = 0;
+    int seq_depth = TMIF_SEQ_DEPTH_DEFAULT;
+    int seq_hold_us = TMIF_SEQ_HOLD_US_DEFAULT;
+    tmif_source_t *src;
+    tmif_rx_mode_t rx_mode = TMIF_RX_MMSG;
+    int rx_batch = TMIF_RX_BATCH_DEFAULT;
+    int rx_gro = 0;
+    const char *rx_ifname = "lo";
+    int busy_poll_us = 0;
+    int z_level = 0;
+    int z_workers = TMIF_H5Z_WORKERS_DEFAULT;
+    double rot_mb = 0;
+    uint64_t rot_rows = 0;
+    int rot_secs = 0;
+    int n_chan = 1;
+    int enc_level = TMIF_ENC_LEVELS - 1;
+    int compress = 0;
+    int high_mode = TMIF_MODE_PACKED;
+    int img_x_bits = 0;
+    int img_y_bits = 0;
+    int img_phd_shift = 0;
+    double img_period = TMIF_IMG_PERIOD_S;
+    tmif_pack_t pack;
+    double pack_on = 0;
+    double pack_off = 0;
+    int opt = 0;
+    int n = 0;
 
     /* health */
     uint8_t l_health_bit = 0;
-    uint16_t status_bits = 0x0000;
+    int timer_fd = -1;
 
     /* Signals */
-    struct sigaction sa_quit;
-    struct sigaction sa_health;
-    struct itimerval health_timer;
+    sigset_t sig_mask;
+    struct signalfd_siginfo sig_info;
+    int sig_fd = -1;
+
+    /* Event loop */
+    int epoll_fd = -1;
+    struct epoll_event events[TMIF_MAX_EVENTS];
+    int n_events = 0;
+    int64_t start_ns = 0;
 
     /* tmif */
-    uint32_t tot_pkt_count = 0;
-    uint16_t packet_counter = 0;
-    uint16_t packet_counter_s = 0;
-    uint16_t packet_counter_h5 = 0;
+    static tmif_state_t st;
     int i = 0;
-    uint16_t num_photons = 0;
-    uint32_t pkt_mismatch_cnt = 0;
+    int j = 0;
+    int c = 0;
     /* Generic status checker! */
     int status = 0;
 
@@ -176,60 +1142,233 @@ int main(void) {
     id_t pid;
 
 
-    printf("Hello!\n");
-    memset(packet_buf, 0, sizeof(uint16_t)*735);
-
-    /* Set highest priority */
-    pid = getpid();
-    status = setpriority(PRIO_PROCESS, pid, -20);
-    if (status != 0) {
-        printf("setpriority() fail %d\n", status);
+    tmif_pack_parse(TMIF_PACK_DEFAULT, &pack);
+    while ((opt = getopt(argc, argv, "m:n:gp:i:s:w:l:q:z:Z:e:L:RB:N:T:c:E:CP:b:I:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "recvfrom") == 0) {
+                rx_mode = TMIF_RX_RECVFROM;
+            } else if (strcmp(optarg, "mmsg") == 0) {
+                rx_mode = TMIF_RX_MMSG;
+            } else if (strcmp(optarg, "ring") == 0) {
+                rx_mode = TMIF_RX_RING;
+            } else if (strcmp(optarg, "uring") == 0) {
+                rx_mode = TMIF_RX_URING;
+            } else {
+                usage();
+                return -1;
+            }
+            break;
+        case 'n':
+            rx_batch = atoi(optarg);
+            break;
+        case 'g':
+            rx_gro = 1;
+            break;
+        case 'p':
+            busy_poll_us = atoi(optarg);
+            break;
+        case 'i':
+            rx_ifname = optarg;
+            break;
+        case 's':
+            if ((n_sources >= TMIF_MAX_SOURCES) ||
+                (parse_source(optarg, &src_addr[n_sources], &src_port[n_sources]) < 0)) {
+                printf("bad or too many sources: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            n_sources++;
+            break;
+        case 'w':
+            seq_depth = atoi(optarg);
+            break;
+        case 'l':
+            seq_hold_us = atoi(optarg);
+            break;
+        case 'q':
+            if (strcmp(optarg, "block") == 0) {
+                set_packet_save_policy(TMIF_H5_BLOCK);
+            } else if (strcmp(optarg, "drop") == 0) {
+                set_packet_save_policy(TMIF_H5_DROP_OLDEST);
+            } else if (strcmp(optarg, "spill") == 0) {
+                set_packet_save_policy(TMIF_H5_SPILL);
+            } else {
+                printf("bad archive queue policy: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'z':
+            z_level = atoi(optarg);
+            break;
+        case 'Z':
+            z_workers = atoi(optarg);
+            break;
+        case 'e':
+            set_packet_save_events(atof(optarg));
+            break;
+        case 'L':
+            set_packet_save_log(optarg);
+            break;
+        case 'R':
+            set_packet_save_swmr(0);
+            break;
+        case 'B':
+            rot_mb = atof(optarg);
+            break;
+        case 'N':
+            rot_rows = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            rot_secs = atoi(optarg);
+            break;
+        case 'c':
+            n_chan = atoi(optarg);
+            if ((n_chan < 1) || (n_chan > TMIF_MAX_CHANNELS)) {
+                printf("bad number of output channels: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'E':
+            enc_level = tmif_enc_parse(optarg);
+            if (enc_level < 0) {
+                printf("bad photon encoder: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'C':
+            compress = 1;
+            break;
+        case 'P':
+            n = sscanf(optarg, "%lf:%lf", &pack_on, &pack_off);
+            if ((n < 1) || (pack_on <= 0)) {
+                printf("bad packed photon rate: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            if (n == 1) {
+                pack_off = pack_on*TMIF_PACK_HYST;
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "image") == 0) {
+                high_mode = TMIF_MODE_IMAGE;
+            } else if (tmif_pack_parse(optarg, &pack) < 0) {
+                printf("bad packed photon layout: %s\n", optarg);
+                usage();
+                return -1;
+            } else {
+                high_mode = TMIF_MODE_PACKED;
+            }
+            break;
+        case 'I':
+            n = sscanf(optarg, "%d:%d:%lf:%d", &img_x_bits, &img_y_bits, &img_period,
+                       &img_phd_shift);
+            if ((n < 2) || (img_period <= 0)) {
+                printf("bad quicklook image: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
+        }
     }
 
-    /* Create socket */
-    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock_fd < 0) {
-        printf("Error creating socket...\n");
+    if ((high_mode == TMIF_MODE_IMAGE) && (img_x_bits == 0)) {
+        printf("-b image needs the -I quicklook\n");
+        usage();
+        return -1;
     }
 
-    /* Bind to port 60000 */
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = INADDR_ANY;
-    sin.sin_port = htons(CU40MMXS_PORT);
-
-    sock_status = bind(sock_fd, (struct sockaddr *)&sin, sizeof(sin));
-    if (sock_status < 0) {
-        printf("Failed to bind\n");
+    if (n_sources == 0) {
+        src_addr[0] = INADDR_ANY;
+        src_port[0] = CU40MMXS_PORT;
+        n_sources = 1;
     }
 
-    opt_status = getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &sock_so_rcvbuf, &optlen);
-    if (opt_status < 0) {
-        printf("getsockopt() error\n");
-        perror("getsockopt()");
+    printf("Hello!\n");
+    memset(&st, 0, sizeof(st));
+    memset(sources, 0, sizeof(sources));
+    start_ns = now_ns();
+    st.report_ns = start_ns;
+    st.n_chan = n_chan;
+    st.compress = compress;
+    st.pack = pack;
+    st.pack_words = tmif_pack_words(&pack);
+    st.pack_on = pack_on;
+    st.pack_off = pack_off;
+    st.high_mode = high_mode;
+    if (img_x_bits > 0) {
+        if (tmif_img_init(&st.img, img_x_bits, img_y_bits, img_phd_shift, start_ns) < 0) {
+            printf("bad quicklook image binning (x, y 1-13 bits, %d in all)\n",
+                   TMIF_IMG_MAX_BITS);
+            return -1;
+        }
+        st.image = 1;
+        st.img_period_ns = (int64_t)(img_period*1e9);
+        printf("quicklook: %d x %d image and phd >> %d histogram every %.1f s\n",
+               1 << img_x_bits, 1 << img_y_bits, img_phd_shift, img_period);
+    }
+    if ((pack_on > 0) && (high_mode == TMIF_MODE_IMAGE)) {
+        printf("quicklook only from %.0f photons/s, tagged again under %.0f\n",
+               pack_on, pack_off);
+    } else if (pack_on > 0) {
+        printf("packed photons (x %d, y %d, phd %d bits, %d words a photon) from %.0f photons/s, "
+               "tagged again under %.0f\n", pack.x_bits, pack.y_bits, pack.phd_bits,
+               st.pack_words, pack_on, pack_off);
+    }
+    printf("photon encoder: %s\n", tmif_enc_name(tmif_enc_init(enc_level)));
+    for (c = 0; c < n_chan; c++) {
+        st.chan[c].fifo = (c == 0) ? DM7820_FIFO_QUEUE_0 : DM7820_FIFO_QUEUE_1;
+        st.chan[c].isr = &fifo_isr[c];
     }
-    printf("so_rcvbuf: %i\n", sock_so_rcvbuf);
 
-    sock_so_rcvbuf = 8388608*2;
-    opt_status = setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &sock_so_rcvbuf, optlen);
-    if (opt_status < 0) {
-        printf("setsockopt() error\n");
-        perror("setsockopt()");
+    /* Allow graceful quit with various signals. Block them before any
+       threads (the DM7820 ISR) exist so they all land on the signalfd. */
+    sigemptyset(&sig_mask);
+    sigaddset(&sig_mask, SIGHUP);
+    sigaddset(&sig_mask, SIGTERM);
+    sigaddset(&sig_mask, SIGINT);
+    sigaddset(&sig_mask, SIGQUIT);
+    if (sigprocmask(SIG_BLOCK, &sig_mask, NULL) < 0) {
+        perror("sigprocmask()");
+    }
+    sig_fd = signalfd(-1, &sig_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd < 0) {
+        perror("signalfd()");
     }
 
-    opt_status = getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &sock_so_rcvbuf, &optlen);
-    if (opt_status < 0) {
-        printf("getsockopt() error\n");
-        perror("getsockopt()");
+    /* Set highest priority */
+    pid = getpid();
+    status = setpriority(PRIO_PROCESS, pid, -20);
+    if (status != 0) {
+        printf("setpriority() fail %d\n", status);
     }
-    printf("so_rcvbuf: %i\n", sock_so_rcvbuf);
-    
 
-    /* Set non-blocking socket */
-    sock_opts = fcntl(sock_fd, F_GETFL);
-    sock_opts = fcntl(sock_fd, F_SETFL, (sock_opts | O_NONBLOCK));
-    if (sock_opts == -1) {
-        printf("Failed to set socket as non-blocking\n");
+    /* Create a socket per source, port 60000 by default */
+    for (i = 0; i < n_sources; i++) {
+        src = &sources[i];
+        src->stream = i;
+        src->st = &st;
+        if (tmif_seq_init(&src->seq, seq_depth, seq_hold_us, release_packet, src) < 0) {
+            return -1;
+        }
+        if (rx_mode == TMIF_RX_RING) {
+            status = tmif_rx_open_ring(&src->rx, rx_ifname, src_addr[i], src_port[i]);
+        } else if (rx_mode == TMIF_RX_URING) {
+            status = tmif_rx_open_uring(&src->rx, src_addr[i], src_port[i], rx_batch);
+        } else {
+            status = tmif_rx_open(&src->rx, rx_mode, src_addr[i], src_port[i],
+                                  rx_batch, rx_gro);
+        }
+        if (status != 0) {
+            printf("Failed to open ingest socket for source %d\n", i);
+        }
     }
 
 
@@ -239,25 +1378,28 @@ int main(void) {
         printf("Failed to open board\n");
         return -1;
     }
+    st.board = output_board;
 
     dm7820_status = DM7820_General_Reset(output_board);
     if (dm7820_status < 0) {
         printf("Failed to reset board \n");
     }
 
-    dm7820_status = init_output_ports(output_board);
+    dm7820_status = init_output_ports(output_board, st.n_chan);
     if (dm7820_status < 0) {
         printf("Failed to set up ports \n");
     }
 
-    dm7820_status = init_output_fifo(output_board);
-    if (dm7820_status < 0) {
-        printf("Failed to set fifo \n");
-    }
+    for (c = 0; c < st.n_chan; c++) {
+        dm7820_status = init_output_fifo(output_board, st.chan[c].fifo);
+        if (dm7820_status < 0) {
+            printf("Failed to set fifo %d \n", c);
+        }
 
-    dm7820_status = init_output_dma(output_board);
-    if (dm7820_status < 0) {
-        printf("Failed to set up DMA \n");
+        dm7820_status = init_output_dma(output_board, st.chan[c].fifo);
+        if (dm7820_status < 0) {
+            printf("Failed to set up DMA %d \n", c);
+        }
     }
 
     dm7820_status = DM7820_General_InstallISR(output_board, ISR);
@@ -267,294 +1409,164 @@ int main(void) {
     dm7820_status = DM7820_General_SetISRPriority(output_board, 99);
     DM7820_Return_Status(dm7820_status, "DM7820_General_SetISRPriority()");
     
-    /* Enable FIFO 0 */
-    dm7820_status = DM7820_FIFO_Enable(output_board, DM7820_FIFO_QUEUE_0, 0xFF);
-    if (dm7820_status < 0) {
-        printf("Failed to enable fifo \n");
-    }
+    for (c = 0; c < st.n_chan; c++) {
+        /* Enable FIFO 0 (and 1) */
+        dm7820_status = DM7820_FIFO_Enable(output_board, st.chan[c].fifo, 0xFF);
+        if (dm7820_status < 0) {
+            printf("Failed to enable fifo %d \n", c);
+        }
 
-    /* Set strobe 2 as input */
-    dm7820_status = DM7820_StdIO_Strobe_Mode(output_board,
-                                             DM7820_STDIO_STROBE_2,
-                                             0x00);
-    if (dm7820_status < 0) {
-        printf("Failed to set strobe to input \n");
-    }
-
-    // dm7820_status = DM7820_General_Enable_Interrupt(output_board,
-    //                                                 DM7820_INTERRUPT_FIFO_0_EMPTY,
-    //                                                 0x00);
-    // dm7820_status = DM7820_General_Enable_Interrupt(output_board,
-    //                                                 DM7820_INTERRUPT_FIFO_0_UNDERFLOW,
-    //                                                 0x00);
-    // dm7820_status = DM7820_General_Enable_Interrupt(output_board,
-    //                                                 DM7820_INTERRUPT_FIFO_0_WRITE_REQUEST,
-    //                                                 0x00);
-    // dm7820_status = DM7820_General_Enable_Interrupt(output_board,
-    //                                                 DM7820_INTERRUPT_FIFO_0_FULL,
-    //                                                 0x00);
-    // dm7820_status = DM7820_General_Enable_Interrupt(output_board,
-    //                                                 DM7820_INTERRUPT_FIFO_0_OVERFLOW, 
-    //                                                 0x00);
-    // dm7820_status = DM7820_General_Enable_Interrupt(output_board,
-    //                                                 DM7820_INTERRUPT_FIFO_0_READ_REQUEST,
-    //                                                 0x00);
-    // dm7820_status = DM7820_General_Enable_Interrupt(output_board,
-    //                                                 DM7820_INTERRUPT_FIFO_0_DMA_DONE,
-    //                                                 0x00);
-
-
-
-    clear_fifo_flags(output_board);
-
-    /* Output FIFOS should be empty */    
-    get_fifo_status(output_board, DM7820_FIFO_QUEUE_0, DM7820_FIFO_STATUS_EMPTY,
-                    &fifo_status);
-    if (!fifo_status) {
-        printf("FIFO 0 NOT empty! \n");
+        /* Set strobe 2 (strobe 1 for FIFO 1) as input */
+        dm7820_status = DM7820_StdIO_Strobe_Mode(output_board,
+                                                 (c == 0) ? DM7820_STDIO_STROBE_2 :
+                                                 DM7820_STDIO_STROBE_1,
+                                                 0x00);
+        if (dm7820_status < 0) {
+            printf("Failed to set strobe to input \n");
+        }
+
+        /* FIFO state for the output scheduler comes from these, see
+           ISR(), rather than from status register reads */
+        init_output_irqs(output_board, st.chan[c].fifo);
+
+        clear_fifo_flags(output_board, st.chan[c].fifo);
+
+        /* Output FIFOS should be empty */    
+        get_fifo_status(output_board, st.chan[c].fifo, DM7820_FIFO_STATUS_EMPTY,
+                        &fifo_status);
+        if (!fifo_status) {
+            printf("FIFO %d NOT empty! \n", c);
+        }
     }
 
     printf("DMA SIZE: %i \n", DMA_USR_BUF_SIZE);
     printf("DMA SAMPLES SIZE: %i \n", DMA_NSAMPLES);
-    /* Create DMA buffers */
-    dm7820_status =
-        DM7820_FIFO_DMA_Create_Buffer(&dma_buf, DMA_USR_BUF_SIZE);
-    if (dm7820_status < 0) {
-        printf("Failed to create DMA buffer \n");
-        perror("DMA BUF: ");
+    for (c = 0; c < st.n_chan; c++) {
+        /* Create DMA buffers */
+        dm7820_status =
+            DM7820_FIFO_DMA_Create_Buffer(&st.chan[c].dma_buf, DMA_USR_BUF_SIZE);
+        if (dm7820_status < 0) {
+            printf("Failed to create DMA buffer \n");
+            perror("DMA BUF: ");
+        }
+        /* Zero out the DMA buffer, don't want spurious words! */
+        memset(st.chan[c].dma_buf, 0, DMA_USR_BUF_SIZE);
+
+        /* DMA stays enabled for the whole run, the ring of buffers is
+           fed with DM7820_FIFO_DMA_Write() as it fills */
+        dm7820_status = DM7820_FIFO_DMA_Enable(output_board,
+                                               st.chan[c].fifo, 0xFF, 0xFF);
+        DM7820_Return_Status(dm7820_status, "DM7820_FIFO_DMA_Enable()");
     }
-    /* Zero out the DMA buffer, don't want spurious words! */
-    memset(dma_buf, 0, DMA_USR_BUF_SIZE);
 
     /* health status... */
-    memset(&sa_health, 0, sizeof(sa_health));
-    sa_health.sa_handler = &health_handler;
-    sigaction(SIGALRM, &sa_health, NULL);
-
-    health_timer.it_value.tv_sec = 0;
-    health_timer.it_value.tv_usec = 500000;
+    timer_fd = open_health_timer();
 
-    /* repeat half second intervals */ 
-    health_timer.it_interval.tv_sec = 0; 
-    health_timer.it_interval.tv_usec = 500000; 
-    /* Start the health timer in "real" time */
-    setitimer(ITIMER_REAL, &health_timer, NULL); 
-
-    /* Allow graceful quit with various signals */
-    memset(&sa_quit, 0, sizeof(sa_quit));
-    sa_quit.sa_handler = &signal_handler;
-
-    sigaction(SIGHUP, &sa_quit, NULL);
-    sigaction(SIGTERM, &sa_quit, NULL);
-    sigaction(SIGINT, &sa_quit, NULL);
-    sigaction(SIGQUIT, &sa_quit, NULL);
-
-    addr_len = sizeof(from_addr);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1()");
+        return -1;
+    }
+    for (i = 0; i < n_sources; i++) {
+        epoll_add(epoll_fd, sources[i].rx.fd);
+    }
+    epoll_add(epoll_fd, timer_fd);
+    epoll_add(epoll_fd, sig_fd);
+    printf("busy-poll window: %d us\n", busy_poll_us);
 
-    status = init_packet_save();
+    set_packet_save_compression(z_level, z_workers);
+    set_packet_save_rotation((uint64_t)(rot_mb*1e6), rot_rows, rot_secs);
+    status = init_packet_save(n_sources);
     if (status != 0) {
         printf("Failed to open packet table!\n");
     }
 
     /* this is the magic. */
     while(loop_switch) {
-    
-        /* Health status bit stuff */
-        if (l_health_bit != g_health_bit) {
-            /* set status bit*/
-            set_status_bit(output_board, 1, l_health_bit, &status_bits);
-            l_health_bit = (l_health_bit + 1)%2;
-        }
-
-        while(1) {
-            // sock_nbytes = recvfrom(sock_fd, 
-            //                        packet_buf, 
-            //                        sizeof(packet_buf), 
-            //                        0, 
-            //                        (struct sockaddr *)&from_addr, 
-            //                        &addr_len);
-
-            sock_nbytes = recvfrom(sock_fd, 
-                                   packet_buf, 
-                                   CU40MMXS_PACKET_SIZE, 
-                                   0, 
-                                   (struct sockaddr *)&from_addr, 
-                                   &addr_len);
-
-	    //printf("sock bytes: %i\n", sock_nbytes);
-
-            if (sock_nbytes == 1470) {
-                // printf("sock bytes: %i\n", sock_nbytes);
-                // printf("Num photons: %u\n", packet_buf[0]);
-                // printf("Packet Count: %u\n", packet_buf[1]);
-                // printf("got packet from: %s\n\n", inet_ntop(from_addr.ss_family, 
-                                                            // &(((struct sockaddr_in*)((struct sockaddr *)&from_addr))->sin_addr), 
-                                                            // s, 
-                                                            // sizeof(s)));
-                /* Check for packet loss */
-                if ((packet_counter + 1) != packet_buf[1]) {
-                    // printf("PACKET COUNTER MISMATCH! \n");
-                    // printf("pc+1: %u\n", (packet_counter + 1));
-                    // printf("pack: %u\n", (packet_buf[1]));
-                    pkt_mismatch_cnt++;
-                }
-                tot_pkt_count++;
-                packet_counter = packet_buf[1];
-
-
-                /* If enough packets have been read, save what we have */
-                if (((uint16_t)(packet_counter - packet_counter_h5)) >= 10) {
-                    //if (pbuf_ind >= 7350) {
-                    //printf("About to save packets %d...\n", pbuf_ind);
-                    //status = save_packets(pbufptr, 10);
-                    status = save_packets(psaveptr, pbuf_ind);
-                    if (status != 0) {
-                        printf("save_packets() failed! %d\n", status);
-                    }
-                    /* Reset packet buffer index */
-                    pbuf_ind = 0;
-                    memset(psave_buf, 0, sizeof(psave_buf));
-                    packet_counter_h5 = packet_counter;
-                }
+        /* Come back for a half waiting on the board, or when the
+           first held packet has waited long enough */
+        n_events = epoll_wait(epoll_fd, events, TMIF_MAX_EVENTS,
+                              wait_ms(&st, sources, n_sources));
+        if (n_events < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait()");
+            }
+            continue;
+        }
 
-                /* If there are photons in the packet do work. */
-                num_photons = packet_buf[0];
-                if (num_photons > 0) {
-                    /* Save packet if there are any photons in it */
-                    status = (int)memcpy(&psave_buf[pbuf_ind*735], &packet_buf, CU40MMXS_PACKET_SIZE);
-                    if (status) {
-                        //pbuf_ind += 735;
-                        pbuf_ind += 1;
-                    } else {
-                        /* eek */
-                        printf("failed to copy memory to packet save buffer\n");
-                    }
-
-                    /* OLD Save to disk! */
-                    //save_packet(pbufptr);
-
-                    for (i = 3; i < 3*(num_photons + 1); i += 3) {
-                        //printf("X, Y: %u, %u\n", packet_buf[i] >> 1 , packet_buf[i+1] >> 1);
-                        //printf("PHD: %u\n", packet_buf[i+2]);
-
-                        if (dma_i < (DMA_NSAMPLES - 100)) {
-                            dma_buf[dma_i] = ((packet_buf[i] >> 1) | 0x2000);
-                            dma_i++;
-                            dma_buf[dma_i] = ((packet_buf[i+1] >> 1) | 0x4000);
-                            dma_i++;
-                            dma_buf[dma_i] = ((packet_buf[i+2]) | 0x6000);
-                            dma_i++;
-                        } else {
-                            printf("dma index too large: %d\n", dma_i);
-                        }
-                    }
+        for (i = 0; i < n_events; i++) {
+            for (j = 0; j < n_sources; j++) {
+                if (events[i].data.fd == sources[j].rx.fd) {
+                    drain_source(&sources[j], busy_poll_us);
                 }
-                
-                /* Write DMA after 3 packets have been processed */
-                //if ((packet_counter - packet_counter_s) > 2) {
-                if (((uint16_t)(packet_counter - packet_counter_s)) > 2) {
-
-                    if (dma_i > 1) {
-                        /* Buffer it all with a 0 */
-                        dma_buf[dma_i] = 0x0000;
-                        dma_i++;
-
-                        /* for (i = 0; i < (dma_i + 1); i++) { */
-			/*     //printf("word: %02X\n", dma_buf[i]); */
-			/*   printf("word: %u %u \n", ((dma_buf[i] & 0xe000) >> 12), dma_buf[i] & 0x1fff); */
-                        /* } */
-                        
-                        /* Calculate number of buffers used */
-                        dma_chk = 1 + ((dma_i - 1)/735);
-                        if (dma_chk > 16) {
-                            printf("ERROR, DMA_CHK: %d\n", dma_chk);
-                        }
-
-                        //printf("dma_chk: %i\n", dma_chk);
-                        //printf("dma_i %i\n", dma_i);
-
-                        /* Make sure fifo isn't full... */
-                        get_fifo_status(output_board, DM7820_FIFO_QUEUE_0,
-                                        DM7820_FIFO_STATUS_FULL,
-                                        &fifo_status);
-                        if (!fifo_status) {
-                            /* Set fifo full status bit low */
-                            set_status_bit(output_board, 2, 0, &status_bits);
-
-                            /* DMA write to output FIFOs */
-                            dm7820_status = DM7820_FIFO_DMA_Write(output_board,
-                                                                  DM7820_FIFO_QUEUE_0,
-                                                                  dma_buf, dma_chk);
-                            DM7820_Return_Status(dm7820_status, "DM7820_FIFO_DMA_Write");
-                            
-                            if (dm7820_status == 0) {
-                                /* Start DMA transfer */
-                                dm7820_status = DM7820_FIFO_DMA_Enable(output_board,
-                                                                       DM7820_FIFO_QUEUE_0, 0xFF, 0xFF);
-                                DM7820_Return_Status(dm7820_status, "DM7820_FIFO_DMA_Enable()");
-
-                                /* Wait for DMA to write out */
-                                if (dm7820_status == 0) {
-                                    while(dma_flag != dma_chk) {
-                                        usleep(5);
-                                    }
-                                    dma_flag = 0;
-                                } else {
-                                    printf("DMA start/enable failed!\n");
-                                }
-
-                            } else {
-                                printf("Didn't start xfer due to dma write failure \n");
-                            }
-
-                            /* Clear all data that's been shipped
-                               off. .*/
-                            memset(dma_buf, 0, sizeof(uint16_t)*(dma_i + 1));
-                            dma_i = 0;
-                        } else {
-                            /* Set fifo full status */
-                            set_status_bit(output_board, 2, 1, &status_bits);
-                            printf("FIFO FULL!\n");
-                        }
-
-                    }
-                    packet_counter_s = packet_counter;
+            }
+            if (events[i].data.fd == timer_fd) {
+                /* Health status bit stuff */
+                heartbeat(timer_fd, &st, &l_health_bit);
+                /* Archive reaches the disk at least this often */
+                flush_packet_save();
+            } else if (events[i].data.fd == sig_fd) {
+                while (read(sig_fd, &sig_info, sizeof(sig_info)) == sizeof(sig_info)) {
+                    printf("Caught signal %u\n", sig_info.ssi_signo);
+                    handle_signal(sig_info.ssi_signo);
                 }
-            } else {
-                /* recvfrom returns negative values due to
-                   non-blocking status. This just means there were no
-                   packets to read! */
-                break;
             }
         }
-        
-        usleep(5);
+        /* Don't leave packets waiting on a quiet source */
+        for (j = 0; j < n_sources; j++) {
+            if (sources[j].seq.n_held) {
+                tmif_seq_expire(&sources[j].seq, tmif_rx_now_ns());
+            }
+        }
+        if (st.image) {
+            put_image(&st);
+        }
+        poll_dma(&st);
     }
 
     printf("Exited main loop \n");
 
-    //status = close_packet_save();
-    // if (status != 0) {
-    //     printf("close packet save fail\n");
-    // }
+    /* Release anything still waiting in the reorder windows and
+       archive what is left in each source's save buffer */
+    for (i = 0; i < n_sources; i++) {
+        src = &sources[i];
+        tmif_seq_flush(&src->seq);
+        if (src->pbuf_ind > 0) {
+            status = save_packets(src->stream, src->psave_buf, src->psave_ns, src->psave_seq,
+                                  src->pbuf_ind);
+            if (status != 0) {
+                printf("save_packets() failed! %d\n", status);
+            }
+            src->pbuf_ind = 0;
+        }
+    }
+    finish_dma(&st);
 
-    /* Disable DMA on FIFO 0 */
-    dm7820_status = DM7820_FIFO_DMA_Enable(output_board,
-                                           DM7820_FIFO_QUEUE_0, 0x00, 0x00);
-    if (dm7820_status < 0) {
-        printf("Failed to disble dma on fifo 0 \n");
+    status = close_packet_save();
+    if (status != 0) {
+        printf("close packet save fail\n");
     }
+    print_packet_save_stats();
+
+    for (c = 0; c < st.n_chan; c++) {
+        /* Disable DMA on FIFO 0 (and 1) */
+        dm7820_status = DM7820_FIFO_DMA_Enable(output_board,
+                                               st.chan[c].fifo, 0x00, 0x00);
+        if (dm7820_status < 0) {
+            printf("Failed to disble dma on fifo %d \n", c);
+        }
     
-    /* Free DMA buffer */
-    dm7820_status =
-        DM7820_FIFO_DMA_Free_Buffer(&dma_buf, DMA_USR_BUF_SIZE);
-    if (dm7820_status < 0) {
-        printf("Error freeing DMA buffer \n");
-    }
+        /* Free DMA buffer */
+        dm7820_status =
+            DM7820_FIFO_DMA_Free_Buffer(&st.chan[c].dma_buf, DMA_USR_BUF_SIZE);
+        if (dm7820_status < 0) {
+            printf("Error freeing DMA buffer \n");
+        }
     
-    dm7820_status = DM7820_FIFO_Enable(output_board, DM7820_FIFO_QUEUE_0, 0x00);
-    if (dm7820_status < 0) {
-        printf("Failed to disable fifo \n");
+        dm7820_status = DM7820_FIFO_Enable(output_board, st.chan[c].fifo, 0x00);
+        if (dm7820_status < 0) {
+            printf("Failed to disable fifo \n");
+        }
     }
 
     /* Close down everything gracefully */
@@ -565,20 +1577,28 @@ int main(void) {
         return -1;
     }
 
-    /* Close the socket! */
-    status = close(sock_fd);
-    if (status < 0) {
-        printf("error closing socket: %d\n", status);
-    }
+    for (i = 0; i < n_sources; i++) {
+        src = &sources[i];
+        printf("Source %d (port %u):\n", i, src->rx.port);
+        printf("Total # of packets: %u\n", src->tot_pkt_count);
+        tmif_seq_print_stats(&src->seq);
+        tmif_rx_print_stats(&src->rx);
+        tmif_seq_free(&src->seq);
 
-    printf("Total packet mismatch: %u\n", pkt_mismatch_cnt);
-    printf("Total # of packets: %u\n", tot_pkt_count);
+        /* Close the socket! */
+        tmif_rx_close(&src->rx);
+    }
+    close(epoll_fd);
+    close(timer_fd);
+    close(sig_fd);
+    print_usage_stats(&st, start_ns);
+    tmif_img_free(&st.img);
 
     return 0;
 }
 
 
-int init_output_ports(DM7820_Board_Descriptor *board) {
+int init_output_ports(DM7820_Board_Descriptor *board, int n_chan) {
     DM7820_Error dm7820_status;
 
     /* Set all port 0 lines as perhipheral output */
@@ -596,6 +1616,22 @@ int init_output_ports(DM7820_Board_Descriptor *board) {
         return -1;
     }
 
+    /* Port 1 carries the second channel */
+    if (n_chan > 1) {
+        dm7820_status =
+            DM7820_StdIO_Set_IO_Mode(board, DM7820_STDIO_PORT_1, 0xFFFF,
+                                     DM7820_STDIO_MODE_PER_OUT);
+        if (dm7820_status < 0) {
+            return -1;
+        }
+
+        dm7820_status =
+            DM7820_StdIO_Set_Output(board, DM7820_STDIO_PORT_1, 0x0000);
+        if (dm7820_status < 0) {
+            return -1;
+        }
+    }
+
     /* Set all used port 2 lines as stdio output */
     dm7820_status =
         DM7820_StdIO_Set_IO_Mode(board, DM7820_STDIO_PORT_2, 0x0007,
@@ -614,63 +1650,71 @@ int init_output_ports(DM7820_Board_Descriptor *board) {
     return 0;
 }
 
-int init_output_fifo(DM7820_Board_Descriptor *board) {
+/* FIFO 0 goes out port 0 clocked by strobe 2 (NSROC strobe), FIFO 1
+   out port 1 clocked by strobe 1 (the encoder's second input) */
+int init_output_fifo(DM7820_Board_Descriptor *board, dm7820_fifo_queue fifo) {
     DM7820_Error dm7820_status;    
+    int second = (fifo == DM7820_FIFO_QUEUE_1);
 
     /* Init Output FIFO */
 
-    /* Disable FIFO 0 */
-    dm7820_status = DM7820_FIFO_Enable(board, DM7820_FIFO_QUEUE_0, 0x00);
+    /* Disable FIFO */
+    dm7820_status = DM7820_FIFO_Enable(board, fifo, 0x00);
     DM7820_Return_Status(dm7820_status, "DM7820_FIFO_Enable()");
     
     /* Set FIFO input clock to PCI write */
     dm7820_status = DM7820_FIFO_Set_Input_Clock(board,
-                                                DM7820_FIFO_QUEUE_0,
+                                                fifo,
                                                 DM7820_FIFO_INPUT_CLOCK_PCI_WRITE);
     DM7820_Return_Status(dm7820_status, "DM7820_FIFO_Set_Input_Clock()");
     
-    /* Set FIFO 0 output clock to strobe 2 (NSROC strobe) */
+    /* Set FIFO 0 output clock to strobe 2 (NSROC strobe), FIFO 1 to
+       strobe 1 */
     dm7820_status = DM7820_FIFO_Set_Output_Clock(board,
-                                                 DM7820_FIFO_QUEUE_0,
+                                                 fifo,
+                                                 second ? DM7820_FIFO_OUTPUT_CLOCK_STROBE_1 :
                                                  DM7820_FIFO_OUTPUT_CLOCK_STROBE_2);
     DM7820_Return_Status(dm7820_status, "DM7820_FIFO_Set_Output_Clock()");
 
-    /* Set FIFO 0 data input to PCI data */
+    /* Set FIFO data input to PCI data */
     dm7820_status = DM7820_FIFO_Set_Data_Input(board,
-                                               DM7820_FIFO_QUEUE_0,
+                                               fifo,
+                                               second ? DM7820_FIFO_1_DATA_INPUT_PCI_DATA :
                                                DM7820_FIFO_0_DATA_INPUT_PCI_DATA);
     DM7820_Return_Status(dm7820_status, "DM7820_FIFO_Set_Data_Input()");
 
     dm7820_status = DM7820_FIFO_Set_DMA_Request(board,
-                                                DM7820_FIFO_QUEUE_0,
+                                                fifo,
                                                 DM7820_FIFO_DMA_REQUEST_WRITE);
     DM7820_Return_Status(dm7820_status, "DM7820_FIFO_Set_DMA_Request()");
 
-    /* Set the FIFO 0 output to port 0 */
+    /* Set the FIFO 0 output to port 0, FIFO 1 to port 1 */
     /* The mask is 0xFFFF for a full 16 bit word */
     dm7820_status = DM7820_StdIO_Set_Periph_Mode(board,
+                                                 second ? DM7820_STDIO_PORT_1 :
                                                  DM7820_STDIO_PORT_0,
                                                  0xFFFF,
+                                                 second ? DM7820_STDIO_PERIPH_FIFO_1 :
                                                  DM7820_STDIO_PERIPH_FIFO_0);
     DM7820_Return_Status(dm7820_status, "DM7820_StdIO_Set_Periph_Mode()");
 
     return 0;
 }
 
-int init_output_dma(DM7820_Board_Descriptor *board) {
+int init_output_dma(DM7820_Board_Descriptor *board, dm7820_fifo_queue fifo) {
     DM7820_Error dm7820_status;    
 
-    /*  Initializing DMA 0 */
+    /*  Initializing DMA */
     //syslog(LOG_INFO, "Initializing DMA 0 ...");
     dm7820_status = DM7820_FIFO_DMA_Initialize(board,
-                                               DM7820_FIFO_QUEUE_0,
+                                               fifo,
                                                DMA_BUF_NUM, DMA_BUF_SIZE);
     DM7820_Return_Status(dm7820_status, "DM7820_FIFO_DMA_Initialize()");
 
-    /*  Configuring DMA 0 */
+    /*  Configuring DMA */
     //syslog(LOG_INFO, "    Configuring DMA 0 ...");
     dm7820_status = DM7820_FIFO_DMA_Configure(board,
-                                              DM7820_FIFO_QUEUE_0,
+                                              fifo,
                                               DM7820_DMA_DEMAND_ON_PCI_TO_DM7820,
                                               DMA_BUF_SIZE);
     DM7820_Return_Status(dm7820_status, "DM7820_FIFO_DMA_Configure()");
@@ -678,29 +1722,58 @@ int init_output_dma(DM7820_Board_Descriptor *board) {
     return 0;
 }
 
-void clear_fifo_flags(DM7820_Board_Descriptor *board) {
+/* Enable the FIFO's EMPTY, FULL and UNDERFLOW interrupts, the ISR
+   keeps its state from them */
+int init_output_irqs(DM7820_Board_Descriptor *board, dm7820_fifo_queue fifo) {
+    DM7820_Error dm7820_status;
+    int second = (fifo == DM7820_FIFO_QUEUE_1);
+    int error = 0;
+
+    dm7820_status = DM7820_General_Enable_Interrupt(board,
+                                                    second ? DM7820_INTERRUPT_FIFO_1_EMPTY :
+                                                    DM7820_INTERRUPT_FIFO_0_EMPTY,
+                                                    0xFF);
+    DM7820_Return_Status(dm7820_status, "DM7820_General_Enable_Interrupt(EMPTY)");
+    error += (dm7820_status != 0);
+    dm7820_status = DM7820_General_Enable_Interrupt(board,
+                                                    second ? DM7820_INTERRUPT_FIFO_1_FULL :
+                                                    DM7820_INTERRUPT_FIFO_0_FULL,
+                                                    0xFF);
+    DM7820_Return_Status(dm7820_status, "DM7820_General_Enable_Interrupt(FULL)");
+    error += (dm7820_status != 0);
+    dm7820_status = DM7820_General_Enable_Interrupt(board,
+                                                    second ? DM7820_INTERRUPT_FIFO_1_UNDERFLOW :
+                                                    DM7820_INTERRUPT_FIFO_0_UNDERFLOW,
+                                                    0xFF);
+    DM7820_Return_Status(dm7820_status, "DM7820_General_Enable_Interrupt(UNDERFLOW)");
+    error += (dm7820_status != 0);
+
+    return error;
+}
+
+void clear_fifo_flags(DM7820_Board_Descriptor *board, dm7820_fifo_queue fifo) {
     uint8_t fifo_status;
 
     //syslog(LOG_INFO, "Clearing FIFO flags...");
     //fprintf(stdout, "Clearing FIFO flags... \n");
 
     //fprintf(stdout, "Clearing FIFO 0 status empty flag ...\n");
-    get_fifo_status(board, DM7820_FIFO_QUEUE_0, DM7820_FIFO_STATUS_EMPTY,
+    get_fifo_status(board, fifo, DM7820_FIFO_STATUS_EMPTY,
                     &fifo_status);
 
     /* Clear FIFO status full flag without checking its state */
     //fprintf(stdout, "Clearing FIFO 0 status full flag ...\n");
-    get_fifo_status(board, DM7820_FIFO_QUEUE_0, DM7820_FIFO_STATUS_FULL,
+    get_fifo_status(board, fifo, DM7820_FIFO_STATUS_FULL,
                     &fifo_status);
 
     /* Clear FIFO status overflow flag without checking its state */
     //fprintf(stdout, "Clearing FIFO 0 status overflow flag ...\n");
-    get_fifo_status(board, DM7820_FIFO_QUEUE_0, DM7820_FIFO_STATUS_OVERFLOW,
+    get_fifo_status(board, fifo, DM7820_FIFO_STATUS_OVERFLOW,
                     &fifo_status);
 
     /* Clear FIFO status underflow flag without checking its state */
     //fprintf(stdout, "Clearing FIFO 0 status underflow flag ...\n");
-    get_fifo_status(board, DM7820_FIFO_QUEUE_0,
+    get_fifo_status(board, fifo,
                     DM7820_FIFO_STATUS_UNDERFLOW, &fifo_status);
 }
 
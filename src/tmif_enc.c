@@ -0,0 +1,258 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Photon encoder kernels, see tmif_enc.h. The tag pattern repeats
+   every 3 words, so the vector kernels take 8 (SSE2) or 16 (AVX2)
+   photons at a time as three registers each, and per lane either keep
+   the word (phd) or shift it down one (x, y) before ORing in its tag:
+
+   out = ((w >> 1) & keep) | (w & ~keep) | tag
+
+   The AVX2 kernel is compiled for AVX2 with a target attribute, so
+   the rest of tmif still runs on anything, and only used if the CPU
+   says it has it.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tmif_enc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TMIF_ENC_X86 1
+#include <immintrin.h>
+#endif
+
+#define TAGS3 TMIF_TAG_X, TMIF_TAG_Y, TMIF_TAG_PHD
+#define KEEP3 0xFFFF, 0xFFFF, 0x0000
+
+/* Per-lane tag and shift mask of 16 photons (48 words), the first 24
+   serve SSE2 */
+static const uint16_t enc_tag[48] __attribute__((aligned(32))) = {
+    TAGS3, TAGS3, TAGS3, TAGS3, TAGS3, TAGS3, TAGS3, TAGS3,
+    TAGS3, TAGS3, TAGS3, TAGS3, TAGS3, TAGS3, TAGS3, TAGS3
+};
+static const uint16_t enc_keep[48] __attribute__((aligned(32))) = {
+    KEEP3, KEEP3, KEEP3, KEEP3, KEEP3, KEEP3, KEEP3, KEEP3,
+    KEEP3, KEEP3, KEEP3, KEEP3, KEEP3, KEEP3, KEEP3, KEEP3
+};
+
+static const char *enc_names[TMIF_ENC_LEVELS] = {"scalar", "sse2", "avx2"};
+
+/* Field widths the tagged words carry */
+#define PACK_FIELD_BITS TMIF_WORD_BITS
+#define PACK_FIELD_MASK ((1 << PACK_FIELD_BITS) - 1)
+
+
+static void enc_scalar(uint16_t *dst, const uint16_t *src, int n) {
+    int i = 0;
+
+    for (i = 0; i < 3*n; i += 3) {
+        dst[i] = ((src[i] >> 1) | TMIF_TAG_X);
+        dst[i+1] = ((src[i+1] >> 1) | TMIF_TAG_Y);
+        dst[i+2] = ((src[i+2]) | TMIF_TAG_PHD);
+    }
+}
+
+#ifdef TMIF_ENC_X86
+static void enc_sse2(uint16_t *dst, const uint16_t *src, int n) {
+    __m128i tag[3];
+    __m128i keep[3];
+    __m128i w;
+    int k = 0;
+    int i = 0;
+
+    for (k = 0; k < 3; k++) {
+        tag[k] = _mm_load_si128((const __m128i *)&enc_tag[8*k]);
+        keep[k] = _mm_load_si128((const __m128i *)&enc_keep[8*k]);
+    }
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        for (k = 0; k < 3; k++) {
+            w = _mm_loadu_si128((const __m128i *)&src[3*i + 8*k]);
+            w = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi16(w, 1), keep[k]),
+                                          _mm_andnot_si128(keep[k], w)),
+                             tag[k]);
+            _mm_storeu_si128((__m128i *)&dst[3*i + 8*k], w);
+        }
+    }
+    enc_scalar(&dst[3*i], &src[3*i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void enc_avx2(uint16_t *dst, const uint16_t *src, int n) {
+    __m256i tag[3];
+    __m256i keep[3];
+    __m256i w;
+    int k = 0;
+    int i = 0;
+
+    for (k = 0; k < 3; k++) {
+        tag[k] = _mm256_load_si256((const __m256i *)&enc_tag[16*k]);
+        keep[k] = _mm256_load_si256((const __m256i *)&enc_keep[16*k]);
+    }
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        for (k = 0; k < 3; k++) {
+            w = _mm256_loadu_si256((const __m256i *)&src[3*i + 16*k]);
+            w = _mm256_or_si256(_mm256_blendv_epi8(w, _mm256_srli_epi16(w, 1), keep[k]),
+                                tag[k]);
+            _mm256_storeu_si256((__m256i *)&dst[3*i + 16*k], w);
+        }
+    }
+    /* up to 15 left, one more SSE2 round and the scalar loop. The
+       SSE2 kernel is legacy encoded, clear the upper halves first or
+       every instruction in it pays for the AVX/SSE transition. */
+    _mm256_zeroupper();
+    enc_sse2(&dst[3*i], &src[3*i], n - i);
+}
+#endif
+
+static tmif_enc_fn enc = enc_scalar;
+
+
+/* Kernel for level, NULL if this CPU (or build) can't run it */
+tmif_enc_fn tmif_enc_kernel(int level) {
+    switch (level) {
+    case TMIF_ENC_SCALAR:
+        return enc_scalar;
+#ifdef TMIF_ENC_X86
+    case TMIF_ENC_SSE2:
+        return __builtin_cpu_supports("sse2") ? enc_sse2 : NULL;
+    case TMIF_ENC_AVX2:
+        return __builtin_cpu_supports("avx2") ? enc_avx2 : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+/* Use the best kernel this CPU has, no better than max_level.
+   Returns the level picked. */
+int tmif_enc_init(int max_level) {
+    int level = 0;
+
+    if (max_level >= TMIF_ENC_LEVELS) {
+        max_level = TMIF_ENC_LEVELS - 1;
+    }
+    for (level = max_level; level > TMIF_ENC_SCALAR; level--) {
+        if (tmif_enc_kernel(level)) {
+            break;
+        }
+    }
+    enc = tmif_enc_kernel(level);
+
+    return level;
+}
+
+/* Encode n photons from src into 3*n words at dst */
+void tmif_enc_photons(uint16_t *dst, const uint16_t *src, int n) {
+    enc(dst, src, n);
+}
+
+const char *tmif_enc_name(int level) {
+    if ((level < 0) || (level >= TMIF_ENC_LEVELS)) {
+        return "unknown";
+    }
+    return enc_names[level];
+}
+
+/* Level for a kernel name, -1 if there is none */
+int tmif_enc_parse(const char *name) {
+    int level = 0;
+
+    for (level = 0; level < TMIF_ENC_LEVELS; level++) {
+        if (strcmp(name, enc_names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+/* Can the layout be sent? Every field fits 13 bits, unpacked phd
+   too, and the photon fits two words. */
+static int pack_ok(const tmif_pack_t *pk) {
+    return (pk->x_bits >= 1) && (pk->x_bits <= PACK_FIELD_BITS) &&
+        (pk->y_bits >= 1) && (pk->y_bits <= PACK_FIELD_BITS) &&
+        (pk->phd_bits >= 0) && (pk->phd_shift >= 0) &&
+        (pk->phd_bits + pk->phd_shift <= PACK_FIELD_BITS) &&
+        (pk->x_bits + pk->y_bits + pk->phd_bits <= 2*PACK_FIELD_BITS);
+}
+
+/* Layout from "x_bits:y_bits:phd_bits[:phd_shift]", -1 if it isn't
+   one */
+int tmif_pack_parse(const char *arg, tmif_pack_t *pk) {
+    memset(pk, 0, sizeof(*pk));
+    if (sscanf(arg, "%d:%d:%d:%d", &pk->x_bits, &pk->y_bits, &pk->phd_bits,
+               &pk->phd_shift) < 3) {
+        return -1;
+    }
+    return pack_ok(pk) ? 0 : -1;
+}
+
+/* Words per packed photon */
+int tmif_pack_words(const tmif_pack_t *pk) {
+    return (pk->x_bits + pk->y_bits + pk->phd_bits <= PACK_FIELD_BITS) ? 1 : 2;
+}
+
+/* The layout as a TMIF_FRM_MODE frame's param, 4 bits a field */
+uint16_t tmif_pack_param(const tmif_pack_t *pk) {
+    return (uint16_t)((pk->x_bits << 12) | (pk->y_bits << 8) |
+                      (pk->phd_bits << 4) | pk->phd_shift);
+}
+
+int tmif_pack_unparam(uint16_t param, tmif_pack_t *pk) {
+    pk->x_bits = param >> 12;
+    pk->y_bits = (param >> 8) & 0xF;
+    pk->phd_bits = (param >> 4) & 0xF;
+    pk->phd_shift = param & 0xF;
+
+    return pack_ok(pk) ? 0 : -1;
+}
+
+/* Pack n photons from src into tmif_pack_words() words each at dst */
+void tmif_enc_pack(uint16_t *dst, const uint16_t *src, int n, const tmif_pack_t *pk) {
+    int x_shift = PACK_FIELD_BITS - pk->x_bits;
+    int y_shift = PACK_FIELD_BITS - pk->y_bits;
+    uint32_t phd_max = (1u << pk->phd_bits) - 1;
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t phd = 0;
+    uint32_t v = 0;
+    int i = 0;
+
+    for (i = 0; i < n; i++) {
+        x = src[3*i] >> 1;
+        y = src[3*i + 1] >> 1;
+        phd = src[3*i + 2] >> pk->phd_shift;
+        x = (x > PACK_FIELD_MASK) ? PACK_FIELD_MASK : x;
+        y = (y > PACK_FIELD_MASK) ? PACK_FIELD_MASK : y;
+        phd = (phd > phd_max) ? phd_max : phd;
+        v = ((((x >> x_shift) << pk->y_bits) | (y >> y_shift)) << pk->phd_bits) | phd;
+
+        if (pk->x_bits + pk->y_bits + pk->phd_bits <= PACK_FIELD_BITS) {
+            dst[i] = TMIF_TAG_PACK_HI | v;
+        } else {
+            dst[2*i] = TMIF_TAG_PACK_HI | (v >> PACK_FIELD_BITS);
+            dst[2*i + 1] = TMIF_TAG_PACK_LO | (v & PACK_FIELD_MASK);
+        }
+    }
+}
+
+/* Back to the three tagged words, each field at the middle of its
+   bin. v is the packed photon's bits, both words' for two. */
+void tmif_enc_unpack(uint16_t *dst, uint32_t v, const tmif_pack_t *pk) {
+    int x_shift = PACK_FIELD_BITS - pk->x_bits;
+    int y_shift = PACK_FIELD_BITS - pk->y_bits;
+    uint32_t phd = v & ((1u << pk->phd_bits) - 1);
+    uint32_t y = (v >> pk->phd_bits) & ((1u << pk->y_bits) - 1);
+    uint32_t x = (v >> (pk->phd_bits + pk->y_bits)) & ((1u << pk->x_bits) - 1);
+
+    x = (x << x_shift) | (x_shift ? (1u << (x_shift - 1)) : 0);
+    y = (y << y_shift) | (y_shift ? (1u << (y_shift - 1)) : 0);
+    phd = (phd << pk->phd_shift) | (pk->phd_shift ? (1u << (pk->phd_shift - 1)) : 0);
+
+    dst[0] = x | TMIF_TAG_X;
+    dst[1] = y | TMIF_TAG_Y;
+    dst[2] = phd | TMIF_TAG_PHD;
+}
@@ -0,0 +1,80 @@
+#ifndef TMIF_ENC_H_
+#define TMIF_ENC_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Photon to telemetry word encoder. Each CU40MMXS photon (x, y, phd)
+   goes out as three tagged 16 bit words:
+
+   x >> 1 | TMIF_TAG_X
+   y >> 1 | TMIF_TAG_Y
+   phd    | TMIF_TAG_PHD
+
+   A packet's photons are encoded in one pass by an SSE2 or AVX2
+   kernel picked at run time, or the scalar loop where neither is
+   available. All give the same words.
+
+   Packed photons are the lossy high rate form, x, y and phd binned to
+   fewer bits and packed msb first, x y phd, into one word
+
+   TMIF_TAG_PACK_HI | v                          (13 bits or fewer)
+
+   or two
+
+   TMIF_TAG_PACK_HI | v >> 13, TMIF_TAG_PACK_LO | v & 0x1FFF
+
+   The layout (tmif_pack_t) is sent ahead of them in a TMIF_FRM_MODE
+   frame, the words mean nothing without it.
+*/
+
+#include <stdint.h>
+
+/* Telemetry word tags */
+#define TMIF_TAG_X 0x2000
+#define TMIF_TAG_Y 0x4000
+#define TMIF_TAG_PHD 0x6000
+/* Channel sequence marker, 0x8000 | 13 bit sequence number */
+#define TMIF_MARKER 0x8000
+#define TMIF_MARKER_MASK 0x1FFF
+/* Frame header, 0xA000 | frame type, see tmif_frm.h */
+#define TMIF_FRAME 0xA000
+/* Packed photon words */
+#define TMIF_TAG_PACK_HI 0xC000
+#define TMIF_TAG_PACK_LO 0xE000
+/* Top three bits of a word, its tag, and the 13 under it */
+#define TMIF_TAG_MASK 0xE000
+#define TMIF_WORD_BITS 13
+
+/* Encoder kernels, in order of preference */
+#define TMIF_ENC_SCALAR 0
+#define TMIF_ENC_SSE2 1
+#define TMIF_ENC_AVX2 2
+#define TMIF_ENC_LEVELS 3
+
+/* Encode n photons from src (x, y, phd triples) into 3*n words at
+   dst */
+typedef void (*tmif_enc_fn)(uint16_t *, const uint16_t *, int);
+
+/* Packed photon layout: the top x_bits and y_bits of the 13 bit x >> 1
+   and y >> 1, and phd >> phd_shift in phd_bits (saturating) */
+typedef struct {
+    int x_bits;
+    int y_bits;
+    int phd_bits;
+    int phd_shift;
+} tmif_pack_t;
+
+int tmif_enc_init(int);
+void tmif_enc_photons(uint16_t *, const uint16_t *, int);
+tmif_enc_fn tmif_enc_kernel(int);
+const char *tmif_enc_name(int);
+int tmif_enc_parse(const char *);
+int tmif_pack_parse(const char *, tmif_pack_t *);
+int tmif_pack_words(const tmif_pack_t *);
+uint16_t tmif_pack_param(const tmif_pack_t *);
+int tmif_pack_unparam(uint16_t, tmif_pack_t *);
+void tmif_enc_pack(uint16_t *, const uint16_t *, int, const tmif_pack_t *);
+void tmif_enc_unpack(uint16_t *, uint32_t, const tmif_pack_t *);
+
+#endif /* TMIF_ENC_H_ */
@@ -0,0 +1,48 @@
+#ifndef TMIF_EVT_H_
+#define TMIF_EVT_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Flat columnar photon event file written by h5export. Made to be
+   mmap()ed: a TMIF_EVT_ALIGN byte header block, then one contiguous
+   array per column, each starting on a TMIF_EVT_ALIGN boundary at
+   col_offset[]. Events are in packet table order, little endian.
+
+   x      uint16  raw x word
+   y      uint16  raw y word
+   phd    uint16  pulse height
+   rx_ns  int64   kernel receive time of the photon's packet, ns
+
+   e.g. x = (uint16_t *)(map + hdr->col_offset[TMIF_EVT_X]);
+*/
+
+#include <stdint.h>
+
+#define TMIF_EVT_MAGIC "TMIFEVT1"
+#define TMIF_EVT_VERSION 1
+/* Header block size and column alignment */
+#define TMIF_EVT_ALIGN 4096
+
+/* Column numbers */
+#define TMIF_EVT_X 0
+#define TMIF_EVT_Y 1
+#define TMIF_EVT_PHD 2
+#define TMIF_EVT_RX_NS 3
+#define TMIF_EVT_COLS 4
+
+/* Header at the start of the file, the rest of the block is zero */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_cols;
+    uint64_t n_events;
+    /* packet table rows the events came from */
+    uint64_t n_packets;
+    uint64_t col_offset[TMIF_EVT_COLS];
+    /* bytes per element of each column */
+    uint32_t col_size[TMIF_EVT_COLS];
+    char col_name[TMIF_EVT_COLS][8];
+} tmif_evt_header_t;
+
+#endif /* TMIF_EVT_H_ */
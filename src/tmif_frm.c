@@ -0,0 +1,389 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Telemetry frames and the compressed photon frame, see tmif_frm.h.
+   Both ends are here, tmif builds frames and the ground decoder
+   parses them.
+*/
+
+#include <string.h>
+
+#include "tmif_frm.h"
+
+/* Photon fields as the tagged words carry them, 13 bits each */
+#define FRM_FIELD_BITS 13
+#define FRM_FIELD_MASK ((1 << FRM_FIELD_BITS) - 1)
+/* (y << 13 | x) sort and delta key */
+#define FRM_KEY_BITS (2*FRM_FIELD_BITS)
+/* Rice quotients this long or longer are sent as an escape and the
+   raw value, so one odd delta can't blow up the frame */
+#define FRM_RICE_ESC 20
+/* Radix sort digit, 4 passes cover the 39 bit (key, phd) item */
+#define FRM_RADIX_BITS 10
+#define FRM_RADIX_PASSES 4
+/* Fewer items than this are insertion sorted, the radix passes'
+   bucket clearing would cost more */
+#define FRM_INSERTION_MAX 48
+
+/* Bit stream over 16 bit words, most significant bit first */
+typedef struct {
+    uint16_t *w;
+    int max;
+    int i;
+    uint32_t acc;
+    int bits;
+} frm_bits_t;
+
+typedef struct {
+    const uint16_t *w;
+    int n;
+    int i;
+    uint32_t acc;
+    int bits;
+} frm_read_t;
+
+static uint16_t crc_table[256];
+static int crc_ready = 0;
+
+
+static void crc_init(void) {
+    uint16_t crc = 0;
+    int i = 0;
+    int b = 0;
+
+    for (i = 0; i < 256; i++) {
+        crc = (uint16_t)(i << 8);
+        for (b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+        crc_table[i] = crc;
+    }
+    crc_ready = 1;
+}
+
+/* CRC-16/CCITT (0x1021, start 0xFFFF) of n words, high byte first */
+static uint16_t frm_crc(const uint16_t *w, int n) {
+    uint16_t crc = 0xFFFF;
+    int i = 0;
+
+    if (!crc_ready) {
+        crc_init();
+    }
+    for (i = 0; i < n; i++) {
+        crc = (uint16_t)(crc << 8) ^ crc_table[((crc >> 8) ^ (w[i] >> 8)) & 0xFF];
+        crc = (uint16_t)(crc << 8) ^ crc_table[((crc >> 8) ^ w[i]) & 0xFF];
+    }
+    return crc;
+}
+
+/* Append the low n (<= 16) bits of v, -1 if out of words */
+static int put_bits(frm_bits_t *b, uint32_t v, int n) {
+    b->acc = (b->acc << n) | (v & ((1u << n) - 1));
+    b->bits += n;
+    if (b->bits >= 16) {
+        if (b->i >= b->max) {
+            return -1;
+        }
+        b->bits -= 16;
+        b->w[b->i++] = (uint16_t)(b->acc >> b->bits);
+    }
+    return 0;
+}
+
+/* Up to 32 bits */
+static int put_long(frm_bits_t *b, uint32_t v, int n) {
+    if (n > 16) {
+        if (put_bits(b, v >> 16, n - 16) < 0) {
+            return -1;
+        }
+        n = 16;
+    }
+    return put_bits(b, v, n);
+}
+
+/* Rice code: the quotient v >> k in unary (ones and a zero), then the
+   low k bits. A quotient of FRM_RICE_ESC or more is FRM_RICE_ESC ones
+   and v in width bits. */
+static int put_rice(frm_bits_t *b, uint32_t v, int k, int width) {
+    uint32_t q = v >> k;
+
+    if (q >= FRM_RICE_ESC) {
+        return ((put_bits(b, 0xFFFF, 16) < 0) ||
+                (put_bits(b, 0xF, FRM_RICE_ESC - 16) < 0) ||
+                (put_long(b, v, width) < 0)) ? -1 : 0;
+    }
+    if (q >= 16) {
+        if (put_bits(b, 0xFFFF, 16) < 0) {
+            return -1;
+        }
+        q -= 16;
+    }
+    if (put_bits(b, ((1u << q) - 1) << 1, q + 1) < 0) {
+        return -1;
+    }
+    return (k > 0) ? put_long(b, v, k) : 0;
+}
+
+/* Pad out the last word with zeros, returns the words written */
+static int flush_bits(frm_bits_t *b) {
+    if ((b->bits > 0) && (put_bits(b, 0, 16 - b->bits) < 0)) {
+        return -1;
+    }
+    return b->i;
+}
+
+/* Next n (<= 16) bits, -1 past the end */
+static int32_t get_bits(frm_read_t *r, int n) {
+    if (r->bits < n) {
+        if (r->i >= r->n) {
+            return -1;
+        }
+        r->acc = (r->acc << 16) | r->w[r->i++];
+        r->bits += 16;
+    }
+    r->bits -= n;
+    return (int32_t)((r->acc >> r->bits) & ((1u << n) - 1));
+}
+
+static int32_t get_long(frm_read_t *r, int n) {
+    int32_t hi = 0;
+    int32_t lo = 0;
+
+    if (n <= 16) {
+        return get_bits(r, n);
+    }
+    hi = get_bits(r, n - 16);
+    lo = get_bits(r, 16);
+    if ((hi < 0) || (lo < 0)) {
+        return -1;
+    }
+    return (hi << 16) | lo;
+}
+
+static int32_t get_rice(frm_read_t *r, int k, int width) {
+    int32_t q = 0;
+    int32_t bit = 0;
+    int32_t low = 0;
+
+    while ((bit = get_bits(r, 1)) == 1) {
+        if (++q == FRM_RICE_ESC) {
+            return get_long(r, width);
+        }
+    }
+    if (bit < 0) {
+        return -1;
+    }
+    if (k > 0) {
+        low = get_long(r, k);
+        if (low < 0) {
+            return -1;
+        }
+    }
+    return (q << k) | low;
+}
+
+/* Rice parameter for values averaging sum/n, floor(log2(mean)) */
+static int rice_k(uint64_t sum, int n, int width) {
+    uint64_t mean = sum/(uint64_t)n;
+    int k = 0;
+
+    while ((k < width - 1) && (mean >> (k + 1))) {
+        k++;
+    }
+    return k;
+}
+
+/* Sort n items in a. LSD radix sort, FRM_RADIX_PASSES (even) passes
+   through tmp leave them back in a. */
+static void sort_items(uint64_t *a, uint64_t *tmp, int n) {
+    uint16_t pos[1 << FRM_RADIX_BITS];
+    uint64_t *from = a;
+    uint64_t *to = tmp;
+    uint64_t *swap;
+    uint16_t sum = 0;
+    uint16_t c = 0;
+    int shift = 0;
+    int pass = 0;
+    uint64_t v = 0;
+    int d = 0;
+    int i = 0;
+    int j = 0;
+
+    if (n < FRM_INSERTION_MAX) {
+        for (i = 1; i < n; i++) {
+            v = a[i];
+            for (j = i; (j > 0) && (a[j - 1] > v); j--) {
+                a[j] = a[j - 1];
+            }
+            a[j] = v;
+        }
+        return;
+    }
+
+    for (pass = 0; pass < FRM_RADIX_PASSES; pass++) {
+        shift = pass*FRM_RADIX_BITS;
+        memset(pos, 0, sizeof(pos));
+        for (i = 0; i < n; i++) {
+            pos[(from[i] >> shift) & ((1 << FRM_RADIX_BITS) - 1)]++;
+        }
+        sum = 0;
+        for (d = 0; d < (1 << FRM_RADIX_BITS); d++) {
+            c = pos[d];
+            pos[d] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n; i++) {
+            to[pos[(from[i] >> shift) & ((1 << FRM_RADIX_BITS) - 1)]++] = from[i];
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+}
+
+
+/* Fill in the header and CRC of the frame whose length payload words
+   are already at frame + TMIF_FRM_HEADER. Returns the frame's words. */
+int tmif_frm_close(uint16_t *frame, int type, int count, uint16_t param, int length) {
+    frame[0] = TMIF_FRAME | (type & ~TMIF_TAG_MASK);
+    frame[1] = (uint16_t)length;
+    frame[2] = (uint16_t)count;
+    frame[3] = param;
+    frame[TMIF_FRM_HEADER + length] = frm_crc(frame, TMIF_FRM_HEADER + length);
+
+    return length + TMIF_FRM_OVERHEAD;
+}
+
+/* Is there a whole frame with a good CRC at the start of the n words
+   at w? Returns its words and fills in f if so, -1 if not. */
+int tmif_frm_parse(const uint16_t *w, int n, tmif_frm_t *f) {
+    int length = 0;
+
+    if ((n < TMIF_FRM_OVERHEAD) || ((w[0] & TMIF_TAG_MASK) != TMIF_FRAME)) {
+        return -1;
+    }
+    length = w[1];
+    if ((length + TMIF_FRM_OVERHEAD > n) ||
+        (frm_crc(w, TMIF_FRM_HEADER + length) != w[TMIF_FRM_HEADER + length])) {
+        return -1;
+    }
+    f->type = w[0] & ~TMIF_TAG_MASK;
+    f->count = w[2];
+    f->param = w[3];
+    f->length = length;
+    f->payload = w + TMIF_FRM_HEADER;
+
+    return length + TMIF_FRM_OVERHEAD;
+}
+
+/* Compress n photons (x, y, phd triples as in the packet) into a
+   TMIF_FRM_PHOTONS frame at frame, at most max_words long. Returns the
+   frame's words, or -1 if it would be no shorter than the 3*n tagged
+   words or a field doesn't fit them, and the photons should go out
+   tagged. */
+int tmif_frm_photons(uint16_t *frame, int max_words, const uint16_t *p, int n) {
+    uint64_t item[TMIF_FRM_MAX_PHOTONS];
+    uint64_t tmp[TMIF_FRM_MAX_PHOTONS];
+    uint64_t key_sum = 0;
+    uint64_t phd_sum = 0;
+    uint32_t key = 0;
+    uint32_t last = 0;
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t phd = 0;
+    frm_bits_t b;
+    int key_k = 0;
+    int phd_k = 0;
+    int length = 0;
+    int i = 0;
+
+    if ((n < 1) || (n > TMIF_FRM_MAX_PHOTONS)) {
+        return -1;
+    }
+    if (max_words > 3*n - 1) {
+        max_words = 3*n - 1;
+    }
+    if (max_words <= TMIF_FRM_OVERHEAD) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        x = p[3*i] >> 1;
+        y = p[3*i + 1] >> 1;
+        phd = p[3*i + 2];
+        if ((x | y | phd) > FRM_FIELD_MASK) {
+            return -1;
+        }
+        item[i] = ((uint64_t)((y << FRM_FIELD_BITS) | x) << FRM_FIELD_BITS) | phd;
+    }
+    sort_items(item, tmp, n);
+
+    for (i = 0; i < n; i++) {
+        key = (uint32_t)(item[i] >> FRM_FIELD_BITS);
+        key_sum += key - last;
+        phd_sum += item[i] & FRM_FIELD_MASK;
+        last = key;
+    }
+    key_k = rice_k(key_sum, n, FRM_KEY_BITS);
+    phd_k = rice_k(phd_sum, n, FRM_FIELD_BITS);
+
+    memset(&b, 0, sizeof(b));
+    b.w = frame + TMIF_FRM_HEADER;
+    b.max = max_words - TMIF_FRM_OVERHEAD;
+    last = 0;
+    for (i = 0; i < n; i++) {
+        key = (uint32_t)(item[i] >> FRM_FIELD_BITS);
+        if ((put_rice(&b, key - last, key_k, FRM_KEY_BITS) < 0) ||
+            (put_rice(&b, item[i] & FRM_FIELD_MASK, phd_k, FRM_FIELD_BITS) < 0)) {
+            return -1;
+        }
+        last = key;
+    }
+    length = flush_bits(&b);
+    if (length < 0) {
+        return -1;
+    }
+
+    return tmif_frm_close(frame, TMIF_FRM_PHOTONS, n, (uint16_t)((key_k << 8) | phd_k), length);
+}
+
+/* Decode a TMIF_FRM_PHOTONS frame into its 3*count tagged words.
+   Returns the photons, -1 if the payload doesn't decode to exactly
+   that many. */
+int tmif_frm_unphotons(const tmif_frm_t *f, uint16_t *words) {
+    frm_read_t r;
+    int key_k = f->param >> 8;
+    int phd_k = f->param & 0xFF;
+    int32_t delta = 0;
+    int32_t phd = 0;
+    uint32_t key = 0;
+    int i = 0;
+
+    if ((f->type != TMIF_FRM_PHOTONS) || (key_k >= FRM_KEY_BITS) || (phd_k >= FRM_FIELD_BITS)) {
+        return -1;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.w = f->payload;
+    r.n = f->length;
+    for (i = 0; i < f->count; i++) {
+        delta = get_rice(&r, key_k, FRM_KEY_BITS);
+        phd = get_rice(&r, phd_k, FRM_FIELD_BITS);
+        if ((delta < 0) || (phd < 0) || (phd > FRM_FIELD_MASK)) {
+            return -1;
+        }
+        key += delta;
+        if (key >> FRM_KEY_BITS) {
+            return -1;
+        }
+        words[3*i] = (key & FRM_FIELD_MASK) | TMIF_TAG_X;
+        words[3*i + 1] = (key >> FRM_FIELD_BITS) | TMIF_TAG_Y;
+        words[3*i + 2] = phd | TMIF_TAG_PHD;
+    }
+
+    /* all of the payload used, only zero padding after */
+    if ((r.i != r.n) || (r.acc & ((1u << r.bits) - 1))) {
+        return -1;
+    }
+    return f->count;
+}
@@ -0,0 +1,75 @@
+#ifndef TMIF_FRM_H_
+#define TMIF_FRM_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Telemetry frames. A frame is a run of 16 bit words in the telemetry
+   stream, between the tagged photon words and markers, that can be
+   found and decoded on its own:
+
+   TMIF_FRAME | type    sync, the only words with the 0xA000 tag
+   length               payload words
+   count                e.g. photons
+   param                type specific
+   payload...
+   CRC                  CRC-16/CCITT of everything before it
+
+   A frame never straddles a DMA buffer, so the stream around it is
+   never split. The ground finds frames by the sync tag and keeps
+   those whose length fits and CRC checks, anything else it skips a
+   word at a time.
+
+   TMIF_FRM_PHOTONS is a packet's photons losslessly compressed: sorted
+   by (y, x, phd) and Rice coded, the key (y << 13 | x) as the delta
+   from the one before and phd as is. param has the Rice parameters,
+   key k << 8 | phd k. Decoding gives exactly the tagged words
+   tmif_enc_photons() would have sent for them, in that sorted order
+   (a packet has no per photon times to lose).
+
+   TMIF_FRM_MODE has no payload and says how the photon words after it
+   are to be read: count is the mode, for TMIF_MODE_PACKED param is the
+   layout (tmif_pack_param()). tmif sends one on every channel when the
+   mode changes and every so often after, so a decoder that starts
+   mid-stream catches up.
+*/
+
+#include <stdint.h>
+
+#include "tmif_enc.h"
+
+/* Frame types */
+#define TMIF_FRM_PHOTONS 1
+#define TMIF_FRM_MODE 2
+/* Quicklook image and pulse height histogram, see tmif_img.h */
+#define TMIF_FRM_IMAGE 3
+#define TMIF_FRM_PHD 4
+
+/* Photon modes */
+#define TMIF_MODE_TAGGED 0
+#define TMIF_MODE_PACKED 1
+/* no photons, only the quicklook frames */
+#define TMIF_MODE_IMAGE 2
+
+/* sync, length, count, param */
+#define TMIF_FRM_HEADER 4
+/* header and CRC */
+#define TMIF_FRM_OVERHEAD (TMIF_FRM_HEADER + 1)
+/* Most photons compressed into one frame */
+#define TMIF_FRM_MAX_PHOTONS 256
+
+/* A frame found in the word stream */
+typedef struct {
+    int type;
+    int count;
+    uint16_t param;
+    int length;
+    const uint16_t *payload;
+} tmif_frm_t;
+
+int tmif_frm_close(uint16_t *, int, int, uint16_t, int);
+int tmif_frm_parse(const uint16_t *, int, tmif_frm_t *);
+int tmif_frm_photons(uint16_t *, int, const uint16_t *, int);
+int tmif_frm_unphotons(const tmif_frm_t *, uint16_t *);
+
+#endif /* TMIF_FRM_H_ */
@@ -0,0 +1,296 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Sparse photon-event archive, see tmif_h5ev.h. Events are buffered
+   per stream and written TMIF_H5EV_CHUNK at a time, one hyperslab
+   write per column, so a packet with a handful of photons costs a
+   handful of 22 byte rows instead of a 1480 byte packet record.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmif_h5ev.h"
+
+#define EV_COLS 5
+
+/* One stream's event group, its columns and the events not written yet */
+typedef struct {
+    hid_t group;
+    hid_t cols[EV_COLS];
+    hsize_t rows;
+    int n;
+    uint16_t x[TMIF_H5EV_CHUNK];
+    uint16_t y[TMIF_H5EV_CHUNK];
+    uint16_t phd[TMIF_H5EV_CHUNK];
+    uint64_t seq[TMIF_H5EV_CHUNK];
+    int64_t rx_ns[TMIF_H5EV_CHUNK];
+} ev_table_t;
+
+static const char *col_names[EV_COLS] = {"x", "y", "phd", "seq", "rx_ns"};
+
+static ev_table_t *ev[TMIF_MAX_STREAMS];
+
+static struct {
+    uint64_t packets;
+    uint64_t events;
+    uint64_t writes;
+    uint64_t truncated;
+    uint64_t errors;
+} ev_stats;
+
+
+static hid_t col_type(int col) {
+    switch (col) {
+    case 3:
+        return H5T_NATIVE_UINT64;
+    case 4:
+        return H5T_NATIVE_LLONG;
+    default:
+        return H5T_NATIVE_UINT16;
+    }
+}
+
+static void *col_buf(ev_table_t *t, int col) {
+    switch (col) {
+    case 0:
+        return t->x;
+    case 1:
+        return t->y;
+    case 2:
+        return t->phd;
+    case 3:
+        return t->seq;
+    default:
+        return t->rx_ns;
+    }
+}
+
+/* New extendible column, shuffle+deflate at level if level > 0 */
+static hid_t create_col(hid_t group, int col, int level) {
+    hsize_t dims[1] = {0};
+    hsize_t maxdims[1] = {H5S_UNLIMITED};
+    hsize_t chunk[1] = {TMIF_H5EV_CHUNK};
+    hid_t space;
+    hid_t dcpl;
+    hid_t dset = -1;
+
+    space = H5Screate_simple(1, dims, maxdims);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    if ((space >= 0) && (dcpl >= 0) && (H5Pset_chunk(dcpl, 1, chunk) >= 0)) {
+        if (level > 0) {
+            H5Pset_shuffle(dcpl);
+            H5Pset_deflate(dcpl, level);
+        }
+        dset = H5Dcreate2(group, col_names[col], col_type(col), space,
+                          H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    }
+    if (dcpl >= 0) {
+        H5Pclose(dcpl);
+    }
+    if (space >= 0) {
+        H5Sclose(space);
+    }
+
+    return dset;
+}
+
+static hsize_t col_rows(hid_t dset) {
+    hsize_t dims[1] = {0};
+    hid_t space;
+
+    space = H5Dget_space(dset);
+    if (space >= 0) {
+        H5Sget_simple_extent_dims(space, dims, NULL);
+        H5Sclose(space);
+    }
+    return dims[0];
+}
+
+/* Open or create the stream's event group in fid (EVENT_GROUP_NAME,
+   EVENT_GROUP_NAME_n for stream n). level compresses new columns. */
+int tmif_h5ev_open(hid_t fid, int stream, int level) {
+    ev_table_t *t;
+    char name[64];
+    hsize_t rows = 0;
+    int col = 0;
+
+    if (stream == 0) {
+        snprintf(name, sizeof(name), "%s", EVENT_GROUP_NAME);
+    } else {
+        snprintf(name, sizeof(name), "%s_%d", EVENT_GROUP_NAME, stream);
+    }
+
+    t = calloc(1, sizeof(ev_table_t));
+    if (!t) {
+        printf("Failed to allocate event buffer\n");
+        return -1;
+    }
+    for (col = 0; col < EV_COLS; col++) {
+        t->cols[col] = H5I_BADID;
+    }
+    ev[stream] = t;
+
+    if (H5Lexists(fid, name, H5P_DEFAULT) > 0) {
+        t->group = H5Gopen2(fid, name, H5P_DEFAULT);
+    } else {
+        printf("warn: no event group %s found yet...\n", name);
+        t->group = H5Gcreate2(fid, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    }
+    if (t->group < 0) {
+        printf("failed to open event group %s\n", name);
+        return -1;
+    }
+
+    for (col = 0; col < EV_COLS; col++) {
+        if (H5Lexists(t->group, col_names[col], H5P_DEFAULT) > 0) {
+            t->cols[col] = H5Dopen2(t->group, col_names[col], H5P_DEFAULT);
+        } else {
+            t->cols[col] = create_col(t->group, col, level);
+        }
+        if (t->cols[col] < 0) {
+            printf("failed to open event column %s/%s\n", name, col_names[col]);
+            return -1;
+        }
+
+        /* A crash between column writes can leave them uneven, carry
+           on from the shortest so the rows line up again */
+        if ((col == 0) || (col_rows(t->cols[col]) < rows)) {
+            rows = col_rows(t->cols[col]);
+        }
+    }
+    t->rows = rows;
+
+    return 0;
+}
+
+/* Write one stream's buffered events */
+static int write_events(ev_table_t *t) {
+    hsize_t start[1];
+    hsize_t count[1];
+    hsize_t dims[1];
+    hid_t fspace;
+    hid_t mspace;
+    herr_t status = 0;
+    int col = 0;
+
+    if (t->n == 0) {
+        return 0;
+    }
+    start[0] = t->rows;
+    count[0] = t->n;
+    dims[0] = t->rows + t->n;
+
+    mspace = H5Screate_simple(1, count, NULL);
+    for (col = 0; (col < EV_COLS) && (status >= 0); col++) {
+        status = H5Dset_extent(t->cols[col], dims);
+        if (status < 0) {
+            break;
+        }
+        fspace = H5Dget_space(t->cols[col]);
+        status = H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start, NULL, count, NULL);
+        if (status >= 0) {
+            status = H5Dwrite(t->cols[col], col_type(col), mspace, fspace,
+                              H5P_DEFAULT, col_buf(t, col));
+        }
+        H5Sclose(fspace);
+    }
+    H5Sclose(mspace);
+
+    if (status < 0) {
+        printf("Failed to write events\n");
+        ev_stats.errors++;
+        t->n = 0;
+        return -1;
+    }
+    t->rows += t->n;
+    t->n = 0;
+    ev_stats.writes++;
+
+    return 0;
+}
+
+/* Split one archived packet into events on its stream */
+void tmif_h5ev_add(int stream, const chess_word_packet_t *rec, uint64_t seq) {
+    ev_table_t *t = ev[stream];
+    int n_photons = rec->packet[0];
+    int i = 0;
+
+    if (!t) {
+        return;
+    }
+    if (n_photons > TMIF_H5EV_MAX_PHOTONS) {
+        ev_stats.truncated++;
+        n_photons = TMIF_H5EV_MAX_PHOTONS;
+    }
+
+    for (i = 0; i < n_photons; i++) {
+        if (t->n == TMIF_H5EV_CHUNK) {
+            write_events(t);
+        }
+        t->x[t->n] = rec->packet[3 + 3*i];
+        t->y[t->n] = rec->packet[4 + 3*i];
+        t->phd[t->n] = rec->packet[5 + 3*i];
+        t->seq[t->n] = seq;
+        t->rx_ns[t->n] = rec->timestamp_ns;
+        t->n++;
+    }
+    ev_stats.packets++;
+    ev_stats.events += n_photons;
+}
+
+/* Write every stream's buffered events, ahead of a file flush */
+int tmif_h5ev_flush(void) {
+    int error = 0;
+    int stream = 0;
+
+    for (stream = 0; stream < TMIF_MAX_STREAMS; stream++) {
+        if (ev[stream] && (write_events(ev[stream]) < 0)) {
+            error++;
+        }
+    }
+    return error;
+}
+
+/* Flush and close all event groups */
+int tmif_h5ev_close(void) {
+    int error = 0;
+    int stream = 0;
+    int col = 0;
+
+    error += tmif_h5ev_flush();
+    for (stream = 0; stream < TMIF_MAX_STREAMS; stream++) {
+        if (!ev[stream]) {
+            continue;
+        }
+        for (col = 0; col < EV_COLS; col++) {
+            if (ev[stream]->cols[col] >= 0) {
+                H5Dclose(ev[stream]->cols[col]);
+            }
+        }
+        if (ev[stream]->group >= 0) {
+            H5Gclose(ev[stream]->group);
+        }
+        free(ev[stream]);
+        ev[stream] = NULL;
+    }
+
+    return error;
+}
+
+void tmif_h5ev_print_stats(void) {
+    /* bytes per event row across the columns */
+    size_t row_bytes = 3*sizeof(uint16_t) + sizeof(uint64_t) + sizeof(int64_t);
+    double ev_mb = ev_stats.events*(double)row_bytes/1e6;
+    double pkt_mb = ev_stats.packets*(double)sizeof(chess_word_packet_t)/1e6;
+
+    printf("events: %llu photons from %llu packets (%.1f per packet) in %llu writes, "
+           "truncated %llu, errors %llu\n",
+           (unsigned long long)ev_stats.events, (unsigned long long)ev_stats.packets,
+           ev_stats.packets ? (double)ev_stats.events/(double)ev_stats.packets : 0.0,
+           (unsigned long long)ev_stats.writes, (unsigned long long)ev_stats.truncated,
+           (unsigned long long)ev_stats.errors);
+    printf("events: %.2f MB of event rows vs %.2f MB as packet records (ratio %.1f)\n",
+           ev_mb, pkt_mb, (ev_mb > 0) ? pkt_mb/ev_mb : 0.0);
+}
@@ -0,0 +1,38 @@
+#ifndef TMIF_H5EV_H_
+#define TMIF_H5EV_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Sparse photon-event archive. Each packet's x, y, phd triples (from
+   word 3 on, as tmif hands them to the DMA encoder) become rows of a
+   columnar event group, one 1-D dataset per column:
+
+   CHESS_EVENTS/x        uint16  raw x word
+   CHESS_EVENTS/y        uint16  raw y word
+   CHESS_EVENTS/phd      uint16  pulse height
+   CHESS_EVENTS/seq      uint64  64-bit packet sequence number
+   CHESS_EVENTS/rx_ns    int64   packet kernel receive time, ns
+
+   Only called from the archive writer thread.
+*/
+
+#include <stdint.h>
+#include <hdf5.h>
+
+#include "tmif_hdf5.h"
+
+#define EVENT_GROUP_NAME "CHESS_EVENTS"
+/* Events per column chunk, and buffered per stream before a write */
+#define TMIF_H5EV_CHUNK 8192
+/* Most photons a packet can carry */
+#define TMIF_H5EV_MAX_PHOTONS ((CHESS_PACKET_LEN - 3)/3)
+
+
+int tmif_h5ev_open(hid_t, int, int);
+void tmif_h5ev_add(int, const chess_word_packet_t *, uint64_t);
+int tmif_h5ev_flush(void);
+int tmif_h5ev_close(void);
+void tmif_h5ev_print_stats(void);
+
+#endif /* TMIF_H5EV_H_ */
@@ -0,0 +1,292 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Packet index, see tmif_h5ix.h. Rows are buffered per stream and
+   written TMIF_H5IX_CHUNK at a time with one hyperslab write, gaps in
+   the sequence are filled with lost rows as they are seen.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmif_h5ix.h"
+
+/* One stream's index table and the rows not written yet. next_seq is
+   the sequence number the next row should have and last_ns the newest
+   rx_ns indexed, both only once started. */
+typedef struct {
+    hid_t dset;
+    hsize_t rows;
+    int started;
+    uint64_t next_seq;
+    int64_t last_ns;
+    int n;
+    tmif_h5ix_rec_t buf[TMIF_H5IX_CHUNK];
+} ix_table_t;
+
+static ix_table_t *ix[TMIF_MAX_STREAMS];
+
+static struct {
+    uint64_t packets;
+    uint64_t lost;
+    uint64_t filled;
+    uint64_t late;
+    uint64_t resets;
+    uint64_t writes;
+    uint64_t errors;
+} ix_stats;
+
+
+/* HDF5 type of tmif_h5ix_rec_t, close it after use */
+hid_t tmif_h5ix_type(void) {
+    hid_t tid;
+
+    tid = H5Tcreate(H5T_COMPOUND, sizeof(tmif_h5ix_rec_t));
+    if (tid < 0) {
+        return -1;
+    }
+    H5Tinsert(tid, "seq", HOFFSET(tmif_h5ix_rec_t, seq), H5T_NATIVE_UINT64);
+    H5Tinsert(tid, "rx_ns", HOFFSET(tmif_h5ix_rec_t, rx_ns), H5T_NATIVE_LLONG);
+    H5Tinsert(tid, "row", HOFFSET(tmif_h5ix_rec_t, row), H5T_NATIVE_LLONG);
+    H5Tinsert(tid, "n_photons", HOFFSET(tmif_h5ix_rec_t, n_photons), H5T_NATIVE_UINT16);
+
+    return tid;
+}
+
+/* New extendible index table, deflated at level if level > 0 */
+static hid_t create_index(hid_t fid, const char *name, int level) {
+    hsize_t dims[1] = {0};
+    hsize_t maxdims[1] = {H5S_UNLIMITED};
+    hsize_t chunk[1] = {TMIF_H5IX_CHUNK};
+    hid_t space;
+    hid_t dcpl;
+    hid_t tid;
+    hid_t dset = -1;
+
+    space = H5Screate_simple(1, dims, maxdims);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    tid = tmif_h5ix_type();
+    if ((space >= 0) && (dcpl >= 0) && (tid >= 0) && (H5Pset_chunk(dcpl, 1, chunk) >= 0)) {
+        if (level > 0) {
+            H5Pset_shuffle(dcpl);
+            H5Pset_deflate(dcpl, level);
+        }
+        dset = H5Dcreate2(fid, name, tid, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    }
+    if (tid >= 0) {
+        H5Tclose(tid);
+    }
+    if (dcpl >= 0) {
+        H5Pclose(dcpl);
+    }
+    if (space >= 0) {
+        H5Sclose(space);
+    }
+
+    return dset;
+}
+
+/* Open or create the stream's index in fid (INDEX_TABLE_NAME,
+   INDEX_TABLE_NAME_n for stream n). level compresses a new table. */
+int tmif_h5ix_open(hid_t fid, int stream, int level) {
+    ix_table_t *t;
+    char name[64];
+    hsize_t dims[1] = {0};
+    hid_t space;
+
+    if (stream == 0) {
+        snprintf(name, sizeof(name), "%s", INDEX_TABLE_NAME);
+    } else {
+        snprintf(name, sizeof(name), "%s_%d", INDEX_TABLE_NAME, stream);
+    }
+
+    t = calloc(1, sizeof(ix_table_t));
+    if (!t) {
+        printf("Failed to allocate index buffer\n");
+        return -1;
+    }
+    ix[stream] = t;
+
+    if (H5Lexists(fid, name, H5P_DEFAULT) > 0) {
+        t->dset = H5Dopen2(fid, name, H5P_DEFAULT);
+    } else {
+        printf("warn: no packet index %s found yet...\n", name);
+        t->dset = create_index(fid, name, level);
+    }
+    if (t->dset < 0) {
+        printf("failed to open packet index %s\n", name);
+        return -1;
+    }
+
+    space = H5Dget_space(t->dset);
+    if (space >= 0) {
+        H5Sget_simple_extent_dims(space, dims, NULL);
+        H5Sclose(space);
+    }
+    t->rows = dims[0];
+
+    return 0;
+}
+
+/* Write one stream's buffered rows */
+static int write_rows(ix_table_t *t) {
+    hsize_t start[1];
+    hsize_t count[1];
+    hsize_t dims[1];
+    hid_t fspace;
+    hid_t mspace;
+    hid_t tid;
+    herr_t status = -1;
+
+    if (t->n == 0) {
+        return 0;
+    }
+    start[0] = t->rows;
+    count[0] = t->n;
+    dims[0] = t->rows + t->n;
+
+    if (H5Dset_extent(t->dset, dims) >= 0) {
+        fspace = H5Dget_space(t->dset);
+        mspace = H5Screate_simple(1, count, NULL);
+        tid = tmif_h5ix_type();
+        if (H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start, NULL, count, NULL) >= 0) {
+            status = H5Dwrite(t->dset, tid, mspace, fspace, H5P_DEFAULT, t->buf);
+        }
+        H5Tclose(tid);
+        H5Sclose(mspace);
+        H5Sclose(fspace);
+    }
+
+    if (status < 0) {
+        printf("Failed to write packet index\n");
+        ix_stats.errors++;
+        t->n = 0;
+        return -1;
+    }
+    t->rows += t->n;
+    t->n = 0;
+    ix_stats.writes++;
+
+    return 0;
+}
+
+static void put_row(ix_table_t *t, uint64_t seq, int64_t rx_ns, uint16_t n_photons, int64_t row) {
+    tmif_h5ix_rec_t *rec;
+
+    if (t->n == TMIF_H5IX_CHUNK) {
+        write_rows(t);
+    }
+    /* Packets the reorder window put back in order can have arrived a
+       little before the one ahead of them, keep rx_ns sorted */
+    if (rx_ns < t->last_ns) {
+        rx_ns = t->last_ns;
+    }
+    t->last_ns = rx_ns;
+    rec = &t->buf[t->n++];
+    rec->seq = seq;
+    rec->rx_ns = rx_ns;
+    rec->row = row;
+    rec->n_photons = n_photons;
+    t->next_seq = seq + 1;
+}
+
+/* Index one received packet on its stream. row is its packet table
+   record or TMIF_H5IX_EMPTY. */
+void tmif_h5ix_add(int stream, uint64_t seq, int64_t rx_ns, uint16_t n_photons, int64_t row) {
+    ix_table_t *t = ix[stream];
+    tmif_h5ix_rec_t *rec;
+    uint64_t behind = 0;
+    uint64_t s = 0;
+
+    if (!t) {
+        return;
+    }
+    ix_stats.packets++;
+
+    /* Every open of the file starts a new run, tmif's sequence
+       numbers start over with it */
+    if (!t->started) {
+        t->started = 1;
+        if (t->rows > 0) {
+            ix_stats.resets++;
+        }
+        put_row(t, seq, rx_ns, n_photons, row);
+        return;
+    }
+
+    if ((seq + TMIF_H5IX_MAX_GAP) < t->next_seq) {
+        /* Counter started over (instrument reset), new run */
+        ix_stats.resets++;
+        put_row(t, seq, rx_ns, n_photons, row);
+        return;
+    }
+
+    if (seq < t->next_seq) {
+        /* Late: take over its lost row if that's still in the buffer */
+        behind = t->next_seq - seq;
+        if (behind <= (uint64_t)t->n) {
+            rec = &t->buf[t->n - behind];
+            if ((rec->seq == seq) && (rec->row == TMIF_H5IX_LOST)) {
+                rec->row = row;
+                rec->n_photons = n_photons;
+                ix_stats.filled++;
+                ix_stats.lost--;
+                return;
+            }
+        }
+        ix_stats.late++;
+        return;
+    }
+
+    if ((seq - t->next_seq) > TMIF_H5IX_MAX_GAP) {
+        ix_stats.resets++;
+    } else {
+        for (s = t->next_seq; s < seq; s++) {
+            put_row(t, s, rx_ns, 0, TMIF_H5IX_LOST);
+            ix_stats.lost++;
+        }
+    }
+    put_row(t, seq, rx_ns, n_photons, row);
+}
+
+/* Write every stream's buffered rows, ahead of a file flush */
+int tmif_h5ix_flush(void) {
+    int error = 0;
+    int stream = 0;
+
+    for (stream = 0; stream < TMIF_MAX_STREAMS; stream++) {
+        if (ix[stream] && (write_rows(ix[stream]) < 0)) {
+            error++;
+        }
+    }
+    return error;
+}
+
+/* Flush and close all index tables */
+int tmif_h5ix_close(void) {
+    int error = 0;
+    int stream = 0;
+
+    error += tmif_h5ix_flush();
+    for (stream = 0; stream < TMIF_MAX_STREAMS; stream++) {
+        if (!ix[stream]) {
+            continue;
+        }
+        if (ix[stream]->dset >= 0) {
+            H5Dclose(ix[stream]->dset);
+        }
+        free(ix[stream]);
+        ix[stream] = NULL;
+    }
+
+    return error;
+}
+
+void tmif_h5ix_print_stats(void) {
+    printf("index: %llu packets, %llu lost (%llu filled in late), %llu too late, "
+           "%llu new runs or gaps too long to fill, errors %llu\n",
+           (unsigned long long)ix_stats.packets, (unsigned long long)ix_stats.lost,
+           (unsigned long long)ix_stats.filled, (unsigned long long)ix_stats.late,
+           (unsigned long long)ix_stats.resets, (unsigned long long)ix_stats.errors);
+}
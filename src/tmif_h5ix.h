@@ -0,0 +1,62 @@
+#ifndef TMIF_H5IX_H_
+#define TMIF_H5IX_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Packet index written alongside each packet table, one
+   tmif_h5ix_rec_t per received packet, empty ones included:
+
+   CHESS_INDEX     stream 0 (CHESS_INDEX_n for stream n)
+
+   Rows are in strictly increasing sequence order within a run. A new
+   run starts each time tmif reopens the file and where the sequence
+   goes back more than TMIF_H5IX_MAX_GAP (a counter reset). Packets that
+   never arrived get a row too (row TMIF_H5IX_LOST, rx_ns of the
+   packet after the gap), so as long as no gap was longer than
+   TMIF_H5IX_MAX_GAP a run is dense and the row for sequence s is
+   s - (first seq of the run) on from the run's first row. Otherwise
+   seq is still sorted for a binary search, as is rx_ns (a packet
+   received before the one ahead of it in sequence is indexed at that
+   one's time, its packet record keeps the real time). Packets
+   arriving behind the index (late past the reorder window) fill their
+   lost row if it's still buffered and are otherwise left out.
+
+   Only called from the archive writer thread.
+*/
+
+#include <stdint.h>
+#include <hdf5.h>
+
+#include "tmif_hdf5.h"
+
+#define INDEX_TABLE_NAME "CHESS_INDEX"
+/* Rows per chunk, and buffered per stream before a write */
+#define TMIF_H5IX_CHUNK 4096
+/* Longest run of lost packets filled in, anything longer (a counter
+   reset, say) just breaks the dense run */
+#define TMIF_H5IX_MAX_GAP 65536
+/* row of a packet with no photons (not archived) */
+#define TMIF_H5IX_EMPTY (-1)
+/* row of a packet that never arrived */
+#define TMIF_H5IX_LOST (-2)
+
+/* One index row. row is the packet's record in the packet table, or
+   TMIF_H5IX_EMPTY/TMIF_H5IX_LOST (also -1 for packets kept only as
+   events). */
+typedef struct {
+    uint64_t seq;
+    int64_t rx_ns;
+    int64_t row;
+    uint16_t n_photons;
+} tmif_h5ix_rec_t;
+
+
+hid_t tmif_h5ix_type(void);
+int tmif_h5ix_open(hid_t, int, int);
+void tmif_h5ix_add(int, uint64_t, int64_t, uint16_t, int64_t);
+int tmif_h5ix_flush(void);
+int tmif_h5ix_close(void);
+void tmif_h5ix_print_stats(void);
+
+#endif /* TMIF_H5IX_H_ */
@@ -0,0 +1,336 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Archive chunk compression pool for tmif_hdf5. The archive writer
+   fills a job with one chunk of raw records and submits it. A worker
+   byte-shuffles it and deflates it with zlib, exactly as HDF5's
+   shuffle and deflate filters would, and the writer collects finished
+   jobs in submission order for H5Dwrite_chunk(). HDF5 itself is
+   never called from here, the library is not thread-safe.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "tmif_h5z.h"
+
+
+static tmif_h5z_job_t *jobs;
+static int n_jobs = 0;
+/* submitted jobs, oldest first */
+static int *fifo;
+static int fifo_head = 0;
+static int fifo_len = 0;
+
+static int level = 4;
+static size_t elem_size = 1;
+
+static pthread_t workers[TMIF_H5Z_MAX_WORKERS];
+static int n_workers = 0;
+static int stopping = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static struct {
+    uint64_t chunks;
+    uint64_t raw_bytes;
+    uint64_t out_bytes;
+    uint64_t not_deflated;
+    int64_t cpu_ns;
+} z_stats;
+
+
+static int64_t thread_cpu_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* HDF5 shuffle filter: byte j of every element goes together, any
+   bytes past the last whole element are copied as they are */
+static void shuffle(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t n = len/elem_size;
+    size_t i = 0;
+    size_t j = 0;
+
+    for (j = 0; j < elem_size; j++) {
+        for (i = 0; i < n; i++) {
+            dst[j*n + i] = src[i*elem_size + j];
+        }
+    }
+    memcpy(dst + n*elem_size, src + n*elem_size, len - n*elem_size);
+}
+
+/* Undo HDF5's shuffle for len bytes of elem byte elements */
+static void unshuffle(uint8_t *dst, const uint8_t *src, size_t len, size_t elem) {
+    size_t n = len/elem;
+    size_t i = 0;
+    size_t j = 0;
+
+    for (j = 0; j < elem; j++) {
+        for (i = 0; i < n; i++) {
+            dst[i*elem + j] = src[j*n + i];
+        }
+    }
+    memcpy(dst + n*elem, src + n*elem, len - n*elem);
+}
+
+/* Reverse the pipeline for a chunk read with H5Dread_chunk(): inflate
+   (unless mask says it was skipped) into scratch, then unshuffle
+   raw_len bytes of elem byte records into dst. scratch holds raw_len
+   bytes. Thread safe, for readers doing their own filtering. */
+int tmif_h5z_unfilter(uint8_t *dst, size_t raw_len, const uint8_t *src, size_t src_len,
+                      uint32_t mask, size_t elem, uint8_t *scratch) {
+    uLongf out_len = (uLongf)raw_len;
+
+    if (mask & TMIF_H5Z_MASK_NO_DEFLATE) {
+        if (src_len < raw_len) {
+            return -1;
+        }
+        memcpy(scratch, src, raw_len);
+    } else if ((uncompress(scratch, &out_len, src, src_len) != Z_OK) ||
+               (out_len != raw_len)) {
+        return -1;
+    }
+
+    if (mask & TMIF_H5Z_MASK_NO_SHUFFLE) {
+        memcpy(dst, scratch, raw_len);
+    } else {
+        unshuffle(dst, scratch, raw_len, elem);
+    }
+    return 0;
+}
+
+/* Shuffle into scratch, then deflate into out. Falls back to shuffle
+   only when deflate would grow the chunk, like HDF5's optional
+   deflate filter. */
+static void compress_job(tmif_h5z_job_t *job, uint8_t *scratch) {
+    uLongf out_len = (uLongf)compressBound(job->raw_len);
+
+    shuffle(scratch, job->raw, job->raw_len);
+
+    if ((compress2(job->out, &out_len, scratch, job->raw_len, level) == Z_OK) &&
+        (out_len < job->raw_len)) {
+        job->out_len = out_len;
+        job->filter_mask = 0;
+    } else {
+        memcpy(job->out, scratch, job->raw_len);
+        job->out_len = job->raw_len;
+        job->filter_mask = TMIF_H5Z_MASK_NO_DEFLATE;
+    }
+}
+
+static void *worker_main(void *arg) {
+    size_t chunk_bytes = (size_t)arg;
+    uint8_t *scratch = malloc(chunk_bytes);
+    tmif_h5z_job_t *job;
+    int64_t cpu0 = 0;
+    int i = 0;
+
+    if (!scratch) {
+        printf("Failed to allocate compression scratch\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        job = NULL;
+        for (i = 0; i < fifo_len; i++) {
+            if (jobs[fifo[(fifo_head + i) % n_jobs]].state == TMIF_H5Z_QUEUED) {
+                job = &jobs[fifo[(fifo_head + i) % n_jobs]];
+                break;
+            }
+        }
+        if (!job) {
+            if (stopping) {
+                break;
+            }
+            pthread_cond_wait(&work_cond, &lock);
+            continue;
+        }
+
+        job->state = TMIF_H5Z_BUSY;
+        pthread_mutex_unlock(&lock);
+
+        cpu0 = thread_cpu_ns();
+        compress_job(job, scratch);
+
+        pthread_mutex_lock(&lock);
+        z_stats.cpu_ns += thread_cpu_ns() - cpu0;
+        z_stats.chunks++;
+        z_stats.raw_bytes += job->raw_len;
+        z_stats.out_bytes += job->out_len;
+        if (job->filter_mask) {
+            z_stats.not_deflated++;
+        }
+        job->state = TMIF_H5Z_DONE;
+        pthread_cond_broadcast(&done_cond);
+    }
+    pthread_mutex_unlock(&lock);
+
+    free(scratch);
+    return NULL;
+}
+
+/* Start n_workers threads compressing at deflate level lvl. Chunks
+   are chunk_bytes of elem records, max_jobs may be in flight. */
+int tmif_h5z_start(int lvl, int n, size_t chunk_bytes, size_t elem, int max_jobs) {
+    int i = 0;
+
+    if (n < 1) {
+        n = 1;
+    } else if (n > TMIF_H5Z_MAX_WORKERS) {
+        n = TMIF_H5Z_MAX_WORKERS;
+    }
+    level = lvl;
+    elem_size = elem;
+    n_jobs = max_jobs;
+    fifo_head = 0;
+    fifo_len = 0;
+    stopping = 0;
+    memset(&z_stats, 0, sizeof(z_stats));
+
+    jobs = calloc(n_jobs, sizeof(tmif_h5z_job_t));
+    fifo = calloc(n_jobs, sizeof(int));
+    if (!jobs || !fifo) {
+        printf("Failed to allocate compression jobs\n");
+        return -1;
+    }
+    for (i = 0; i < n_jobs; i++) {
+        jobs[i].raw = malloc(chunk_bytes);
+        jobs[i].out = malloc(compressBound(chunk_bytes));
+        if (!jobs[i].raw || !jobs[i].out) {
+            printf("Failed to allocate compression buffers\n");
+            return -1;
+        }
+    }
+
+    for (n_workers = 0; n_workers < n; n_workers++) {
+        if (pthread_create(&workers[n_workers], NULL, worker_main,
+                           (void *)chunk_bytes) != 0) {
+            printf("Failed to start compression worker\n");
+            break;
+        }
+    }
+    printf("archive: shuffle+deflate level %d on %d workers\n", level, n_workers);
+
+    return (n_workers > 0) ? 0 : -1;
+}
+
+/* A free job for the caller to fill, NULL if all are in flight */
+tmif_h5z_job_t *tmif_h5z_acquire(void) {
+    tmif_h5z_job_t *job = NULL;
+    int i = 0;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < n_jobs; i++) {
+        if (jobs[i].state == TMIF_H5Z_FREE) {
+            job = &jobs[i];
+            job->state = TMIF_H5Z_FILLING;
+            job->raw_len = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return job;
+}
+
+void tmif_h5z_submit(tmif_h5z_job_t *job) {
+    pthread_mutex_lock(&lock);
+    job->state = TMIF_H5Z_QUEUED;
+    fifo[(fifo_head + fifo_len) % n_jobs] = (int)(job - jobs);
+    fifo_len++;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Hand back a job from tmif_h5z_acquire() that won't be submitted */
+void tmif_h5z_cancel(tmif_h5z_job_t *job) {
+    pthread_mutex_lock(&lock);
+    job->state = TMIF_H5Z_FREE;
+    pthread_mutex_unlock(&lock);
+}
+
+/* The oldest submitted job once it's compressed. With wait, blocks
+   until it is. NULL if nothing is submitted (or, without wait, the
+   oldest isn't done yet). */
+tmif_h5z_job_t *tmif_h5z_oldest(int wait) {
+    tmif_h5z_job_t *job = NULL;
+
+    pthread_mutex_lock(&lock);
+    while (fifo_len > 0) {
+        job = &jobs[fifo[fifo_head]];
+        if (job->state == TMIF_H5Z_DONE) {
+            break;
+        }
+        job = NULL;
+        if (!wait) {
+            break;
+        }
+        pthread_cond_wait(&done_cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return job;
+}
+
+/* Done with the job tmif_h5z_oldest() returned */
+void tmif_h5z_release(tmif_h5z_job_t *job) {
+    pthread_mutex_lock(&lock);
+    job->state = TMIF_H5Z_FREE;
+    fifo_head = (fifo_head + 1) % n_jobs;
+    fifo_len--;
+    pthread_mutex_unlock(&lock);
+}
+
+/* data_s is how many seconds of flight data went through */
+void tmif_h5z_print_stats(double data_s) {
+    if (z_stats.chunks == 0) {
+        return;
+    }
+    printf("archive: compressed %llu chunks, %.1f MB -> %.1f MB (ratio %.2f), "
+           "%llu not deflated\n",
+           (unsigned long long)z_stats.chunks, z_stats.raw_bytes/1e6,
+           z_stats.out_bytes/1e6,
+           z_stats.out_bytes ? (double)z_stats.raw_bytes/(double)z_stats.out_bytes : 0.0,
+           (unsigned long long)z_stats.not_deflated);
+    printf("archive: compression cpu %.3f s, %.1f us per record", z_stats.cpu_ns*1e-9,
+           z_stats.cpu_ns*1e-3/((double)z_stats.raw_bytes/(double)elem_size));
+    if (data_s > 0) {
+        printf(" for %.1f s of data (%.1f ms per s)", data_s, z_stats.cpu_ns*1e-6/data_s);
+    }
+    printf("\n");
+}
+
+/* Stop the workers, anything still queued is abandoned */
+void tmif_h5z_stop(void) {
+    int i = 0;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < n_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    n_workers = 0;
+
+    if (jobs) {
+        for (i = 0; i < n_jobs; i++) {
+            free(jobs[i].raw);
+            free(jobs[i].out);
+        }
+    }
+    free(jobs);
+    free(fifo);
+    jobs = NULL;
+    fifo = NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef TMIF_H5Z_H_
+#define TMIF_H5Z_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Archive chunk compression pool. Worker threads run the same
+   shuffle + deflate pipeline HDF5 would, so finished chunks can go
+   straight into the file with a direct chunk write.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Most compression worker threads */
+#define TMIF_H5Z_MAX_WORKERS 8
+/* Default compression worker threads */
+#define TMIF_H5Z_WORKERS_DEFAULT 2
+
+/* Filter mask bit set when deflate did not pay and the chunk is only
+   shuffled (deflate is the second filter in the pipeline) */
+#define TMIF_H5Z_MASK_NO_DEFLATE 0x2
+/* and when the shuffle was skipped (never by tmif) */
+#define TMIF_H5Z_MASK_NO_SHUFFLE 0x1
+
+typedef enum {
+    TMIF_H5Z_FREE = 0,
+    /* owned by the caller, being filled */
+    TMIF_H5Z_FILLING,
+    TMIF_H5Z_QUEUED,
+    TMIF_H5Z_BUSY,
+    TMIF_H5Z_DONE
+} tmif_h5z_state_t;
+
+/* One chunk on its way to the file */
+typedef struct {
+    tmif_h5z_state_t state;
+    int stream;
+    /* first record of the chunk in the dataset */
+    uint64_t offset;
+
+    /* raw records, raw_len bytes filled of chunk_bytes, the first
+       data_len of them real (the rest pads a flushed copy of a partly
+       packed chunk) */
+    uint8_t *raw;
+    size_t raw_len;
+    size_t data_len;
+
+    /* filtered chunk and HDF5 filter mask for it */
+    uint8_t *out;
+    size_t out_len;
+    uint32_t filter_mask;
+} tmif_h5z_job_t;
+
+
+int tmif_h5z_start(int, int, size_t, size_t, int);
+tmif_h5z_job_t *tmif_h5z_acquire(void);
+void tmif_h5z_submit(tmif_h5z_job_t *);
+void tmif_h5z_cancel(tmif_h5z_job_t *);
+tmif_h5z_job_t *tmif_h5z_oldest(int);
+void tmif_h5z_release(tmif_h5z_job_t *);
+void tmif_h5z_print_stats(double);
+void tmif_h5z_stop(void);
+int tmif_h5z_unfilter(uint8_t *, size_t, const uint8_t *, size_t, uint32_t, size_t, uint8_t *);
+
+#endif /* TMIF_H5Z_H_ */
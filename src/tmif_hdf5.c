@@ -2,31 +2,176 @@
    email: nicholas.nell@colorado.edu
    
    This helper function saves packets of CHESS data as they are read
-   by tmif.
+   by tmif. The file and its packet tables stay open from
+   init_packet_save() to close_packet_save(), tmif flushes the file
+   off its heartbeat with flush_packet_save().
+
+   save_packets() only copies records onto a bounded lock-free queue
+   (one producer, the tmif main loop). A writer thread owns the file
+   and appends hundreds of records per H5PTappend(), so a slow disk or
+   a long flush never holds up the UDP drain or DMA output.
+
+   With compression on, new tables are created shuffle+deflate. The
+   writer packs whole chunks and hands them to the tmif_h5z worker
+   pool, and writes the compressed chunks with H5Dwrite_chunk() in
+   order, so the filters never run on the writer thread.
+
+   Every packet handed over, empty or not, gets a row in the stream's
+   packet index (tmif_h5ix), only packets with photons go in the
+   packet table.
+
+   In event mode the writer splits each packet into photon events
+   (tmif_h5ev) and only every raw_every'th packet, by sequence number,
+   still goes to the packet table.
+
+   With an archive log set the writer appends framed records to that
+   (tmif_log) instead and the HDF5 file is never opened, log2h5 builds
+   it afterwards.
+
+   By default the file is in the latest format and switched to SWMR
+   writing once its tables exist, so quicklook (h5tail) can read it
+   while tmif writes. The writer flushes at least every
+   TMIF_H5_SWMR_FLUSH_MS while appending to keep readers close behind.
+
+   With rotation set the archive is a run of numbered files,
+   FILE_NAME_0000.h5 on, each closed once it reaches a size, row count
+   or age. At TMIF_H5_ROTATE_PREP of the limit the writer builds the
+   next file's tables and a helper thread preallocates its disk space,
+   so the switch itself is a close and an open. Each packet table
+   carries first_seq/last_seq attributes, the lowest and highest
+   sequence numbers in it.
 */
 
+#define _GNU_SOURCE
 #include <hdf5.h>
 #include <hdf5_hl.h>
-#include <sys/time.h>
+#include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
 //#include <syslog.h>
 #include <stdint.h>
 
 #include "tmif_hdf5.h"
+#include "tmif_h5z.h"
+#include "tmif_h5ev.h"
+#include "tmif_h5ix.h"
+#include "tmif_log.h"
 
 
 static hid_t fid;
 static hid_t comp_tid;
-static hid_t ptable;
+/* One open packet table per stream, and its length when it's appended
+   to with H5PTappend() */
+static hid_t ptables[TMIF_MAX_STREAMS];
+static hsize_t pt_rows[TMIF_MAX_STREAMS];
+static int n_streams = 1;
+static const char *file_name = FILE_NAME;
 //static hid_t space;
-static hid_t array_tid;
-/* Holds length of CHESS UDP packet in uint16_t units */
-static hsize_t packet_dim[] = {CHESS_PACKET_LEN};
-/* Struct for packet and timestamp */
 static int tmif_hdf5_init = 0;
 static int tmif_init_good = 0;
 
+/* Compression. dsets[stream] is open only for streams whose table has
+   the shuffle+deflate layout, rows[] is the next record offset
+   (including chunks still with the workers), extent[] what the
+   dataset has been extended to. z_fill[] is the chunk being packed. */
+static int z_level = 0;
+static int z_workers = TMIF_H5Z_WORKERS_DEFAULT;
+static int z_on = 0;
+static hid_t dsets[TMIF_MAX_STREAMS];
+static hsize_t rows[TMIF_MAX_STREAMS];
+static hsize_t extent[TMIF_MAX_STREAMS];
+static tmif_h5z_job_t *z_fill[TMIF_MAX_STREAMS];
+static int64_t z_first_ns = 0;
+static int64_t z_last_ns = 0;
+static int z_started = 0;
+
+/* SWMR wanted, and whether the file is actually in SWMR write mode */
+static int swmr = 1;
+static int swmr_on = 0;
+
+/* Raw append log backend instead of HDF5 if set */
+static const char *log_name = NULL;
+
+/* Event mode, keeping 1 in raw_every packets raw (0 for none) */
+static int ev_on = 0;
+static uint64_t raw_every = 0;
+
+/* Sequence range in each stream's table of the open file, for its
+   first_seq/last_seq attributes (TMIF_H5_SEQ_NONE while empty) */
+static uint64_t first_seq[TMIF_MAX_STREAMS];
+static uint64_t last_seq[TMIF_MAX_STREAMS];
+static int seq_dirty = 0;
+
+/* Rotation limits (0 for none), the open file and the prepared next
+   one. prep_tid preallocates the next file while prep_running. */
+static uint64_t rot_bytes = 0;
+static uint64_t rot_rows = 0;
+static int rot_secs = 0;
+static int rot_on = 0;
+static int file_index = 0;
+static char cur_name[512];
+/* The prepared next file, its index, and whether this run created it
+   (only then is it ours to remove unused at the end) */
+static char next_name[512];
+static int next_index = 0;
+static int next_ready = 0;
+static int next_created = 0;
+/* No archive file could be opened, records go to the spill file */
+static int archive_down = 0;
+static uint64_t file_rows = 0;
+static int64_t file_open_ms = 0;
+static pthread_t prep_tid;
+static int prep_running = 0;
+static uint64_t prep_bytes = 0;
+
+/* Writer queue: TMIF_H5_QUEUE_LEN records and the stream each goes
+   to. q_head is only written by the producer, q_tail by the writer
+   and, under drop-oldest, by the producer discarding the oldest
+   record (both with compare-and-swap). */
+static chess_word_packet_t *q_recs;
+static uint8_t *q_stream;
+static uint64_t *q_seq;
+static uint64_t q_head;
+static uint64_t q_tail;
+static tmif_h5_policy_t policy = TMIF_H5_DROP_OLDEST;
+static FILE *spill_fp;
+static uint64_t spill_frames;
+/* The writer spills too once the archive is down */
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t writer_tid;
+static int writer_running = 0;
+static int writer_stop = 0;
+static int flush_req = 0;
+/* The writer sleeps on wake_cond with writer_idle set; the producer
+   wakes it once APPEND_MIN records are queued, flush and stop always */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond;
+static int writer_idle = 0;
+
+static struct {
+    uint64_t queued;
+    uint64_t written;
+    uint64_t appends;
+    uint64_t flushes;
+    uint64_t dropped;
+    uint64_t spilled;
+    uint64_t blocked;
+    uint64_t errors;
+    uint64_t max_depth;
+    uint64_t swmr_flushes;
+    uint64_t rotations;
+    int64_t max_switch_us;
+} w_stats;
+
+static void *writer_main(void *);
+static void finish_jobs(void);
+static int spill_record(int, chess_word_packet_t *, uint64_t);
+
 
 /* log any hdf5 errors that occur so we know what the hell is going on... */
 static herr_t log_err(int n, H5E_error_t *err_desc, void *client_data) {
@@ -65,322 +210,1653 @@ static herr_t log_err(int n, H5E_error_t *err_desc, void *client_data) {
     return 0;
 }
 
-/* hdf5 error handler function */
-static herr_t tmif_hdf5_error_handler(void *unused) {
-    /* Go through errors and log them... */
-    H5Ewalk(H5E_WALK_DOWNWARD, log_err, (void *)0);
-    return 0;
+static int64_t mono_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
 }
 
-/* Initialize all of the hdf5 items... */
-int init_packet_save(void) {
-    herr_t status;
-    int error = 0;
-    //hsize_t fspace;
+/* Packet table name for an archive stream */
+static void stream_table_name(int stream, char *name, size_t len) {
+    if (stream == 0) {
+        snprintf(name, len, "%s", TABLE_NAME);
+    } else {
+        snprintf(name, len, "%s_%d", TABLE_NAME, stream);
+    }
+}
 
-    /* set custom hdf5 error handler to log any errors */
-    H5Eset_auto(tmif_hdf5_error_handler, NULL);
+/* Does the named packet table hold chess_word_packet_t records? */
+static int table_type_ok(const char *name) {
+    hid_t dset;
+    hid_t dtype;
+    htri_t equal = 0;
 
-    /* open the file or create it */
-    fid = H5Fopen(FILE_NAME, H5F_ACC_RDWR, H5P_DEFAULT);
-    if (fid < 0) {
-        //syslog(LOG_WARNING, "WARNING: No hdf5 file exists yet!");
-        printf("WARNING: No hdf5 file exists yet!\n");
-        fid = H5Fcreate(FILE_NAME, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
-        if (fid < 0) {
-            //syslog(LOG_ERR, "Failed to create packet table file!");
-            printf("Failed to create packet table file!\n");
-            error++;
-            return error;
-        }
+    dset = H5Dopen(fid, name);
+    if (dset < 0) {
+        return -1;
+    }
+    dtype = H5Dget_type(dset);
+    if (dtype >= 0) {
+        equal = H5Tequal(dtype, comp_tid);
+        H5Tclose(dtype);
     }
+    H5Dclose(dset);
 
-    // fspace = H5Fget_freespace(fid);
-    // printf("File free space: %d\n", (int)fspace);
+    return (int)equal;
+}
 
-    /* HDF5 space for packet array */
-    array_tid = H5Tarray_create(H5T_NATIVE_UINT16, 1, packet_dim, NULL);
-    //array_tid = H5Tarray_create(H5T_NATIVE_UINT16, 1, packet_dim);
-    if (array_tid < 0) {
-        printf("Failed to create array_tid. \n");
-        H5Fclose(fid);
-        error++;
-        return error;
-    }
+/* Close whatever packet tables are open */
+static void close_tables(void) {
+    int stream = 0;
 
-    /* Compound type (packet struct) */
-    comp_tid = H5Tcreate(H5T_COMPOUND, sizeof (chess_word_packet_t));
-    if (comp_tid < 0) {
-        H5Tclose(array_tid);
-        H5Fclose(fid);
-        error++;
-        return error;
+    for (stream = 0; stream < TMIF_MAX_STREAMS; stream++) {
+        if (ptables[stream] > 0) {
+            H5PTclose(ptables[stream]);
+        }
+        ptables[stream] = H5I_BADID;
+        if (dsets[stream] > 0) {
+            H5Dclose(dsets[stream]);
+        }
+        dsets[stream] = H5I_BADID;
     }
+}
 
-    status = H5Tinsert(comp_tid, "packet", HOFFSET(chess_word_packet_t, packet), array_tid);
-    if (status < 0) {
-        printf("failed to insert array\n");
-        error++;
-    }
+/* New packet table with TMIF_H5_CHUNK_RECS record chunks run through
+   shuffle then deflate at z_level */
+static int create_ztable(hid_t loc, const char *name) {
+    hsize_t dims[1] = {0};
+    hsize_t maxdims[1] = {H5S_UNLIMITED};
+    hsize_t chunk[1] = {TMIF_H5_CHUNK_RECS};
+    hid_t space;
+    hid_t dcpl;
+    hid_t dset = -1;
 
-    status = H5Tinsert(comp_tid, "timestamp_s", HOFFSET(chess_word_packet_t, timestamp_s), H5T_NATIVE_LLONG);
-    if (status < 0) {
-        //syslog(LOG_ERR, "H5Tinsert failed for timestamp_s");
-        error++;
+    space = H5Screate_simple(1, dims, maxdims);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    if ((space >= 0) && (dcpl >= 0) &&
+        (H5Pset_chunk(dcpl, 1, chunk) >= 0) &&
+        (H5Pset_shuffle(dcpl) >= 0) &&
+        (H5Pset_deflate(dcpl, z_level) >= 0)) {
+        dset = H5Dcreate2(loc, name, comp_tid, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
     }
-
-    status = H5Tinsert(comp_tid, "timestamp_us", HOFFSET(chess_word_packet_t, timestamp_us), H5T_NATIVE_LLONG);
-    if (status < 0) {
-        //syslog(LOG_ERR, "H5Tinsert failed for timestamp_us");
-        error++;
+    if (dcpl >= 0) {
+        H5Pclose(dcpl);
     }
+    if (space >= 0) {
+        H5Sclose(space);
+    }
+    if (dset < 0) {
+        return -1;
+    }
+    H5Dclose(dset);
+
+    return 0;
+}
 
-    /* open or create the packet table */
-    ptable = H5PTopen(fid, TABLE_NAME);
+/* New packet table for a stream in loc, compressed if z_level */
+static int create_table(hid_t loc, const char *name) {
+    hid_t ptable;
+
+    if (z_level > 0) {
+        return create_ztable(loc, name);
+    }
+    ptable = H5PTcreate_fl(loc, name, comp_tid, (hsize_t)TMIF_H5_CHUNK_RECS, -1);
     if (ptable == H5I_BADID) {
-        //syslog(LOG_WARNING, "WARNING: H5PTopen found no packet table yet...");
-        printf("warn: no packet table found yet...\n");
-        //ptable = H5PTcreate_fl(fid, TABLE_NAME, data_tid, (hsize_t)100, -1);
-        ptable = H5PTcreate_fl(fid, TABLE_NAME, comp_tid, (hsize_t)1000, -1);
-        if (ptable == H5I_BADID) {
-            printf("failed to create pt?\n");
-            //syslog(LOG_ERR, "Packet table creation failed");
-            error++;
-            H5Tclose(array_tid);
-            H5Tclose(comp_tid);
-            H5Fclose(fid);
-            return error;
-        }
+        return -1;
     }
+    H5PTclose(ptable);
 
-    /* Validate packet table... */
-    status = H5PTis_valid(ptable);
-    if (status < 0) {
-        //syslog(LOG_ERR, "hdf5 file does not contain valid packet table");
-        error++;
-        H5Tclose(array_tid);
-        H5Tclose(comp_tid);
-        H5PTclose(ptable);
-        H5Fclose(fid);
-        return error;
-    }
+    return 0;
+}
 
-    if (error == 0) {
-        tmif_init_good = 1;
-        tmif_hdf5_init = 1;
-        status = close_packet_save();
-        if (status != 0) {
-            printf("Failed to close objects!\n");
+/* Read (creating them if need be) the first_seq/last_seq attributes
+   of a stream's table into first_seq[]/last_seq[] */
+static int seq_attrs_open(int stream, const char *table) {
+    const char *names[2] = {"first_seq", "last_seq"};
+    uint64_t *vals[2] = {&first_seq[stream], &last_seq[stream]};
+    uint64_t none = TMIF_H5_SEQ_NONE;
+    hid_t dset;
+    hid_t space;
+    hid_t attr;
+    int error = 0;
+    int i = 0;
+
+    first_seq[stream] = TMIF_H5_SEQ_NONE;
+    last_seq[stream] = TMIF_H5_SEQ_NONE;
+    dset = H5Dopen2(fid, table, H5P_DEFAULT);
+    if (dset < 0) {
+        return -1;
+    }
+    for (i = 0; i < 2; i++) {
+        if (H5Aexists(dset, names[i]) > 0) {
+            attr = H5Aopen(dset, names[i], H5P_DEFAULT);
+            if ((attr < 0) || (H5Aread(attr, H5T_NATIVE_UINT64, vals[i]) < 0)) {
+                error++;
+            }
+        } else {
+            space = H5Screate(H5S_SCALAR);
+            attr = H5Acreate2(dset, names[i], H5T_NATIVE_UINT64, space,
+                              H5P_DEFAULT, H5P_DEFAULT);
+            if ((attr < 0) || (H5Awrite(attr, H5T_NATIVE_UINT64, &none) < 0)) {
+                error++;
+            }
+            H5Sclose(space);
+        }
+        if (attr >= 0) {
+            H5Aclose(attr);
         }
     }
+    H5Dclose(dset);
 
-    tmif_hdf5_init = 1;
-    return 0;
+    return error ? -1 : 0;
 }
 
-int close_packet_save(void) {
-    herr_t status;
+/* Write every stream's sequence range to its table's attributes */
+static int seq_attrs_write(void) {
+    const char *names[2] = {"first_seq", "last_seq"};
+    char table[64];
+    hid_t dset;
+    hid_t attr;
     int error = 0;
+    int stream = 0;
 
-    /* Close all of the hdf5 data type memory */
-    if (tmif_hdf5_init) {
-        status = H5Tclose(comp_tid);
-        if (status < 0) {
+    if (!seq_dirty) {
+        return 0;
+    }
+    for (stream = 0; stream < n_streams; stream++) {
+        stream_table_name(stream, table, sizeof(table));
+        dset = H5Dopen2(fid, table, H5P_DEFAULT);
+        if (dset < 0) {
             error++;
+            continue;
         }
-        status = H5Tclose(array_tid);
-        if (status < 0) {
+        attr = H5Aopen(dset, names[0], H5P_DEFAULT);
+        if ((attr < 0) || (H5Awrite(attr, H5T_NATIVE_UINT64, &first_seq[stream]) < 0)) {
             error++;
         }
-        status = H5PTclose(ptable);
-        if (status < 0) {
-            error++;
+        if (attr >= 0) {
+            H5Aclose(attr);
         }
-        status = H5Fclose(fid);
-        if (status < 0) {
+        attr = H5Aopen(dset, names[1], H5P_DEFAULT);
+        if ((attr < 0) || (H5Awrite(attr, H5T_NATIVE_UINT64, &last_seq[stream]) < 0)) {
             error++;
         }
-    } else {
-        error++;
+        if (attr >= 0) {
+            H5Aclose(attr);
+        }
+        H5Dclose(dset);
     }
+    seq_dirty = 0;
 
-    tmif_hdf5_init = 0;
     return error;
 }
 
-/* Note chess_pkt must be 735 in length. */
-int save_packet(uint16_t *chess_pkt) {
-    herr_t status;
-    /* Struct for packet and timestamp */
-    chess_word_packet_t data;
-    struct timeval ts;
-    int error = 0;
+/* Open the stream's table for direct chunk writes if its layout is
+   exactly what the workers produce. Anything else (tables from an
+   uncompressed run) keeps going through H5PTappend(). */
+static void open_ztable(int stream, const char *name) {
+    hsize_t chunk[1] = {0};
+    hsize_t dims[1] = {0};
+    unsigned int flags = 0;
+    unsigned int cd[4];
+    size_t n_cd = 4;
+    unsigned int fconfig = 0;
+    hid_t dset;
+    hid_t dcpl;
+    hid_t space;
+    int ok = 0;
 
-    fid = H5Fopen(FILE_NAME, H5F_ACC_RDWR, H5P_DEFAULT);
-    if (fid < 0) {
-        //syslog(LOG_WARNING, "WARNING: No hdf5 file exists yet!");
-        printf("WARNING: No hdf5 file exists yet!\n");
-        error++;
-        return -1;
+    dset = H5Dopen2(fid, name, H5P_DEFAULT);
+    if (dset < 0) {
+        return;
+    }
+    dcpl = H5Dget_create_plist(dset);
+    if (dcpl >= 0) {
+        ok = (H5Pget_layout(dcpl) == H5D_CHUNKED) &&
+            (H5Pget_chunk(dcpl, 1, chunk) == 1) &&
+            (chunk[0] == TMIF_H5_CHUNK_RECS) &&
+            (H5Pget_nfilters(dcpl) == 2) &&
+            (H5Pget_filter2(dcpl, 0, &flags, &n_cd, cd, 0, NULL, &fconfig) == H5Z_FILTER_SHUFFLE);
+        n_cd = 4;
+        ok = ok && (H5Pget_filter2(dcpl, 1, &flags, &n_cd, cd, 0, NULL, &fconfig) == H5Z_FILTER_DEFLATE);
+        H5Pclose(dcpl);
+    }
+    space = H5Dget_space(dset);
+    if ((space < 0) || (H5Sget_simple_extent_dims(space, dims, NULL) != 1)) {
+        ok = 0;
+    }
+    if (space >= 0) {
+        H5Sclose(space);
     }
 
-    /* open or create the packet table */
-    ptable = H5PTopen(fid, TABLE_NAME);
-    if (ptable == H5I_BADID) {
-        //syslog(LOG_WARNING, "WARNING: H5PTopen found no packet table yet...");
-        printf("warn: no packet table found yet...\n");
-        error++;
-        H5Fclose(fid);
-        return -1;
+    if (!ok) {
+        printf("warn: %s is not shuffle+deflate, appending to it uncompressed\n", name);
+        H5Dclose(dset);
+        return;
     }
+    dsets[stream] = dset;
+    rows[stream] = dims[0];
+    extent[stream] = dims[0];
+    z_on = 1;
+}
 
-    // /* Validate packet table... */
-    // status = H5PTis_valid(ptable);
-    // if (status < 0) {
-    //     //syslog(LOG_ERR, "hdf5 file does not contain valid packet table");
-    //     printf("save_packet(): Packet table invalid!\n");
-    //     error++;
-    //     H5PTclose(ptable);
-    //     H5Fclose(fid);
-    //     return -1;
-    // }
-
-    if (tmif_init_good) {
-        if (chess_pkt) {
-            /* Set the data */
-            // for (i = 0; i < CHESS_PACKET_LEN; i++) {
-            //     data.packet[i] = chess_pkt[i];
-            // }
-            memcpy(data.packet, chess_pkt, sizeof(uint16_t)*CHESS_PACKET_LEN);
-    
-            /* create timestamp */
-            gettimeofday(&ts, NULL);
-            data.timestamp_s = (int64_t)ts.tv_sec;
-            data.timestamp_us = (int64_t)ts.tv_usec;
-
-            /* Validate packet table... */
-            status = H5PTis_valid(ptable);
-            if (status == 0) {
-        
-                /* Append the packet */
-                status = H5PTappend(ptable, (hsize_t)1, &data);
-                if (status < 0) {
-                    //syslog(LOG_ERR, "Failed to append packet to table!");
-                    printf("Failed to append\n");
-                    error++;
-                }
+/* File access properties: a metadata cache big enough that appends
+   don't keep evicting the table's B-tree, and a chunk cache that holds
+   a whole 1000 record chunk (the 1 MB default does not, so every
+   append went straight to disk). w0 = 1 evicts fully written chunks
+   first. */
+static hid_t make_fapl(void) {
+    H5AC_cache_config_t mdc;
+    hid_t fapl;
 
-                /* Flush the file to disk */
-                status = H5Fflush(fid, H5F_SCOPE_LOCAL);
-                if (status < 0) {
-                    //syslog(LOG_ERR, "Failed to flush hdf5 file");
-                    printf("Failed to flush file\n");
-                    error++;
-                }
-            } else {
-                printf("PACKET TABLE IS NOT VALID!\n");
-                error++;
-            }
-        } else {
-            printf("NULL POINTER PASSED\n");
-            error++;
+    fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (fapl < 0) {
+        return H5P_DEFAULT;
+    }
+
+    mdc.version = H5AC__CURR_CACHE_CONFIG_VERSION;
+    if (H5Pget_mdc_config(fapl, &mdc) >= 0) {
+        mdc.set_initial_size = 1;
+        mdc.initial_size = TMIF_H5_MDC_SIZE;
+        if (mdc.max_size < TMIF_H5_MDC_SIZE) {
+            mdc.max_size = TMIF_H5_MDC_SIZE;
         }
+        H5Pset_mdc_config(fapl, &mdc);
+    }
+
+    H5Pset_cache(fapl, 0, TMIF_H5_CHUNK_SLOTS, TMIF_H5_CHUNK_CACHE, 1.0);
+
+    /* SWMR needs the latest file format */
+    if (swmr) {
+        H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+    }
+
+    return fapl;
+}
+
+/* File creation properties: paged aggregation keeps metadata and raw
+   data in their own file space pages instead of interleaving small
+   metadata blocks between the chunks */
+static hid_t make_fcpl(void) {
+    hid_t fcpl;
+
+    fcpl = H5Pcreate(H5P_FILE_CREATE);
+    if (fcpl < 0) {
+        return H5P_DEFAULT;
+    }
+#if H5_VERSION_GE(1, 10, 1)
+    H5Pset_file_space_strategy(fcpl, H5F_FSPACE_STRATEGY_PAGE, 0, (hsize_t)1);
+    H5Pset_file_space_page_size(fcpl, TMIF_H5_PAGE_SIZE);
+#endif
+
+    return fcpl;
+}
+
+/* Start a new numbered file when the open one reaches max_bytes,
+   max_rows records or max_seconds old (0 for no limit, all 0 for one
+   file). Call before init_packet_save(). */
+void set_packet_save_rotation(uint64_t max_bytes, uint64_t max_rows, int max_seconds) {
+    rot_bytes = max_bytes;
+    rot_rows = max_rows;
+    rot_secs = (max_seconds > 0) ? max_seconds : 0;
+    rot_on = (rot_bytes || rot_rows || rot_secs);
+}
+
+/* Archive to file instead of FILE_NAME, call before init_packet_save() */
+void set_packet_save_file(const char *file) {
+    file_name = file;
+}
+
+/* Create and write the file for SWMR readers (on by default), off
+   keeps the old file format for HDF5 1.8 readers. Call before
+   init_packet_save(). */
+void set_packet_save_swmr(int on) {
+    swmr = on;
+}
+
+/* Archive to a raw append log at file instead of HDF5 (NULL for HDF5),
+   call before init_packet_save() */
+void set_packet_save_log(const char *file) {
+    log_name = file;
+}
+
+/* Archive photon events instead of whole packets, keeping raw_fraction
+   of the packets (rounded to 1 in N by sequence number) in the packet
+   table as well. Call before init_packet_save(). */
+void set_packet_save_events(double raw_fraction) {
+    ev_on = 1;
+    if (raw_fraction <= 0.0) {
+        raw_every = 0;
+    } else if (raw_fraction >= 1.0) {
+        raw_every = 1;
     } else {
-        error++;
-        printf("TMIF_HDF5 did not successfully init, can't save packet...\n");
+        raw_every = (uint64_t)(1.0/raw_fraction + 0.5);
     }
+}
 
-    H5PTclose(ptable);
-    H5Fclose(fid);
-    
-    return error;
+/* Shuffle+deflate new tables at level (1-9, 0 for none) across workers
+   compression threads, call before init_packet_save() */
+void set_packet_save_compression(int level, int workers) {
+    if (level < 0) {
+        level = 0;
+    } else if (level > 9) {
+        level = 9;
+    }
+    z_level = level;
+    z_workers = workers;
+}
+
+/* hdf5 error handler function */
+static herr_t tmif_hdf5_error_handler(void *unused) {
+    /* Go through errors and log them... */
+    H5Ewalk(H5E_WALK_DOWNWARD, log_err, (void *)0);
+    return 0;
+}
+
+/* HDF5 memory type of chess_word_packet_t, the table record, for the
+   archive and the tools that read it. Close it after use. */
+hid_t tmif_h5_rec_type(void) {
+    hsize_t dim[1] = {CHESS_PACKET_LEN};
+    hid_t array_tid;
+    hid_t tid;
+
+    array_tid = H5Tarray_create2(H5T_NATIVE_UINT16, 1, dim);
+    if (array_tid < 0) {
+        return -1;
+    }
+    tid = H5Tcreate(H5T_COMPOUND, sizeof(chess_word_packet_t));
+    if ((tid >= 0) &&
+        ((H5Tinsert(tid, "packet", HOFFSET(chess_word_packet_t, packet), array_tid) < 0) ||
+         (H5Tinsert(tid, "timestamp_ns", HOFFSET(chess_word_packet_t, timestamp_ns),
+                    H5T_NATIVE_LLONG) < 0))) {
+        H5Tclose(tid);
+        tid = -1;
+    }
+    H5Tclose(array_tid);
+
+    return tid;
+}
+
+/* Read n rows from start of a 1-D dataset as type tid */
+int tmif_h5_read_slab(hid_t dset, hid_t tid, hsize_t start, hsize_t n, void *buf) {
+    hsize_t off[1];
+    hsize_t count[1];
+    hid_t fspace;
+    hid_t mspace;
+    herr_t status = -1;
+
+    off[0] = start;
+    count[0] = n;
+    fspace = H5Dget_space(dset);
+    mspace = H5Screate_simple(1, count, NULL);
+    if ((fspace >= 0) && (mspace >= 0) &&
+        (H5Sselect_hyperslab(fspace, H5S_SELECT_SET, off, NULL, count, NULL) >= 0)) {
+        status = H5Dread(dset, tid, mspace, fspace, H5P_DEFAULT, buf);
+    }
+    if (mspace >= 0) {
+        H5Sclose(mspace);
+    }
+    if (fspace >= 0) {
+        H5Sclose(fspace);
+    }
+
+    return (status < 0) ? -1 : 0;
 }
 
+/* Set up the writer queue and start the writer thread */
+static int start_writer(void) {
+    pthread_condattr_t attr;
+
+    q_recs = calloc(TMIF_H5_QUEUE_LEN, sizeof(chess_word_packet_t));
+    q_stream = calloc(TMIF_H5_QUEUE_LEN, sizeof(uint8_t));
+    q_seq = calloc(TMIF_H5_QUEUE_LEN, sizeof(uint64_t));
+    if (!q_recs || !q_stream || !q_seq) {
+        printf("Failed to allocate archive queue\n");
+        return 1;
+    }
+    q_head = 0;
+    q_tail = 0;
+    writer_stop = 0;
+    flush_req = 0;
+    writer_idle = 0;
+    memset(&w_stats, 0, sizeof(w_stats));
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&writer_tid, NULL, writer_main, NULL) != 0) {
+        printf("Failed to start archive writer\n");
+        return 1;
+    }
+    writer_running = 1;
+
+    return 0;
+}
 
-/* Note each chess_pkt must be 735 in length. */
-int save_packets(uint16_t *chess_pkts, uint8_t n_packets) {
+/* Open (or create) one archive file with a packet table, and event
+   group if wanted, per stream, then switch it to SWMR writing. Returns
+   the number of errors. */
+static int open_archive(const char *name) {
     herr_t status;
-    /* Struct for packet and timestamp */
-    chess_word_packet_t data;
-    struct timeval ts;
-    int i = 0;
     int error = 0;
-    int s = 0;
+    int stream = 0;
+    char table[64];
+    hid_t fapl;
+    hid_t fcpl;
+    hid_t ptable;
+    hbool_t clear = 1;
+    //hsize_t fspace;
 
-    fid = H5Fopen(FILE_NAME, H5F_ACC_RDWR, H5P_DEFAULT);
-    if (fid < 0) {
+    for (stream = 0; stream < TMIF_MAX_STREAMS; stream++) {
+        ptables[stream] = H5I_BADID;
+        dsets[stream] = H5I_BADID;
+        z_fill[stream] = NULL;
+    }
+    z_on = 0;
+
+    /* open the file or create it, never over an existing one */
+    fapl = make_fapl();
+    if (access(name, F_OK) != 0) {
         //syslog(LOG_WARNING, "WARNING: No hdf5 file exists yet!");
         printf("WARNING: No hdf5 file exists yet!\n");
-        error++;
-        return -1;
+        fcpl = make_fcpl();
+        fid = H5Fcreate(name, H5F_ACC_EXCL, fcpl, fapl);
+        if (fcpl != H5P_DEFAULT) {
+            H5Pclose(fcpl);
+        }
+    } else {
+        fid = H5Fopen(name, H5F_ACC_RDWR, fapl);
+        if ((fid < 0) && (fapl != H5P_DEFAULT)) {
+            /* A SWMR writer that died leaves the superblock marked open
+               for writing, clear it as h5clear -s would and try again */
+            printf("warn: %s won't open, clearing its status flags (unclean exit?)\n", name);
+            if (H5Pset(fapl, "clear_status_flags", &clear) >= 0) {
+                fid = H5Fopen(name, H5F_ACC_RDWR, fapl);
+            }
+        }
+        if (fid < 0) {
+            printf("archive: can't open %s, leaving it as is\n", name);
+        }
     }
-
-    /* open or create the packet table */
-    ptable = H5PTopen(fid, TABLE_NAME);
-    if (ptable == H5I_BADID) {
-        //syslog(LOG_WARNING, "WARNING: H5PTopen found no packet table yet...");
-        printf("warn: no packet table found yet...\n");
+    if (fapl != H5P_DEFAULT) {
+        H5Pclose(fapl);
+    }
+    if (fid < 0) {
+        //syslog(LOG_ERR, "Failed to create packet table file!");
+        printf("Failed to create packet table file!\n");
+        fid = -1;
         error++;
-        H5Fclose(fid);
-        return -1;
+        return error;
     }
 
-    /* Validate packet table... */
-    status = H5PTis_valid(ptable);
-    if (status < 0) {
-        //syslog(LOG_ERR, "hdf5 file does not contain valid packet table");
-        printf("save_packet(): Packet table invalid!\n");
-        error++;
-        H5PTclose(ptable);
+    // fspace = H5Fget_freespace(fid);
+    // printf("File free space: %d\n", (int)fspace);
+
+    /* Compound type (packet struct) */
+    comp_tid = tmif_h5_rec_type();
+    if (comp_tid < 0) {
+        printf("Failed to create comp_tid. \n");
         H5Fclose(fid);
-        return -1;
+        fid = -1;
+        error++;
+        return error;
     }
 
-    if (tmif_init_good) {
-        if (chess_pkts) {
-            /* create one timestamp for all packets */
-            s = gettimeofday(&ts, NULL);
-            if (s < 0) {
-                printf("gettimeofday() failed: %d\n", s);
+    for (stream = n_streams - 1; stream >= 0; stream--) {
+        stream_table_name(stream, table, sizeof(table));
+
+        /* open or create the packet table */
+        ptable = H5PTopen(fid, table);
+        if (ptable == H5I_BADID) {
+            //syslog(LOG_WARNING, "WARNING: H5PTopen found no packet table yet...");
+            printf("warn: no packet table %s found yet...\n", table);
+            //ptable = H5PTcreate_fl(fid, TABLE_NAME, data_tid, (hsize_t)100, -1);
+            if (create_table(fid, table) == 0) {
+                ptable = H5PTopen(fid, table);
+            }
+            if (ptable == H5I_BADID) {
+                printf("failed to create pt?\n");
+                //syslog(LOG_ERR, "Packet table creation failed");
                 error++;
+                H5Tclose(comp_tid);
+                close_tables();
+                H5Fclose(fid);
+                fid = -1;
+                return error;
             }
-            data.timestamp_s = (int64_t)ts.tv_sec;
-            data.timestamp_us = (int64_t)ts.tv_usec;
-
-            /* Loop over all packets and append them to ptable */
-            for (i = 0; i < n_packets; i++) {                
-                /* Set the data */
-                memcpy(&(data.packet), chess_pkts + i*735, sizeof(uint16_t)*CHESS_PACKET_LEN);
-    
-                /* Append the packet */
-                status = H5PTappend(ptable, (hsize_t)1, &data);
-                if (status < 0) {
-                    //syslog(LOG_ERR, "Failed to append packet to table!");
-                    printf("Failed to append\n");
-                    error++;
-                }
+        }
+        /* Tables stay open until close_archive() */
+        ptables[stream] = ptable;
+        pt_rows[stream] = 0;
+        H5PTget_num_packets(ptable, &pt_rows[stream]);
 
-            }
-        } else {
-            printf("NULL POINTER PASSED\n");
+        /* Validate packet table... */
+        status = H5PTis_valid(ptable);
+        if (status < 0) {
+            //syslog(LOG_ERR, "hdf5 file does not contain valid packet table");
             error++;
+            H5Tclose(comp_tid);
+            close_tables();
+            H5Fclose(fid);
+            fid = -1;
+            return error;
         }
-    } else {
-        error++;
-        printf("TMIF_HDF5 did not successfully init, can't save packet...\n");
-    }
 
-    /* Flush the file to disk */
-    status = H5Fflush(fid, H5F_SCOPE_LOCAL);
-    if (status < 0) {
-        //syslog(LOG_ERR, "Failed to flush hdf5 file");
-        printf("Failed to flush file\n");
-        error++;
-    }
+        /* Tables from before per-packet timestamps have a different
+           record layout, appending to them would scramble both */
+        if (table_type_ok(table) <= 0) {
+            printf("packet table %s has an old record layout, move %s aside\n",
+                   table, name);
+            error++;
+            H5Tclose(comp_tid);
+            close_tables();
+            H5Fclose(fid);
+            fid = -1;
+            return error;
+        }
+
+        if (seq_attrs_open(stream, table) < 0) {
+            error++;
+        }
 
+        if (z_level > 0) {
+            open_ztable(stream, table);
+        }
+
+        if (ev_on && (tmif_h5ev_open(fid, stream, z_level) < 0)) {
+            error++;
+        }
+
+        if (tmif_h5ix_open(fid, stream, z_level) < 0) {
+            error++;
+        }
+    }
+
+    if (z_on && !z_started) {
+        if (tmif_h5z_start(z_level, z_workers,
+                           TMIF_H5_CHUNK_RECS*sizeof(chess_word_packet_t),
+                           sizeof(chess_word_packet_t), TMIF_H5_Z_JOBS) != 0) {
+            printf("Failed to start compression workers\n");
+            error++;
+        }
+        z_started = 1;
+    }
+
+    /* Everything is created, readers may come in now. Files from
+       before SWMR (old superblock) carry on without it. */
+    swmr_on = 0;
+    if (swmr && (error == 0)) {
+        if (H5Fstart_swmr_write(fid) < 0) {
+            printf("warn: %s can't do SWMR (older file format?), no live readers\n", name);
+        } else {
+            swmr_on = 1;
+            printf("archive: SWMR writing %s, live readers welcome\n", name);
+        }
+    }
+
+    file_rows = 0;
+    file_open_ms = mono_ms();
+    tmif_hdf5_init = 1;
+
+    return error;
+}
+
+/* Finish everything in flight and close the archive file */
+static int close_archive(void) {
+    herr_t status;
+    int error = 0;
+
+    if (!tmif_hdf5_init) {
+        return 1;
+    }
+    if (z_on) {
+        finish_jobs();
+    }
+    if (ev_on) {
+        error += tmif_h5ev_close();
+    }
+    error += tmif_h5ix_close();
+    seq_dirty = 1;
+    error += seq_attrs_write();
+
+    /* Close all of the hdf5 data type memory */
+    status = H5Tclose(comp_tid);
+    if (status < 0) {
+        error++;
+    }
+    close_tables();
+    status = H5Fflush(fid, H5F_SCOPE_LOCAL);
+    if (status < 0) {
+        error++;
+    }
+    status = H5Fclose(fid);
+    if (status < 0) {
+        error++;
+    }
+    fid = -1;
+
+    tmif_hdf5_init = 0;
+    return error;
+}
+
+/* Numbered file for rotation: FILE_NAME less .h5, _NNNN.h5 */
+static void rotation_name(int index, char *name, size_t len) {
+    size_t base = strlen(file_name);
+
+    if ((base > 3) && (strcmp(file_name + base - 3, ".h5") == 0)) {
+        base -= 3;
+    }
+    snprintf(name, len, "%.*s_%04d.h5", (int)base, file_name, index);
+}
+
+/* Initialize all of the hdf5 items, one packet table per stream... */
+int init_packet_save(int streams) {
+    int error = 0;
+
+    if (streams < 1) {
+        streams = 1;
+    } else if (streams > TMIF_MAX_STREAMS) {
+        streams = TMIF_MAX_STREAMS;
+    }
+    n_streams = streams;
+
+    if (log_name) {
+        if (tmif_log_open(log_name, 0) < 0) {
+            error++;
+            return error;
+        }
+        tmif_init_good = 1;
+        return start_writer();
+    }
+
+    /* set custom hdf5 error handler to log any errors */
+    H5Eset_auto(tmif_hdf5_error_handler, NULL);
+
+    z_first_ns = 0;
+    z_last_ns = 0;
+    z_started = 0;
+    if (ev_on) {
+        if (raw_every) {
+            printf("archive: photon events, 1 in %llu packets raw\n",
+                   (unsigned long long)raw_every);
+        } else {
+            printf("archive: photon events only\n");
+        }
+    }
+
+    /* Rotating runs always start a new numbered file */
+    if (rot_on) {
+        file_index = 0;
+        do {
+            rotation_name(file_index++, cur_name, sizeof(cur_name));
+        } while (access(cur_name, F_OK) == 0);
+        file_index--;
+        next_ready = 0;
+        next_created = 0;
+    } else {
+        snprintf(cur_name, sizeof(cur_name), "%s", file_name);
+    }
+
+    /* No writer on a file that didn't open */
+    error = open_archive(cur_name);
+    if (fid < 0) {
+        return error;
+    }
+
+    if (error == 0) {
+        tmif_init_good = 1;
+    }
+
+    /* Hand the file over to the writer thread */
+    if (start_writer() != 0) {
+        error++;
+    }
+    return error;
+}
+
+/* Make the stream's dataset at least end records long */
+static int grow_dataset(int stream, hsize_t end) {
+    hsize_t dims[1];
+
+    if (end <= extent[stream]) {
+        return 0;
+    }
+    dims[0] = end;
+    if (H5Dset_extent(dsets[stream], dims) < 0) {
+        return -1;
+    }
+    extent[stream] = end;
+    return 0;
+}
+
+/* Write n records at rows[stream] through the normal filtered path.
+   Only used for the odd records that don't fill a whole chunk. */
+static void write_rows(int stream, chess_word_packet_t *recs, size_t n) {
+    hsize_t start[1];
+    hsize_t count[1];
+    hid_t fspace;
+    hid_t mspace;
+    herr_t status = -1;
+
+    start[0] = rows[stream];
+    count[0] = n;
+    if (grow_dataset(stream, rows[stream] + n) == 0) {
+        fspace = H5Dget_space(dsets[stream]);
+        mspace = H5Screate_simple(1, count, NULL);
+        if ((fspace >= 0) && (mspace >= 0) &&
+            (H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start, NULL, count, NULL) >= 0)) {
+            status = H5Dwrite(dsets[stream], comp_tid, mspace, fspace, H5P_DEFAULT, recs);
+        }
+        if (mspace >= 0) {
+            H5Sclose(mspace);
+        }
+        if (fspace >= 0) {
+            H5Sclose(fspace);
+        }
+    }
+
+    if (status < 0) {
+        printf("Failed to write records\n");
+        w_stats.errors++;
+    } else {
+        rows[stream] += n;
+        w_stats.written += n;
+        w_stats.appends++;
+    }
+}
+
+/* Put one compressed chunk in the file as is. A padded copy only
+   extends the dataset over its real records. */
+static void write_job(tmif_h5z_job_t *job) {
+    hsize_t offset[1];
+    size_t n = job->data_len/sizeof(chess_word_packet_t);
+    herr_t status = -1;
+
+    offset[0] = job->offset;
+    if (grow_dataset(job->stream, job->offset + n) == 0) {
+#if H5_VERSION_GE(1, 10, 3)
+        status = H5Dwrite_chunk(dsets[job->stream], H5P_DEFAULT, job->filter_mask,
+                                offset, job->out_len, job->out);
+#else
+        status = H5DOwrite_chunk(dsets[job->stream], H5P_DEFAULT, job->filter_mask,
+                                 offset, job->out_len, job->out);
+#endif
+    }
+
+    if (status < 0) {
+        printf("Failed to write chunk\n");
+        w_stats.errors++;
+    } else if (job->data_len == job->raw_len) {
+        /* a padded copy's records are counted with the full chunk */
+        w_stats.written += n;
+        w_stats.appends++;
+    }
+}
+
+/* Write compressed chunks in the order they were packed, stopping at
+   the first one still with the workers unless wait */
+static void write_jobs(int wait) {
+    tmif_h5z_job_t *job;
+
+    while ((job = tmif_h5z_oldest(wait)) != NULL) {
+        write_job(job);
+        tmif_h5z_release(job);
+    }
+}
+
+/* Pack records into whole chunks for the compression workers */
+static void pack_records(int stream, chess_word_packet_t *recs, size_t n) {
+    tmif_h5z_job_t *job;
+    size_t room = 0;
+    size_t k = 0;
+
+    if ((z_first_ns == 0) || (recs[0].timestamp_ns < z_first_ns)) {
+        z_first_ns = recs[0].timestamp_ns;
+    }
+    if (recs[n - 1].timestamp_ns > z_last_ns) {
+        z_last_ns = recs[n - 1].timestamp_ns;
+    }
+
+    while (n > 0) {
+        job = z_fill[stream];
+        if (!job) {
+            /* A table left part way through a chunk by an earlier run,
+               top that chunk up first */
+            room = TMIF_H5_CHUNK_RECS - (rows[stream] % TMIF_H5_CHUNK_RECS);
+            if (room < TMIF_H5_CHUNK_RECS) {
+                k = (n < room) ? n : room;
+                write_rows(stream, recs, k);
+                recs += k;
+                n -= k;
+                continue;
+            }
+
+            while ((job = tmif_h5z_acquire()) == NULL) {
+                write_jobs(0);
+                if ((job = tmif_h5z_acquire()) != NULL) {
+                    break;
+                }
+                /* Every job is queued, wait for the oldest */
+                job = tmif_h5z_oldest(1);
+                write_job(job);
+                tmif_h5z_release(job);
+            }
+            job->stream = stream;
+            job->offset = rows[stream];
+            z_fill[stream] = job;
+        }
+
+        room = TMIF_H5_CHUNK_RECS - job->raw_len/sizeof(chess_word_packet_t);
+        k = (n < room) ? n : room;
+        memcpy(job->raw + job->raw_len, recs, k*sizeof(chess_word_packet_t));
+        job->raw_len += k*sizeof(chess_word_packet_t);
+        recs += k;
+        n -= k;
+
+        if (k == room) {
+            rows[stream] += TMIF_H5_CHUNK_RECS;
+            z_fill[stream] = NULL;
+            job->data_len = job->raw_len;
+            tmif_h5z_submit(job);
+        }
+    }
+
+    write_jobs(0);
+}
+
+/* On a flush: every queued chunk, and a copy of each partly packed one
+   padded out with empty records, through the workers and straight
+   into the file. Packing carries on in the same job, and the full
+   chunk overwrites the copy when it's done. */
+static void flush_jobs(void) {
+    size_t chunk = TMIF_H5_CHUNK_RECS*sizeof(chess_word_packet_t);
+    tmif_h5z_job_t *fill;
+    tmif_h5z_job_t *job;
+    int stream = 0;
+
+    for (stream = 0; stream < n_streams; stream++) {
+        fill = z_fill[stream];
+        if (!fill || (fill->raw_len == 0)) {
+            continue;
+        }
+        if ((job = tmif_h5z_acquire()) == NULL) {
+            write_jobs(1);
+            job = tmif_h5z_acquire();
+        }
+        if (!job) {
+            printf("archive: no free chunk to flush stream %d\n", stream);
+            w_stats.errors++;
+            continue;
+        }
+        memcpy(job->raw, fill->raw, fill->raw_len);
+        memset(job->raw + fill->raw_len, 0, chunk - fill->raw_len);
+        job->raw_len = chunk;
+        job->data_len = fill->raw_len;
+        job->stream = stream;
+        job->offset = fill->offset;
+        tmif_h5z_submit(job);
+    }
+    write_jobs(1);
+}
+
+/* Finish off compression at close: every queued chunk, then the
+   partly packed ones through the normal filtered write */
+static void finish_jobs(void) {
+    tmif_h5z_job_t *job;
+    int stream = 0;
+
+    write_jobs(1);
+    for (stream = 0; stream < n_streams; stream++) {
+        job = z_fill[stream];
+        if (job) {
+            write_rows(stream, (chess_word_packet_t *)job->raw,
+                       job->raw_len/sizeof(chess_word_packet_t));
+            z_fill[stream] = NULL;
+            tmif_h5z_cancel(job);
+        }
+    }
+}
+
+/* Append one stream's contiguous run of records */
+static void append_records(int stream, chess_word_packet_t *recs, uint64_t *seqs, size_t n) {
+    herr_t status;
+    hsize_t base = 0;
+    uint16_t n_photons = 0;
+    size_t kept = 0;
+    size_t i = 0;
+    int keep = 0;
+
+    if (n == 0) {
+        return;
+    }
+
+    /* The file's sequence range covers every packet archived, raw or
+       as events */
+    for (i = 0; i < n; i++) {
+        if ((first_seq[stream] == TMIF_H5_SEQ_NONE) || (seqs[i] < first_seq[stream])) {
+            first_seq[stream] = seqs[i];
+        }
+        if ((last_seq[stream] == TMIF_H5_SEQ_NONE) || (seqs[i] > last_seq[stream])) {
+            last_seq[stream] = seqs[i];
+        }
+    }
+    seq_dirty = 1;
+    file_rows += n;
+
+    /* Index everything, squeeze the packets going in the table (ones
+       with photons, in event mode only the raw keepers) to the front */
+    if (dsets[stream] > 0) {
+        /* rows[] only moves on once the chunk being packed is full */
+        base = rows[stream];
+        if (z_fill[stream]) {
+            base += z_fill[stream]->raw_len/sizeof(chess_word_packet_t);
+        }
+    } else {
+        base = pt_rows[stream];
+    }
+    for (i = 0; i < n; i++) {
+        n_photons = recs[i].packet[0];
+        if (ev_on) {
+            tmif_h5ev_add(stream, &recs[i], seqs[i]);
+            keep = raw_every && ((seqs[i] % raw_every) == 0);
+        } else {
+            keep = 1;
+        }
+        if (!keep || (n_photons == 0)) {
+            tmif_h5ix_add(stream, seqs[i], recs[i].timestamp_ns, n_photons, TMIF_H5IX_EMPTY);
+            continue;
+        }
+        tmif_h5ix_add(stream, seqs[i], recs[i].timestamp_ns, n_photons, (int64_t)(base + kept));
+        if (kept != i) {
+            recs[kept] = recs[i];
+        }
+        kept++;
+    }
+    n = kept;
+    if (n == 0) {
+        return;
+    }
+
+    if (dsets[stream] > 0) {
+        pack_records(stream, recs, n);
+        return;
+    }
+    status = H5PTappend(ptables[stream], (hsize_t)n, recs);
+    if (status < 0) {
+        //syslog(LOG_ERR, "Failed to append packet to table!");
+        printf("Failed to append\n");
+        w_stats.errors++;
+    } else {
+        pt_rows[stream] += n;
+        w_stats.written += n;
+        w_stats.appends++;
+    }
+}
+
+/* Take up to TMIF_H5_APPEND_MAX records off the queue and append them,
+   one H5PTappend() per stream. Returns the number taken. */
+static size_t writer_drain(void) {
+    static chess_word_packet_t staging[TMIF_H5_APPEND_MAX];
+    static uint8_t staging_stream[TMIF_H5_APPEND_MAX];
+    static uint64_t staging_seq[TMIF_H5_APPEND_MAX];
+    static chess_word_packet_t by_stream[TMIF_MAX_STREAMS][TMIF_H5_APPEND_MAX];
+    static uint64_t by_stream_seq[TMIF_MAX_STREAMS][TMIF_H5_APPEND_MAX];
+    size_t n_by_stream[TMIF_MAX_STREAMS];
+    uint64_t head = __atomic_load_n(&q_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&q_tail, __ATOMIC_ACQUIRE);
+    uint64_t cur = 0;
+    size_t n = head - tail;
+    size_t first = 0;
+    size_t skip = 0;
+    size_t i = 0;
+    int stream = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+    if (n > TMIF_H5_APPEND_MAX) {
+        n = TMIF_H5_APPEND_MAX;
+    }
+
+    /* Copy out, in two pieces if the run wraps the end of the ring */
+    first = TMIF_H5_QUEUE_LEN - (tail & (TMIF_H5_QUEUE_LEN - 1));
+    if (first > n) {
+        first = n;
+    }
+    memcpy(staging, &q_recs[tail & (TMIF_H5_QUEUE_LEN - 1)], first*sizeof(chess_word_packet_t));
+    memcpy(staging_stream, &q_stream[tail & (TMIF_H5_QUEUE_LEN - 1)], first);
+    memcpy(staging_seq, &q_seq[tail & (TMIF_H5_QUEUE_LEN - 1)], first*sizeof(uint64_t));
+    memcpy(staging + first, q_recs, (n - first)*sizeof(chess_word_packet_t));
+    memcpy(staging_stream + first, q_stream, n - first);
+    memcpy(staging_seq + first, q_seq, (n - first)*sizeof(uint64_t));
+
+    /* Hand the slots back. Under drop-oldest the producer may have
+       moved the tail past some of what we copied (and overwritten it),
+       those records were counted as dropped, skip them. */
+    cur = tail;
+    while (!__atomic_compare_exchange_n(&q_tail, &cur, tail + n, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (cur >= (tail + n)) {
+            return n;
+        }
+    }
+    skip = cur - tail;
+
+    if (log_name) {
+        /* The log takes every stream in arrival order */
+        for (i = skip; i < n; i++) {
+            if (tmif_log_append(staging_stream[i], &staging[i], staging_seq[i]) < 0) {
+                w_stats.errors++;
+            } else {
+                w_stats.written++;
+            }
+        }
+        w_stats.appends++;
+        return n;
+    }
+
+    if (archive_down) {
+        for (i = skip; i < n; i++) {
+            if (spill_record(staging_stream[i], &staging[i], staging_seq[i]) < 0) {
+                w_stats.dropped++;
+            } else {
+                w_stats.spilled++;
+            }
+        }
+        return n;
+    }
+
+    if (n_streams == 1) {
+        append_records(0, staging + skip, staging_seq + skip, n - skip);
+        return n;
+    }
+
+    memset(n_by_stream, 0, sizeof(n_by_stream));
+    for (i = skip; i < n; i++) {
+        stream = staging_stream[i];
+        by_stream_seq[stream][n_by_stream[stream]] = staging_seq[i];
+        by_stream[stream][n_by_stream[stream]++] = staging[i];
+    }
+    for (stream = 0; stream < n_streams; stream++) {
+        append_records(stream, by_stream[stream], by_stream_seq[stream], n_by_stream[stream]);
+    }
+
+    return n;
+}
+
+/* Helper thread: reserve the prepared file's disk space */
+static void *prep_main(void *arg) {
+    int fd;
+
+    fd = open(next_name, O_WRONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)prep_bytes) != 0) {
+        perror("fallocate() next archive file");
+    }
+    close(fd);
+
+    return NULL;
+}
+
+/* Build the next numbered file with its packet tables (attributes and
+   event groups are added when it's opened) and start preallocating
+   it. frac is how far the open file is to its limit. */
+static void prepare_next(double frac) {
+    char table[64];
+    hid_t fapl;
+    hid_t fcpl;
+    hid_t next_fid;
+    hsize_t size = 0;
+    int error = 0;
+    int stream = 0;
+
+    /* The next free number, an earlier run's files are never reused */
+    next_index = file_index;
+    do {
+        rotation_name(++next_index, next_name, sizeof(next_name));
+    } while (access(next_name, F_OK) == 0);
+    fapl = make_fapl();
+    fcpl = make_fcpl();
+    next_fid = H5Fcreate(next_name, H5F_ACC_EXCL, fcpl, fapl);
+    if (fcpl != H5P_DEFAULT) {
+        H5Pclose(fcpl);
+    }
+    if (fapl != H5P_DEFAULT) {
+        H5Pclose(fapl);
+    }
+    if (next_fid < 0) {
+        /* Rather than retry on every append */
+        printf("archive: failed to create %s, rotation off, staying in %s\n",
+               next_name, cur_name);
+        w_stats.errors++;
+        rot_on = 0;
+        return;
+    }
+    next_created = 1;
+    for (stream = 0; stream < n_streams; stream++) {
+        stream_table_name(stream, table, sizeof(table));
+        if (create_table(next_fid, table) < 0) {
+            error++;
+        }
+    }
+    H5Fclose(next_fid);
+    if (error) {
+        printf("archive: failed to create tables in %s\n", next_name);
+        w_stats.errors++;
+    }
+    next_ready = 1;
+
+    /* Room for a file as big as this one will be */
+    if (rot_bytes) {
+        prep_bytes = rot_bytes;
+    } else {
+        H5Fget_filesize(fid, &size);
+        prep_bytes = (uint64_t)(size/((frac > 0.0) ? frac : 1.0));
+    }
+    if (prep_bytes > 0) {
+        if (pthread_create(&prep_tid, NULL, prep_main, NULL) == 0) {
+            prep_running = 1;
+        }
+    }
+}
+
+/* Close the open file and carry on in the prepared one */
+static void rotate_file(double frac) {
+    struct timespec t0;
+    struct timespec t1;
+    int64_t us = 0;
+
+    if (!next_ready) {
+        prepare_next(frac);
+        if (!next_ready) {
+            return;
+        }
+    }
+    if (prep_running) {
+        pthread_join(prep_tid, NULL);
+        prep_running = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (close_archive() != 0) {
+        w_stats.errors++;
+    }
+    if (open_archive(next_name) != 0) {
+        printf("archive: failed to open %s\n", next_name);
+        w_stats.errors++;
+    }
+    if (fid < 0) {
+        /* Go back to the file we were in and stay there */
+        unlink(next_name);
+        next_ready = 0;
+        next_created = 0;
+        rot_on = 0;
+        open_archive(cur_name);
+        if (fid < 0) {
+            printf("ARCHIVE STOPPED: can't reopen %s either, records go to %s.spill\n",
+                   cur_name, file_name);
+            archive_down = 1;
+            swmr_on = 0;
+        } else {
+            printf("archive: rotation off, carrying on in %s\n", cur_name);
+        }
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    us = (t1.tv_sec - t0.tv_sec)*1000000LL + (t1.tv_nsec - t0.tv_nsec)/1000;
+
+    snprintf(cur_name, sizeof(cur_name), "%s", next_name);
+    file_index = next_index;
+    next_ready = 0;
+    next_created = 0;
+    w_stats.rotations++;
+    if (us > w_stats.max_switch_us) {
+        w_stats.max_switch_us = us;
+    }
+    printf("archive: rotated to %s in %.1f ms\n", cur_name, us*1e-3);
+}
+
+/* How far the open file is to its rotation limit, prepare the next
+   file once it's close and switch when it's there. Runs after every
+   append, so a file ends at most one append past its limit. */
+static void check_rotation(int64_t now) {
+    hsize_t size = 0;
+    double frac = 0.0;
+    double f = 0.0;
+
+    if (!rot_on) {
+        return;
+    }
+
+    if (rot_bytes && (H5Fget_filesize(fid, &size) >= 0)) {
+        frac = (double)size/(double)rot_bytes;
+    }
+    if (rot_rows) {
+        f = (double)file_rows/(double)rot_rows;
+        frac = (f > frac) ? f : frac;
+    }
+    if (rot_secs) {
+        f = (now - file_open_ms)*1e-3/rot_secs;
+        frac = (f > frac) ? f : frac;
+    }
+
+    /* Empty files are never rotated out */
+    if (file_rows == 0) {
+        return;
+    }
+    if (frac >= 1.0) {
+        rotate_file(frac);
+    } else if ((frac >= TMIF_H5_ROTATE_PREP) && !next_ready) {
+        prepare_next(frac);
+    }
+}
+
+/* Wake the writer if it's asleep */
+static void wake_writer(void) {
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+/* Sleep until woken or the clock reaches until_ms, unless there is
+   already something to do. writer_idle and q_head are sequentially
+   consistent on both sides, so either the producer sees the writer
+   idle or the writer sees the new records. */
+static void writer_sleep(int64_t until_ms) {
+    struct timespec ts;
+
+    ts.tv_sec = until_ms/1000;
+    ts.tv_nsec = (until_ms % 1000)*1000000;
+
+    pthread_mutex_lock(&wake_lock);
+    __atomic_store_n(&writer_idle, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&writer_stop, __ATOMIC_SEQ_CST) &&
+        !__atomic_load_n(&flush_req, __ATOMIC_SEQ_CST) &&
+        ((__atomic_load_n(&q_head, __ATOMIC_SEQ_CST) -
+          __atomic_load_n(&q_tail, __ATOMIC_SEQ_CST)) < TMIF_H5_APPEND_MIN)) {
+        pthread_cond_timedwait(&wake_cond, &wake_lock, &ts);
+    }
+    __atomic_store_n(&writer_idle, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+/* Archive writer thread. The only caller of HDF5 between
+   init_packet_save() and close_packet_save(). Waits for a few hundred
+   records to build up (or TMIF_H5_WRITER_WAIT_MS) so each append is
+   big, and flushes the file when asked. */
+static void *writer_main(void *arg) {
+    struct timespec ts;
+    int64_t now = 0;
+    int64_t last = 0;
+    int64_t last_swmr = 0;
+    uint64_t swmr_written = 0;
+    int64_t until = 0;
+    uint64_t depth = 0;
+    int stop = 0;
+    int flush = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    last = (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+
+    while (1) {
+        stop = __atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE);
+        flush = __atomic_load_n(&flush_req, __ATOMIC_ACQUIRE);
+        depth = __atomic_load_n(&q_head, __ATOMIC_ACQUIRE) -
+            __atomic_load_n(&q_tail, __ATOMIC_ACQUIRE);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+
+        if ((depth >= TMIF_H5_APPEND_MIN) ||
+            ((depth > 0) && (stop || flush || ((now - last) >= TMIF_H5_WRITER_WAIT_MS)))) {
+            writer_drain();
+            last = now;
+            check_rotation(now);
+            continue;
+        }
+
+        /* Let SWMR readers see what's been appended */
+        if (swmr_on && (w_stats.written != swmr_written) &&
+            ((now - last_swmr) >= TMIF_H5_SWMR_FLUSH_MS)) {
+            if (H5Fflush(fid, H5F_SCOPE_LOCAL) < 0) {
+                w_stats.errors++;
+            }
+            w_stats.swmr_flushes++;
+            swmr_written = w_stats.written;
+            last_swmr = now;
+        }
+
+        if (z_on) {
+            write_jobs(0);
+        }
+        check_rotation(now);
+
+        if (depth == 0) {
+            if (flush) {
+                /* Everything compressed goes out, and the chunks still
+                   being packed so far */
+                if (z_on) {
+                    flush_jobs();
+                }
+                if (ev_on && !archive_down && (tmif_h5ev_flush() != 0)) {
+                    w_stats.errors++;
+                }
+                if (archive_down) {
+                    pthread_mutex_lock(&spill_lock);
+                    if (spill_fp) {
+                        fflush(spill_fp);
+                    }
+                    pthread_mutex_unlock(&spill_lock);
+                } else if (log_name) {
+                    if (tmif_log_sync() < 0) {
+                        w_stats.errors++;
+                    }
+                } else {
+                    if ((tmif_h5ix_flush() + seq_attrs_write()) != 0) {
+                        w_stats.errors++;
+                    }
+                    if (H5Fflush(fid, H5F_SCOPE_LOCAL) < 0) {
+                        //syslog(LOG_ERR, "Failed to flush hdf5 file");
+                        printf("Failed to flush file\n");
+                        w_stats.errors++;
+                    }
+                }
+                w_stats.flushes++;
+                __atomic_store_n(&flush_req, 0, __ATOMIC_RELEASE);
+            }
+            if (stop) {
+                if (z_on) {
+                    finish_jobs();
+                }
+                break;
+            }
+        }
+
+        /* Up to the next append or SWMR flush that falls due */
+        until = now + TMIF_H5_WRITER_IDLE_MS;
+        if ((depth > 0) && ((last + TMIF_H5_WRITER_WAIT_MS) < until)) {
+            until = last + TMIF_H5_WRITER_WAIT_MS;
+        }
+        if (swmr_on && (w_stats.written != swmr_written) &&
+            ((last_swmr + TMIF_H5_SWMR_FLUSH_MS) < until)) {
+            until = last_swmr + TMIF_H5_SWMR_FLUSH_MS;
+        }
+        writer_sleep(until);
+    }
+
+    return NULL;
+}
+
+/* Open FILE_NAME.spill, an archive log (tmif_log.h) so log2h5 turns
+   it into an archive file, carrying on after the last whole frame of
+   one already there. Called with spill_lock held. */
+static int spill_open(void) {
+    static uint8_t hdr_block[TMIF_LOG_ALIGN];
+    tmif_log_header_t *hdr = (tmif_log_header_t *)hdr_block;
+    char name[512];
+    long size = 0;
+
+    snprintf(name, sizeof(name), "%s.spill", file_name);
+    spill_fp = fopen(name, "r+b");
+    if (spill_fp) {
+        if ((fread(hdr_block, TMIF_LOG_ALIGN, 1, spill_fp) != 1) ||
+            (memcmp(hdr->magic, TMIF_LOG_FILE_MAGIC, sizeof(hdr->magic)) != 0) ||
+            (hdr->frame_size != TMIF_LOG_FRAME_SIZE) ||
+            (fseek(spill_fp, 0, SEEK_END) != 0) || ((size = ftell(spill_fp)) < 0)) {
+            printf("archive: %s is not a spill log, move it aside\n", name);
+            fclose(spill_fp);
+            spill_fp = NULL;
+            return -1;
+        }
+        spill_frames = (uint64_t)(size - TMIF_LOG_ALIGN)/TMIF_LOG_FRAME_SIZE;
+    } else {
+        spill_fp = fopen(name, "w+b");
+        if (!spill_fp) {
+            perror("fopen() spill file");
+            return -1;
+        }
+        tmif_log_header(hdr_block);
+        if (fwrite(hdr_block, TMIF_LOG_ALIGN, 1, spill_fp) != 1) {
+            perror("fwrite() spill file");
+            fclose(spill_fp);
+            spill_fp = NULL;
+            return -1;
+        }
+        spill_frames = 0;
+    }
+    /* a torn last frame is written over */
+    fseek(spill_fp, (long)(TMIF_LOG_ALIGN + spill_frames*TMIF_LOG_FRAME_SIZE), SEEK_SET);
+    printf("archive: spilling to %s (log2h5 reads it), %llu records already in it\n",
+           name, (unsigned long long)spill_frames);
+
+    return 0;
+}
+
+/* Queue-full handling for spill, and everything once the archive is
+   down: the record as a checksummed log frame in the spill file */
+static int spill_record(int stream, chess_word_packet_t *rec, uint64_t seq) {
+    static tmif_log_frame_t frame;
+    static chess_word_packet_t full;
+    int status = 0;
+
+    pthread_mutex_lock(&spill_lock);
+    if (!spill_fp && (spill_open() < 0)) {
+        pthread_mutex_unlock(&spill_lock);
+        return -1;
+    }
+    /* The queue only keeps the header of an empty packet */
+    if (rec->packet[0] == 0) {
+        full = *rec;
+        memset(&full.packet[3], 0, sizeof(full.packet) - 3*sizeof(full.packet[0]));
+        rec = &full;
+    }
+    tmif_log_frame(&frame, stream, rec, seq, spill_frames);
+    if (fwrite(&frame, sizeof(frame), 1, spill_fp) != 1) {
+        status = -1;
+    } else {
+        spill_frames++;
+    }
+    pthread_mutex_unlock(&spill_lock);
+    return status;
+}
+
+/* Put one record on the writer queue, applying the queue-full policy.
+   Only ever called from the one producer thread. */
+static int enqueue_record(int stream, uint16_t *chess_pkt, int64_t rx_ns, uint64_t seq) {
+    chess_word_packet_t *slot;
+    chess_word_packet_t rec;
+    uint64_t head = q_head;
+    uint64_t tail = __atomic_load_n(&q_tail, __ATOMIC_ACQUIRE);
+    int blocked = 0;
+
+    while ((head - tail) >= TMIF_H5_QUEUE_LEN) {
+        if (policy == TMIF_H5_DROP_OLDEST) {
+            /* Fails only if the writer just took it, then there's room */
+            if (__atomic_compare_exchange_n(&q_tail, &tail, tail + 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                w_stats.dropped++;
+                tail++;
+            }
+        } else if (policy == TMIF_H5_SPILL) {
+            memcpy(rec.packet, chess_pkt, sizeof(uint16_t)*CHESS_PACKET_LEN);
+            rec.timestamp_ns = rx_ns;
+            if (spill_record(stream, &rec, seq) < 0) {
+                w_stats.dropped++;
+                return 1;
+            }
+            w_stats.spilled++;
+            return 0;
+        } else {
+            if (!blocked) {
+                w_stats.blocked++;
+                blocked = 1;
+            }
+            usleep(50);
+            tail = __atomic_load_n(&q_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    /* Empty packets only go in the index, their header is enough */
+    slot = &q_recs[head & (TMIF_H5_QUEUE_LEN - 1)];
+    if ((chess_pkt[0] == 0) && !log_name) {
+        memcpy(slot->packet, chess_pkt, sizeof(uint16_t)*3);
+    } else {
+        memcpy(slot->packet, chess_pkt, sizeof(uint16_t)*CHESS_PACKET_LEN);
+    }
+    slot->timestamp_ns = rx_ns;
+    q_stream[head & (TMIF_H5_QUEUE_LEN - 1)] = (uint8_t)stream;
+    q_seq[head & (TMIF_H5_QUEUE_LEN - 1)] = seq;
+    __atomic_store_n(&q_head, head + 1, __ATOMIC_SEQ_CST);
+    if (((head + 1 - tail) >= TMIF_H5_APPEND_MIN) &&
+        __atomic_load_n(&writer_idle, __ATOMIC_SEQ_CST)) {
+        wake_writer();
+    }
+
+    w_stats.queued++;
+    if ((head + 1 - tail) > w_stats.max_depth) {
+        w_stats.max_depth = head + 1 - tail;
+    }
+
+    return 0;
+}
+
+/* What to do with packets when the writer falls behind and the queue
+   is full, call before init_packet_save() */
+void set_packet_save_policy(tmif_h5_policy_t p) {
+    policy = p;
+}
+
+/* Ask the writer to push everything queued so far out to the file.
+   Returns straight away. */
+int flush_packet_save(void) {
+    if (!writer_running) {
+        return -1;
+    }
+
+    __atomic_store_n(&flush_req, 1, __ATOMIC_RELEASE);
+    wake_writer();
+    return 0;
+}
+
+/* Let the writer finish the queue, then close everything */
+int close_packet_save(void) {
+    int error = 0;
+
+    if (writer_running) {
+        __atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+        wake_writer();
+        pthread_join(writer_tid, NULL);
+        writer_running = 0;
+    }
+    if (prep_running) {
+        pthread_join(prep_tid, NULL);
+        prep_running = 0;
+    }
+    if (spill_fp) {
+        fclose(spill_fp);
+        spill_fp = NULL;
+    }
+    free(q_recs);
+    free(q_stream);
+    free(q_seq);
+    q_recs = NULL;
+    q_stream = NULL;
+    q_seq = NULL;
+
+    if (log_name) {
+        tmif_init_good = 0;
+        return tmif_log_close();
+    }
+
+    error += close_archive();
+    if (z_started) {
+        tmif_h5z_stop();
+        z_started = 0;
+    }
+
+    /* A file this run prepared and never switched to is just empty
+       tables */
+    if (next_created) {
+        unlink(next_name);
+        next_created = 0;
+    }
+    next_ready = 0;
+
+    return error;
+}
+
+void print_packet_save_stats(void) {
+    printf("archive: queued %llu, written %llu in %llu appends (%.1f per append), "
+           "flushes %llu\n",
+           (unsigned long long)w_stats.queued, (unsigned long long)w_stats.written,
+           (unsigned long long)w_stats.appends,
+           w_stats.appends ? (double)w_stats.written/(double)w_stats.appends : 0.0,
+           (unsigned long long)w_stats.flushes);
+    if (swmr_on) {
+        printf("archive: SWMR flushes %llu\n", (unsigned long long)w_stats.swmr_flushes);
+    }
+    if (rot_on && !log_name) {
+        printf("archive: %llu rotations, slowest switch %.1f ms, last file %s\n",
+               (unsigned long long)w_stats.rotations, w_stats.max_switch_us*1e-3, cur_name);
+    }
+    printf("archive: queue max depth %llu of %d, dropped %llu, spilled %llu, "
+           "blocked %llu, errors %llu\n",
+           (unsigned long long)w_stats.max_depth, TMIF_H5_QUEUE_LEN,
+           (unsigned long long)w_stats.dropped, (unsigned long long)w_stats.spilled,
+           (unsigned long long)w_stats.blocked, (unsigned long long)w_stats.errors);
+    if (z_on) {
+        tmif_h5z_print_stats((z_last_ns - z_first_ns)*1e-9);
+    }
+    if (ev_on) {
+        tmif_h5ev_print_stats();
+    }
+    if (!log_name) {
+        tmif_h5ix_print_stats();
+    }
+    if (log_name) {
+        tmif_log_print_stats();
+    }
+}
+
+/* Note chess_pkt must be 735 in length. rx_ns is its receive time.
+   Goes to stream 0, sequence number straight from the packet counter. */
+int save_packet(uint16_t *chess_pkt, int64_t rx_ns) {
+    return save_packets(0, chess_pkt, &rx_ns, NULL, 1);
+}
+
+
+/* Note each chess_pkt must be 735 in length. rx_ns holds each packet's
+   receive time and seq its 64-bit sequence number (NULL to use the
+   16-bit packet counter). stream picks the packet table (one per
+   packet source). The packets are copied onto the writer queue,
+   nothing touches the file here. */
+int save_packets(int stream, uint16_t *chess_pkts, int64_t *rx_ns, uint64_t *seq,
+                 uint8_t n_packets) {
+    int i = 0;
+    int error = 0;
+
+    if ((stream < 0) || (stream >= n_streams)) {
+        printf("save_packets(): bad stream %d\n", stream);
+        return -1;
+    }
+
+    if (tmif_init_good && writer_running) {
+        if (chess_pkts && rx_ns) {
+            for (i = 0; i < n_packets; i++) {
+                error += enqueue_record(stream, chess_pkts + i*735, rx_ns[i],
+                                        seq ? seq[i] : chess_pkts[i*735 + 1]);
+            }
+        } else {
+            printf("NULL POINTER PASSED\n");
+            error++;
+        }
+    } else {
+        error++;
+        printf("TMIF_HDF5 did not successfully init, can't save packet...\n");
+    }
 
-    H5PTclose(ptable);
-    H5Fclose(fid);
-    
     return error;
 }
@@ -8,24 +8,79 @@
 */
 
 #include <stdint.h>
+#include <hdf5.h>
 
 #define FILE_NAME "/home/clu/flight_data/chess_flight_data.h5"
 #define TABLE_NAME "CHESS_PACKETS"
+/* Most archive streams (one packet table per packet source). Stream 0
+   is TABLE_NAME, stream n is TABLE_NAME_n. */
+#define TMIF_MAX_STREAMS 4
+/* Metadata cache starting size */
+#define TMIF_H5_MDC_SIZE (4*1024*1024)
+/* Raw data chunk cache, big enough for a few 1000 record chunks */
+#define TMIF_H5_CHUNK_CACHE (8*1024*1024)
+#define TMIF_H5_CHUNK_SLOTS 521
+/* File space page size for paged aggregation */
+#define TMIF_H5_PAGE_SIZE (64*1024)
+/* Writer queue length in records (power of two), ~1.6 s at 10k
+   packets/s */
+#define TMIF_H5_QUEUE_LEN 16384
+/* Records per H5PTappend(): wait for at least MIN, take at most MAX */
+#define TMIF_H5_APPEND_MIN 256
+#define TMIF_H5_APPEND_MAX 1024
+/* Longest SWMR readers wait for appended records */
+#define TMIF_H5_SWMR_FLUSH_MS 100
+/* Longest the writer sits on fewer than APPEND_MIN records */
+#define TMIF_H5_WRITER_WAIT_MS 50
+/* Longest the writer sleeps with nothing to wake it, for compressed
+   chunks coming back and time based rotation */
+#define TMIF_H5_WRITER_IDLE_MS 10
+/* Records per table chunk */
+#define TMIF_H5_CHUNK_RECS 1000
+/* Chunks in flight through the compression workers */
+#define TMIF_H5_Z_JOBS 8
+/* Rotation: build and preallocate the next file at this fraction of
+   the limit */
+#define TMIF_H5_ROTATE_PREP 0.9
+/* first_seq/last_seq of a table with nothing in it yet */
+#define TMIF_H5_SEQ_NONE UINT64_MAX
 /* Number of 16-bit words in CHESS UDP packet */
 #define CHESS_PACKET_LEN 735
 
 
-/* SLICE word packet */
+/* SLICE word packet. timestamp_ns is the kernel receive time of the
+   packet in ns since the epoch. */
 typedef struct {
     uint16_t packet[735];
-    int64_t timestamp_s;
-    int64_t timestamp_us;
+    int64_t timestamp_ns;
 } chess_word_packet_t;
 
 
-int init_packet_save(void);
+/* What save_packets() does when the writer queue is full */
+typedef enum {
+    /* wait for the writer (stalls ingest and telemetry) */
+    TMIF_H5_BLOCK = 0,
+    /* throw away the oldest queued record */
+    TMIF_H5_DROP_OLDEST,
+    /* append the record to FILE_NAME.spill (an archive log) instead */
+    TMIF_H5_SPILL
+} tmif_h5_policy_t;
+
+
+void set_packet_save_file(const char *);
+void set_packet_save_policy(tmif_h5_policy_t);
+void set_packet_save_compression(int, int);
+void set_packet_save_events(double);
+void set_packet_save_log(const char *);
+void set_packet_save_swmr(int);
+void set_packet_save_rotation(uint64_t, uint64_t, int);
+int init_packet_save(int);
+int flush_packet_save(void);
 int close_packet_save(void);
-int save_packet(uint16_t *);
-int save_packets(uint16_t *, uint8_t);
+void print_packet_save_stats(void);
+int save_packet(uint16_t *, int64_t);
+int save_packets(int, uint16_t *, int64_t *, uint64_t *, uint8_t);
+hid_t tmif_h5_rec_type(void);
+int tmif_h5_read_slab(hid_t, hid_t, hsize_t, hsize_t, void *);
 
 #endif /* TMIF_HDF5_H_ */
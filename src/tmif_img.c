@@ -0,0 +1,181 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Quicklook image and pulse height histogram, see tmif_img.h. tmif
+   accumulates and cuts the frames, the ground decoder reads them with
+   tmif_img_part().
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmif_img.h"
+
+#define IMG_FIELD_MASK ((1 << TMIF_WORD_BITS) - 1)
+
+
+/* Set up an empty 2^x_bits by 2^y_bits image starting at now_ns.
+   Returns 0, or -1 for a bad binning or no memory. */
+int tmif_img_init(tmif_img_t *im, int x_bits, int y_bits, int phd_shift, int64_t now_ns) {
+    size_t bins = (size_t)1 << (x_bits + y_bits);
+
+    memset(im, 0, sizeof(*im));
+    if ((x_bits < 1) || (x_bits > TMIF_WORD_BITS) || (y_bits < 1) || (y_bits > TMIF_WORD_BITS) ||
+        (x_bits + y_bits > TMIF_IMG_MAX_BITS) || (phd_shift < 0) || (phd_shift > TMIF_WORD_BITS)) {
+        return -1;
+    }
+    im->img = calloc(bins, sizeof(uint16_t));
+    im->snap = calloc(bins, sizeof(uint16_t));
+    if (!im->img || !im->snap) {
+        tmif_img_free(im);
+        return -1;
+    }
+    im->x_bits = x_bits;
+    im->y_bits = y_bits;
+    im->phd_shift = phd_shift;
+    im->start_ns = now_ns;
+    im->snap_next = -1;
+
+    return 0;
+}
+
+void tmif_img_free(tmif_img_t *im) {
+    free(im->img);
+    free(im->snap);
+    im->img = NULL;
+    im->snap = NULL;
+}
+
+/* Count n photons (x, y, phd triples as in the packet) */
+void tmif_img_add(tmif_img_t *im, const uint16_t *p, int n) {
+    int x_shift = TMIF_WORD_BITS - im->x_bits;
+    int y_shift = TMIF_WORD_BITS - im->y_bits;
+    uint16_t *img = im->img;
+    uint16_t *phd = im->phd;
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t b = 0;
+    int i = 0;
+
+    for (i = 0; i < n; i++) {
+        x = p[3*i] >> 1;
+        y = p[3*i + 1] >> 1;
+        x = (x > IMG_FIELD_MASK) ? IMG_FIELD_MASK : x;
+        y = (y > IMG_FIELD_MASK) ? IMG_FIELD_MASK : y;
+        b = ((y >> y_shift) << im->x_bits) | (x >> x_shift);
+        img[b] += (img[b] != 0xFFFF);
+
+        b = p[3*i + 2] >> im->phd_shift;
+        b = (b >= TMIF_IMG_PHD_BINS) ? (TMIF_IMG_PHD_BINS - 1) : b;
+        phd[b] += (phd[b] != 0xFFFF);
+    }
+    im->photons += n;
+}
+
+/* End the period at now_ns: what was accumulated becomes the snapshot
+   to send (replacing one still being sent) and the next starts
+   empty */
+void tmif_img_snap(tmif_img_t *im, int64_t now_ns) {
+    uint16_t *swap = im->snap;
+    int64_t ms = (now_ns - im->start_ns)/1000000;
+
+    im->snap = im->img;
+    im->img = swap;
+    memcpy(im->snap_phd, im->phd, sizeof(im->phd));
+    memset(im->img, 0, sizeof(uint16_t) << (im->x_bits + im->y_bits));
+    memset(im->phd, 0, sizeof(im->phd));
+
+    im->snap_seq = (uint16_t)im->snaps++;
+    im->snap_ms = (ms > 0xFFFF) ? 0xFFFF : (uint16_t)ms;
+    im->snap_photons = im->photons;
+    im->snap_next = 0;
+    im->photons = 0;
+    im->start_ns = now_ns;
+}
+
+/* Cut the next frame of the snapshot, at most max_words long, into
+   frame. Returns its words, 0 once the image and histogram are all
+   sent. The snapshot stays at this frame until tmif_img_sent(), so one
+   that can't go now is cut again next time. */
+int tmif_img_frame(tmif_img_t *im, uint16_t *frame, int max_words) {
+    int n_img = 1 << (im->x_bits + im->y_bits);
+    int max_bins = max_words - TMIF_FRM_OVERHEAD - TMIF_IMG_PART_HEADER;
+    uint16_t *payload = frame + TMIF_FRM_HEADER;
+    const uint16_t *bins;
+    uint16_t param = 0;
+    int type = 0;
+    int first = 0;
+    int count = 0;
+
+    if ((im->snap_next < 0) || (max_bins < 1)) {
+        return 0;
+    }
+    if (im->snap_next < n_img) {
+        type = TMIF_FRM_IMAGE;
+        param = (uint16_t)((im->x_bits << 8) | im->y_bits);
+        first = im->snap_next;
+        count = n_img - first;
+        bins = im->snap + first;
+    } else {
+        type = TMIF_FRM_PHD;
+        param = (uint16_t)im->phd_shift;
+        first = im->snap_next - n_img;
+        count = TMIF_IMG_PHD_BINS - first;
+        bins = im->snap_phd + first;
+    }
+    if (count > max_bins) {
+        count = max_bins;
+    }
+
+    payload[0] = im->snap_seq;
+    payload[1] = (uint16_t)first;
+    payload[2] = im->snap_ms;
+    memcpy(&payload[TMIF_IMG_PART_HEADER], bins, count*sizeof(uint16_t));
+
+    return tmif_frm_close(frame, type, count, param, TMIF_IMG_PART_HEADER + count);
+}
+
+/* The frame tmif_img_frame() cut went out, move on past its bins */
+void tmif_img_sent(tmif_img_t *im, const uint16_t *frame) {
+    int n_img = 1 << (im->x_bits + im->y_bits);
+
+    if (im->snap_next < 0) {
+        return;
+    }
+    im->snap_next += frame[2];
+    if (im->snap_next >= n_img + TMIF_IMG_PHD_BINS) {
+        im->snap_next = -1;
+    }
+    im->frames++;
+}
+
+/* Read an image or histogram frame, -1 if it isn't a sound one */
+int tmif_img_part(const tmif_frm_t *f, tmif_img_part_t *part) {
+    int n_bins = 0;
+
+    memset(part, 0, sizeof(*part));
+    if (((f->type != TMIF_FRM_IMAGE) && (f->type != TMIF_FRM_PHD)) ||
+        (f->length != TMIF_IMG_PART_HEADER + f->count)) {
+        return -1;
+    }
+    part->type = f->type;
+    if (f->type == TMIF_FRM_IMAGE) {
+        part->x_bits = f->param >> 8;
+        part->y_bits = f->param & 0xFF;
+        if ((part->x_bits < 1) || (part->y_bits < 1) ||
+            (part->x_bits + part->y_bits > TMIF_IMG_MAX_BITS)) {
+            return -1;
+        }
+        n_bins = 1 << (part->x_bits + part->y_bits);
+    } else {
+        part->phd_shift = f->param;
+        n_bins = TMIF_IMG_PHD_BINS;
+    }
+    part->seq = f->payload[0];
+    part->first = f->payload[1];
+    part->ms = f->payload[2];
+    part->count = f->count;
+    part->bins = &f->payload[TMIF_IMG_PART_HEADER];
+
+    return (part->first + part->count <= n_bins) ? 0 : -1;
+}
@@ -0,0 +1,83 @@
+#ifndef TMIF_IMG_H_
+#define TMIF_IMG_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   On-board quicklook: a detector image, counts of (x >> 1, y >> 1)
+   binned to 2^x_bits by 2^y_bits, and a pulse height histogram of
+   phd >> phd_shift, accumulated from every photon and sent down every
+   so often as telemetry frames (tmif_frm.h) at a fixed cost whatever
+   the count rate.
+
+   Counts are 16 bit and saturate at 0xFFFF, so a 128 x 128 image is
+   32 kB and stays in cache next to the packet path. At the end of
+   each period the image is swapped with a second one that the frames
+   are cut from, while the next period accumulates.
+
+   TMIF_FRM_IMAGE   param x_bits << 8 | y_bits, count bins
+   TMIF_FRM_PHD     param phd_shift, count bins
+
+   each with a payload of
+
+   image sequence number
+   first bin (image bins run x fastest, row by row)
+   milliseconds accumulated (saturating)
+   count bins
+*/
+
+#include <stdint.h>
+
+#include "tmif_frm.h"
+
+#define TMIF_IMG_PHD_BINS 256
+/* Biggest image, 2^16 bins (128 kB) */
+#define TMIF_IMG_MAX_BITS 16
+/* Words ahead of the bins in a frame's payload */
+#define TMIF_IMG_PART_HEADER 3
+
+typedef struct {
+    int x_bits;
+    int y_bits;
+    int phd_shift;
+    /* the image being accumulated, and the last one being sent */
+    uint16_t *img;
+    uint16_t *snap;
+    uint16_t phd[TMIF_IMG_PHD_BINS];
+    uint16_t snap_phd[TMIF_IMG_PHD_BINS];
+    uint64_t photons;
+    int64_t start_ns;
+
+    /* snapshot being sent: its number, length, photons and the next
+       bin to go (image then histogram), -1 when all sent */
+    uint16_t snap_seq;
+    uint16_t snap_ms;
+    uint64_t snap_photons;
+    int snap_next;
+
+    uint64_t snaps;
+    uint64_t frames;
+} tmif_img_t;
+
+/* One frame's part of an image or histogram, as the ground reads it */
+typedef struct {
+    int type;
+    int x_bits;
+    int y_bits;
+    int phd_shift;
+    uint16_t seq;
+    int first;
+    uint16_t ms;
+    int count;
+    const uint16_t *bins;
+} tmif_img_part_t;
+
+int tmif_img_init(tmif_img_t *, int, int, int, int64_t);
+void tmif_img_free(tmif_img_t *);
+void tmif_img_add(tmif_img_t *, const uint16_t *, int);
+void tmif_img_snap(tmif_img_t *, int64_t);
+int tmif_img_frame(tmif_img_t *, uint16_t *, int);
+void tmif_img_sent(tmif_img_t *, const uint16_t *);
+int tmif_img_part(const tmif_frm_t *, tmif_img_part_t *);
+
+#endif /* TMIF_IMG_H_ */
@@ -0,0 +1,378 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Raw append log archive backend, see tmif_log.h. Only ever called
+   from the archive writer thread (or a single threaded tool), apart
+   from tmif_log_frame() and tmif_log_header() which only fill in the
+   caller's memory (the archive spill file is in the same format).
+
+   Frames are packed into an aligned buffer and written
+   TMIF_LOG_BLOCK_FRAMES at a time. tmif_log_sync() writes whatever is
+   buffered, padded out to whole aligned blocks with empty frames, and
+   fdatasync()s. The partly filled last group stays in the buffer and
+   is written again, with more frames in it, next time. Appends stay
+   inside fallocate()d space so a sync never has to journal a size
+   change.
+*/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "tmif_log.h"
+
+
+static int fd = -1;
+static int direct = 0;
+/* frames in the file (written or buffered) */
+static uint64_t n_frames = 0;
+/* first buffered frame, always a multiple of TMIF_LOG_GROUP */
+static uint64_t buf_first = 0;
+static int buf_n = 0;
+static tmif_log_frame_t *buf;
+/* bytes of file space allocated */
+static uint64_t allocated = 0;
+static uint64_t prealloc = TMIF_LOG_PREALLOC;
+
+static struct {
+    uint64_t frames;
+    uint64_t writes;
+    uint64_t bytes;
+    int64_t write_max_ns;
+    int64_t write_sum_ns;
+    uint64_t syncs;
+    int64_t sync_max_ns;
+    int64_t sync_sum_ns;
+    uint64_t errors;
+} l_stats;
+
+
+static int64_t mono_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t frame_offset(uint64_t frame) {
+    return TMIF_LOG_ALIGN + frame*TMIF_LOG_FRAME_SIZE;
+}
+
+static uint32_t frame_crc(const tmif_log_frame_t *f) {
+    return (uint32_t)crc32(0L, (const Bytef *)f, offsetof(tmif_log_frame_t, crc));
+}
+
+/* Fill in frame frame_no of a log for one record */
+void tmif_log_frame(tmif_log_frame_t *f, int stream, const chess_word_packet_t *rec,
+                    uint64_t seq, uint64_t frame_no) {
+    f->magic = TMIF_LOG_FRAME_MAGIC;
+    f->stream = (uint8_t)stream;
+    f->version = TMIF_LOG_VERSION;
+    f->n_words = CHESS_PACKET_LEN;
+    f->frame_no = frame_no;
+    f->seq = seq;
+    f->rx_ns = rec->timestamp_ns;
+    memcpy(f->packet, rec->packet, sizeof(f->packet));
+    memset(f->pad, 0, sizeof(f->pad));
+    f->crc = frame_crc(f);
+}
+
+/* Fill in a TMIF_LOG_ALIGN byte header block for a new log */
+void tmif_log_header(uint8_t *block) {
+    tmif_log_header_t *hdr = (tmif_log_header_t *)block;
+    struct timespec ts;
+
+    memset(block, 0, TMIF_LOG_ALIGN);
+    memcpy(hdr->magic, TMIF_LOG_FILE_MAGIC, sizeof(hdr->magic));
+    hdr->version = TMIF_LOG_VERSION;
+    hdr->frame_size = TMIF_LOG_FRAME_SIZE;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr->created_ns = (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Is this a complete, intact frame? */
+int tmif_log_frame_ok(const tmif_log_frame_t *f) {
+    return (f->magic == TMIF_LOG_FRAME_MAGIC) && (f->crc == frame_crc(f));
+}
+
+/* Make sure the file has space allocated up to end bytes */
+static int reserve(uint64_t end) {
+    uint64_t want = allocated;
+
+    if (end <= allocated) {
+        return 0;
+    }
+    while (want < end) {
+        want += prealloc;
+    }
+    if (fallocate(fd, 0, 0, (off_t)want) < 0) {
+        if ((errno != EOPNOTSUPP) || (ftruncate(fd, (off_t)want) < 0)) {
+            perror("fallocate() archive log");
+            return -1;
+        }
+    }
+    allocated = want;
+    return 0;
+}
+
+/* Read one frame slot (for finding the end of an existing log) */
+static int read_frame(uint64_t frame, tmif_log_frame_t *f) {
+    /* O_DIRECT reads have to be aligned, so read the aligned span */
+    static uint8_t *span;
+    uint64_t off = frame_offset(frame);
+    uint64_t start = off & ~((uint64_t)TMIF_LOG_ALIGN - 1);
+    size_t len = ((off + TMIF_LOG_FRAME_SIZE - start) + TMIF_LOG_ALIGN - 1) &
+        ~((size_t)TMIF_LOG_ALIGN - 1);
+
+    if (!span && (posix_memalign((void **)&span, TMIF_LOG_ALIGN, 2*TMIF_LOG_ALIGN) != 0)) {
+        return -1;
+    }
+    if (pread(fd, span, len, (off_t)start) != (ssize_t)len) {
+        return -1;
+    }
+    memcpy(f, span + (off - start), TMIF_LOG_FRAME_SIZE);
+    return 0;
+}
+
+/* Frames already in the log: binary search for the first slot that
+   never got written (frames are only ever appended) */
+static uint64_t find_end(uint64_t slots) {
+    tmif_log_frame_t f;
+    uint64_t lo = 0;
+    uint64_t hi = slots;
+    uint64_t mid = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if ((read_frame(mid, &f) == 0) && (f.magic == TMIF_LOG_FRAME_MAGIC)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Write out the buffer, padded to whole groups. Keeps the last partial
+   group buffered. */
+static int write_buf(void) {
+    int groups = (buf_n + TMIF_LOG_GROUP - 1)/TMIF_LOG_GROUP;
+    size_t len = (size_t)groups*TMIF_LOG_GROUP*TMIF_LOG_FRAME_SIZE;
+    uint64_t off = frame_offset(buf_first);
+    int64_t t0 = 0;
+    int64_t dt = 0;
+    int keep = buf_n % TMIF_LOG_GROUP;
+    ssize_t ret = 0;
+
+    if (buf_n == 0) {
+        return 0;
+    }
+    if (reserve(off + len) < 0) {
+        l_stats.errors++;
+        return -1;
+    }
+
+    memset(&buf[buf_n], 0, (size_t)(groups*TMIF_LOG_GROUP - buf_n)*TMIF_LOG_FRAME_SIZE);
+    t0 = mono_ns();
+    ret = pwrite(fd, buf, len, (off_t)off);
+    dt = mono_ns() - t0;
+    if (ret != (ssize_t)len) {
+        perror("pwrite() archive log");
+        l_stats.errors++;
+        return -1;
+    }
+    l_stats.writes++;
+    l_stats.bytes += len;
+    l_stats.write_sum_ns += dt;
+    if (dt > l_stats.write_max_ns) {
+        l_stats.write_max_ns = dt;
+    }
+
+    if (keep) {
+        memmove(buf, &buf[buf_n - keep], (size_t)keep*TMIF_LOG_FRAME_SIZE);
+    }
+    buf_first += buf_n - keep;
+    buf_n = keep;
+
+    return 0;
+}
+
+/* Open the log at path, creating it or carrying on after the last
+   frame already in it. prealloc_bytes (0 for TMIF_LOG_PREALLOC) is how
+   much file space to allocate at a time. */
+int tmif_log_open(const char *path, uint64_t prealloc_bytes) {
+    static uint8_t *hdr_block;
+    tmif_log_header_t *hdr;
+    struct stat sb;
+    uint64_t slots = 0;
+    int created = 0;
+
+    if (sizeof(tmif_log_frame_t) != TMIF_LOG_FRAME_SIZE) {
+        printf("archive log frame is %zu bytes, not %d\n",
+               sizeof(tmif_log_frame_t), TMIF_LOG_FRAME_SIZE);
+        return -1;
+    }
+    if (prealloc_bytes) {
+        prealloc = (prealloc_bytes + TMIF_LOG_ALIGN - 1) & ~((uint64_t)TMIF_LOG_ALIGN - 1);
+    }
+    memset(&l_stats, 0, sizeof(l_stats));
+
+    if ((posix_memalign((void **)&buf, TMIF_LOG_ALIGN,
+                        (size_t)TMIF_LOG_BLOCK_FRAMES*TMIF_LOG_FRAME_SIZE) != 0) ||
+        (!hdr_block && (posix_memalign((void **)&hdr_block, TMIF_LOG_ALIGN, TMIF_LOG_ALIGN) != 0))) {
+        printf("Failed to allocate archive log buffer\n");
+        return -1;
+    }
+
+    /* Not every filesystem takes O_DIRECT, big aligned writes through
+       the page cache are the next best thing */
+    direct = 1;
+    fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0644);
+    if ((fd < 0) && (errno == EINVAL)) {
+        direct = 0;
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+    }
+    if ((fd < 0) || (fstat(fd, &sb) < 0)) {
+        perror("open() archive log");
+        return -1;
+    }
+    allocated = (uint64_t)sb.st_size;
+
+    hdr = (tmif_log_header_t *)hdr_block;
+    if ((sb.st_size >= TMIF_LOG_ALIGN) &&
+        (pread(fd, hdr_block, TMIF_LOG_ALIGN, 0) == TMIF_LOG_ALIGN) &&
+        (memcmp(hdr->magic, TMIF_LOG_FILE_MAGIC, sizeof(hdr->magic)) == 0)) {
+        if ((hdr->version != TMIF_LOG_VERSION) || (hdr->frame_size != TMIF_LOG_FRAME_SIZE)) {
+            printf("archive log %s is version %u with %u byte frames, move it aside\n",
+                   path, hdr->version, hdr->frame_size);
+            close(fd);
+            fd = -1;
+            return -1;
+        }
+        slots = (allocated - TMIF_LOG_ALIGN)/TMIF_LOG_FRAME_SIZE;
+        n_frames = find_end(slots);
+    } else if (sb.st_size == 0) {
+        tmif_log_header(hdr_block);
+        if ((reserve(TMIF_LOG_ALIGN + prealloc) < 0) ||
+            (pwrite(fd, hdr_block, TMIF_LOG_ALIGN, 0) != TMIF_LOG_ALIGN) ||
+            (fdatasync(fd) < 0)) {
+            perror("create archive log");
+            close(fd);
+            fd = -1;
+            return -1;
+        }
+        n_frames = 0;
+        created = 1;
+    } else {
+        printf("%s is not an archive log, move it aside\n", path);
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    /* Pick the last partial group back up so it gets rewritten whole */
+    buf_first = n_frames - (n_frames % TMIF_LOG_GROUP);
+    buf_n = 0;
+    while ((buf_first + buf_n) < n_frames) {
+        if (read_frame(buf_first + buf_n, &buf[buf_n]) < 0) {
+            perror("read archive log");
+            close(fd);
+            fd = -1;
+            return -1;
+        }
+        buf_n++;
+    }
+
+    printf("archive log %s: %s, %llu frames already in it%s\n", path,
+           created ? "created" : "opened", (unsigned long long)n_frames,
+           direct ? ", O_DIRECT" : "");
+
+    return 0;
+}
+
+/* Frame one record onto the end of the log */
+int tmif_log_append(int stream, const chess_word_packet_t *rec, uint64_t seq) {
+    tmif_log_frame_t *f;
+
+    if (fd < 0) {
+        return -1;
+    }
+    if ((buf_n == TMIF_LOG_BLOCK_FRAMES) && (write_buf() < 0)) {
+        return -1;
+    }
+
+    f = &buf[buf_n];
+    tmif_log_frame(f, stream, rec, seq, n_frames);
+
+    buf_n++;
+    n_frames++;
+    l_stats.frames++;
+
+    return 0;
+}
+
+/* Everything appended so far onto the disk */
+int tmif_log_sync(void) {
+    int64_t t0 = 0;
+    int64_t dt = 0;
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (write_buf() < 0) {
+        return -1;
+    }
+
+    t0 = mono_ns();
+    if (fdatasync(fd) < 0) {
+        perror("fdatasync() archive log");
+        l_stats.errors++;
+        return -1;
+    }
+    dt = mono_ns() - t0;
+    l_stats.syncs++;
+    l_stats.sync_sum_ns += dt;
+    if (dt > l_stats.sync_max_ns) {
+        l_stats.sync_max_ns = dt;
+    }
+
+    return 0;
+}
+
+int tmif_log_close(void) {
+    int error = 0;
+
+    if (fd < 0) {
+        return 0;
+    }
+    if (tmif_log_sync() < 0) {
+        error++;
+    }
+    if (close(fd) < 0) {
+        error++;
+    }
+    fd = -1;
+    free(buf);
+    buf = NULL;
+
+    return error;
+}
+
+void tmif_log_print_stats(void) {
+    printf("archive log: %llu frames in %llu writes (%.1f MB), errors %llu\n",
+           (unsigned long long)l_stats.frames, (unsigned long long)l_stats.writes,
+           l_stats.bytes/1e6, (unsigned long long)l_stats.errors);
+    printf("archive log: write mean %.1f us max %.1f us, sync mean %.1f us max %.1f us (%llu)\n",
+           l_stats.writes ? l_stats.write_sum_ns*1e-3/l_stats.writes : 0.0,
+           l_stats.write_max_ns*1e-3,
+           l_stats.syncs ? l_stats.sync_sum_ns*1e-3/l_stats.syncs : 0.0,
+           l_stats.sync_max_ns*1e-3, (unsigned long long)l_stats.syncs);
+}
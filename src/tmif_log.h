@@ -0,0 +1,73 @@
+#ifndef TMIF_LOG_H_
+#define TMIF_LOG_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Raw append log archive backend. Packets are framed into fixed size,
+   checksummed records and appended to a preallocated file with large
+   aligned (O_DIRECT where the filesystem allows it) writes. Nothing in
+   the file is ever rewritten except the partly filled tail block, so a
+   power cut can at worst lose what was not yet synced. log2h5 turns a
+   log back into the usual CHESS_PACKETS tables.
+
+   File layout: one TMIF_LOG_ALIGN byte header block, then frames
+   back to back. Unwritten (preallocated) space reads as zeros, the
+   first frame without the magic number marks the end of the log.
+*/
+
+#include <stdint.h>
+
+#include "tmif_hdf5.h"
+
+#define LOG_FILE_NAME "/home/clu/flight_data/chess_flight_data.log"
+
+#define TMIF_LOG_FILE_MAGIC "TMIFLOG1"
+#define TMIF_LOG_FRAME_MAGIC 0x43484553
+#define TMIF_LOG_VERSION 1
+/* Write alignment and header size */
+#define TMIF_LOG_ALIGN 4096
+/* Frame size, TMIF_LOG_GROUP frames make a whole number of aligned
+   blocks */
+#define TMIF_LOG_FRAME_SIZE 1536
+#define TMIF_LOG_GROUP 8
+/* Frames buffered per write, a multiple of TMIF_LOG_GROUP */
+#define TMIF_LOG_BLOCK_FRAMES 256
+/* File space is allocated this much at a time */
+#define TMIF_LOG_PREALLOC (256ULL*1024*1024)
+
+/* One archived packet on disk. crc is the zlib crc32 of everything
+   before it. */
+typedef struct {
+    uint32_t magic;
+    uint8_t stream;
+    uint8_t version;
+    uint16_t n_words;
+    /* record number in the log, from 0 */
+    uint64_t frame_no;
+    uint64_t seq;
+    int64_t rx_ns;
+    uint16_t packet[CHESS_PACKET_LEN];
+    uint8_t pad[TMIF_LOG_FRAME_SIZE - 32 - 2*CHESS_PACKET_LEN - 4];
+    uint32_t crc;
+} tmif_log_frame_t;
+
+/* Header block, the rest of the block is zero */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t frame_size;
+    int64_t created_ns;
+} tmif_log_header_t;
+
+
+int tmif_log_open(const char *, uint64_t);
+int tmif_log_append(int, const chess_word_packet_t *, uint64_t);
+int tmif_log_sync(void);
+int tmif_log_close(void);
+void tmif_log_print_stats(void);
+int tmif_log_frame_ok(const tmif_log_frame_t *);
+void tmif_log_frame(tmif_log_frame_t *, int, const chess_word_packet_t *, uint64_t, uint64_t);
+void tmif_log_header(uint8_t *);
+
+#endif /* TMIF_LOG_H_ */
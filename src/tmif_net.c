@@ -0,0 +1,629 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   UDP ingest for tmif. Pulls CU40MMXS datagrams off the socket in
+   batches (recvmmsg) into preallocated slots so the hot loop does
+   not pay a syscall per packet. Every packet carries the kernel's
+   receive timestamp (SO_TIMESTAMPNS, or the ring frame header).
+*/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <netinet/ip.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "tmif_net.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* Receive buffer size requested from the kernel */
+#define TMIF_RX_SO_RCVBUF (8388608*2)
+
+
+static int hist_bin(int n) {
+    int bin = 0;
+
+    while ((n >>= 1) && (bin < (TMIF_RX_HIST_BINS - 1))) {
+        bin++;
+    }
+    return bin;
+}
+
+/* Create the non-blocking CU40MMXS UDP socket bound to addr:port.
+   SO_REUSEPORT lets a second tmif (or a redundant feed) share it,
+   SO_TIMESTAMPNS has the kernel stamp every datagram on arrival. */
+int tmif_rx_socket(uint32_t addr, uint16_t port) {
+    int sock_fd;
+    int sock_opts = 0;
+    int opt_status = 0;
+    int sock_so_rcvbuf = 0;
+    socklen_t optlen = sizeof(sock_so_rcvbuf);
+    struct sockaddr_in sin;
+    int one = 1;
+
+    /* Create socket */
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0) {
+        printf("Error creating socket...\n");
+        return -1;
+    }
+
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+    }
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0) {
+        perror("setsockopt(SO_TIMESTAMPNS)");
+    }
+
+    /* Bind to the CU40MMXS port */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = addr;
+    sin.sin_port = htons(port);
+
+    if (bind(sock_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        printf("Failed to bind\n");
+        perror("bind()");
+    }
+
+    opt_status = getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &sock_so_rcvbuf, &optlen);
+    if (opt_status < 0) {
+        printf("getsockopt() error\n");
+        perror("getsockopt()");
+    }
+    printf("so_rcvbuf: %i\n", sock_so_rcvbuf);
+
+    sock_so_rcvbuf = TMIF_RX_SO_RCVBUF;
+    opt_status = setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &sock_so_rcvbuf, optlen);
+    if (opt_status < 0) {
+        printf("setsockopt() error\n");
+        perror("setsockopt()");
+    }
+
+    opt_status = getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &sock_so_rcvbuf, &optlen);
+    if (opt_status < 0) {
+        printf("getsockopt() error\n");
+        perror("getsockopt()");
+    }
+    printf("so_rcvbuf: %i\n", sock_so_rcvbuf);
+
+    /* Set non-blocking socket */
+    sock_opts = fcntl(sock_fd, F_GETFL);
+    sock_opts = fcntl(sock_fd, F_SETFL, (sock_opts | O_NONBLOCK));
+    if (sock_opts == -1) {
+        printf("Failed to set socket as non-blocking\n");
+    }
+
+    return sock_fd;
+}
+
+/* Kernel receive time (ns since the epoch) from a message's control
+   data, 0 if there is none */
+int64_t tmif_rx_cmsg_ns(struct msghdr *hdr) {
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+/* Userspace stand-in when the kernel did not stamp a datagram */
+int64_t tmif_rx_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Receive time for one datagram. At most one clock read per call for
+   datagrams that came without a kernel timestamp (fallback holds it). */
+static int64_t datagram_ns(tmif_rx_t *rx, struct msghdr *hdr, int64_t *fallback) {
+    int64_t ns = tmif_rx_cmsg_ns(hdr);
+
+    if (ns == 0) {
+        if (*fallback == 0) {
+            *fallback = tmif_rx_now_ns();
+        }
+        ns = *fallback;
+        rx->no_tstamp++;
+    }
+    return ns;
+}
+
+/* Open the ingest socket on addr:port and allocate receive slots.
+   batch is the number of datagrams per recvmmsg() call, gro enables
+   UDP_GRO. */
+int tmif_rx_open(tmif_rx_t *rx, tmif_rx_mode_t mode, uint32_t addr, uint16_t port,
+                 int batch, int gro) {
+    int i = 0;
+    int one = 1;
+
+    memset(rx, 0, sizeof(tmif_rx_t));
+    rx->fd = -1;
+    rx->udp_fd = -1;
+
+    if (batch < 1) {
+        batch = 1;
+    } else if (batch > TMIF_RX_BATCH_MAX) {
+        batch = TMIF_RX_BATCH_MAX;
+    }
+    if (mode == TMIF_RX_RECVFROM) {
+        batch = 1;
+        gro = 0;
+    }
+    rx->mode = mode;
+    rx->batch = batch;
+
+    rx->fd = tmif_rx_socket(addr, port);
+    if (rx->fd < 0) {
+        return -1;
+    }
+
+    if (gro) {
+        if (setsockopt(rx->fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+            printf("UDP_GRO not supported, continuing without it\n");
+            gro = 0;
+        }
+    }
+    rx->gro = gro;
+
+    rx->slot_size = gro ? TMIF_RX_GRO_SLOT_SIZE : CU40MMXS_PACKET_SIZE;
+    rx->max_pkts = gro ? (batch * TMIF_RX_GRO_SEGS) : batch;
+    /* room for the GRO segment size and the receive timestamp */
+    rx->cmsg_size = CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec));
+
+    rx->slots = calloc(batch, rx->slot_size);
+    rx->msgs = calloc(batch, sizeof(struct mmsghdr));
+    rx->iovs = calloc(batch, sizeof(struct iovec));
+    rx->cmsgs = calloc(batch, rx->cmsg_size);
+    rx->pkts = calloc(rx->max_pkts, sizeof(tmif_pkt_t));
+    if (!rx->slots || !rx->msgs || !rx->iovs || !rx->cmsgs || !rx->pkts) {
+        printf("Failed to allocate receive slots\n");
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    /* Slots never move, so the message headers are set up once. */
+    for (i = 0; i < batch; i++) {
+        rx->iovs[i].iov_base = rx->slots + i*rx->slot_size;
+        rx->iovs[i].iov_len = rx->slot_size;
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    printf("rx: %s, batch %d, gro %s\n",
+           (mode == TMIF_RX_MMSG) ? "recvmmsg" : "recvfrom",
+           batch, gro ? "on" : "off");
+    rx->addr = addr;
+    rx->port = port;
+
+    return 0;
+}
+
+/* Split one received datagram (possibly GRO coalesced) into packets,
+   all stamped rx_ns. Returns the number of packets added at pkts. */
+static int split_datagram(tmif_rx_t *rx, uint8_t *buf, int len,
+                          struct msghdr *hdr, int64_t rx_ns, tmif_pkt_t *pkts) {
+    struct cmsghdr *cmsg;
+    int seg = len;
+    int n = 0;
+    int off = 0;
+
+    if (rx->gro && hdr) {
+        for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+                memcpy(&seg, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+    }
+
+    while (off < len) {
+        if ((len - off) < seg) {
+            seg = len - off;
+        }
+        if (seg == CU40MMXS_PACKET_SIZE) {
+            pkts[n].data = (uint16_t *)(buf + off);
+            pkts[n].len = seg;
+            pkts[n].rx_ns = rx_ns;
+            n++;
+        } else {
+            rx->runts++;
+        }
+        off += seg;
+    }
+
+    return n;
+}
+
+/* Attach a classic BPF program to a socket */
+static int attach_filter(int fd, struct sock_filter *code, unsigned short len) {
+    struct sock_fprog prog;
+
+    prog.len = len;
+    prog.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt(SO_ATTACH_FILTER)");
+        return -1;
+    }
+    return 0;
+}
+
+/* Open an AF_PACKET TPACKET_V3 ring on ifname that only sees IPv4 UDP
+   datagrams to addr:port. Packets are parsed in place out of the ring. */
+int tmif_rx_open_ring(tmif_rx_t *rx, const char *ifname, uint32_t addr, uint16_t port) {
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    int version = TPACKET_V3;
+    int one = 1;
+    unsigned int ifindex = 0;
+
+    /* Cooked (SOCK_DGRAM) packets start at the IP header, so does the
+       filter: ip proto udp, not a fragment, ip dst == addr (skipped
+       for INADDR_ANY), udp dst port == port */
+    struct sock_filter udp_port_filter[] = {
+        { BPF_LD  | BPF_B | BPF_ABS,  0, 0, 9 },
+        { BPF_JMP | BPF_JEQ | BPF_K,  0, 8, IPPROTO_UDP },
+        { BPF_LD  | BPF_H | BPF_ABS,  0, 0, 6 },
+        { BPF_JMP | BPF_JSET | BPF_K, 6, 0, 0x1fff },
+        { BPF_LD  | BPF_W | BPF_ABS,  0, 0, 16 },
+        { BPF_JMP | BPF_JEQ | BPF_K,  0, (addr == INADDR_ANY) ? 0 : 4, ntohl(addr) },
+        { BPF_LDX | BPF_B | BPF_MSH,  0, 0, 0 },
+        { BPF_LD  | BPF_H | BPF_IND,  0, 0, 2 },
+        { BPF_JMP | BPF_JEQ | BPF_K,  0, 1, port },
+        { BPF_RET | BPF_K,            0, 0, 0x40000 },
+        { BPF_RET | BPF_K,            0, 0, 0 },
+    };
+    /* The UDP sink drops everything, it only exists so the kernel
+       does not answer the detector with ICMP port unreachable */
+    struct sock_filter drop_all[] = {
+        { BPF_RET | BPF_K, 0, 0, 0 },
+    };
+
+    memset(rx, 0, sizeof(tmif_rx_t));
+    rx->fd = -1;
+    rx->udp_fd = -1;
+    rx->mode = TMIF_RX_RING;
+
+    ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+        printf("No such interface: %s\n", ifname);
+        return -1;
+    }
+
+    rx->udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (rx->udp_fd >= 0) {
+        struct sockaddr_in sin;
+
+        attach_filter(rx->udp_fd, drop_all, 1);
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = addr;
+        sin.sin_port = htons(port);
+        if (bind(rx->udp_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            perror("bind() UDP sink");
+        }
+    }
+
+    rx->fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+    if (rx->fd < 0) {
+        perror("socket(AF_PACKET)");
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    if (attach_filter(rx->fd, udp_port_filter,
+                      sizeof(udp_port_filter)/sizeof(udp_port_filter[0])) < 0) {
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    if (setsockopt(rx->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("setsockopt(PACKET_VERSION)");
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    /* Loopback shows every packet twice, skip our own transmit copy */
+    if (setsockopt(rx->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) < 0) {
+        printf("PACKET_IGNORE_OUTGOING not supported, filtering in userspace\n");
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = TMIF_RING_BLOCK_SIZE;
+    req.tp_block_nr = TMIF_RING_BLOCK_NR;
+    req.tp_frame_size = TMIF_RING_FRAME_SIZE;
+    req.tp_frame_nr = (TMIF_RING_BLOCK_SIZE/TMIF_RING_FRAME_SIZE)*TMIF_RING_BLOCK_NR;
+    req.tp_retire_blk_tov = TMIF_RING_RETIRE_MS;
+    if (setsockopt(rx->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        perror("setsockopt(PACKET_RX_RING)");
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    rx->ring_size = (size_t)req.tp_block_size*req.tp_block_nr;
+    rx->ring = mmap(NULL, rx->ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_LOCKED | MAP_POPULATE, rx->fd, 0);
+    if (rx->ring == MAP_FAILED) {
+        /* MAP_LOCKED needs CAP_IPC_LOCK/rlimit, try without */
+        rx->ring = mmap(NULL, rx->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, rx->fd, 0);
+    }
+    if (rx->ring == MAP_FAILED) {
+        perror("mmap() packet ring");
+        rx->ring = NULL;
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = ifindex;
+    if (bind(rx->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        perror("bind() packet ring");
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    /* Worst case every frame in a block is a CU40MMXS packet */
+    rx->max_pkts = TMIF_RING_BLOCK_SIZE/CU40MMXS_PACKET_SIZE + 1;
+    rx->pkts = calloc(rx->max_pkts, sizeof(tmif_pkt_t));
+    if (!rx->pkts) {
+        printf("Failed to allocate packet list\n");
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    rx->block = 0;
+    rx->block_held = 0;
+
+    printf("rx: TPACKET_V3 ring on %s, %d x %d byte blocks, port %u\n",
+           ifname, TMIF_RING_BLOCK_NR, TMIF_RING_BLOCK_SIZE, port);
+    rx->addr = addr;
+    rx->port = port;
+
+    return 0;
+}
+
+/* Hand the previously returned block back to the kernel */
+static void ring_release(tmif_rx_t *rx) {
+    struct tpacket_block_desc *bd;
+
+    if (rx->block_held) {
+        bd = (struct tpacket_block_desc *)(rx->ring + (size_t)rx->block*TMIF_RING_BLOCK_SIZE);
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        rx->block = (rx->block + 1) % TMIF_RING_BLOCK_NR;
+        rx->block_held = 0;
+    }
+}
+
+/* Walk the next retired ring block. The block stays ours (and the
+   packet pointers valid) until the next call. */
+static int ring_recv(tmif_rx_t *rx) {
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *hdr;
+    struct sockaddr_ll *sll;
+    struct iphdr *ip;
+    struct udphdr *udp;
+    uint8_t *payload;
+    uint32_t num_pkts = 0;
+    uint32_t j = 0;
+    int len = 0;
+    int n = 0;
+
+    ring_release(rx);
+
+    bd = (struct tpacket_block_desc *)(rx->ring + (size_t)rx->block*TMIF_RING_BLOCK_SIZE);
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+        rx->empty_calls++;
+        return 0;
+    }
+    rx->block_held = 1;
+
+    num_pkts = bd->hdr.bh1.num_pkts;
+    hdr = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+    for (j = 0; j < num_pkts; j++) {
+        sll = (struct sockaddr_ll *)((uint8_t *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        ip = (struct iphdr *)((uint8_t *)hdr + hdr->tp_net);
+
+        if ((sll->sll_pkttype != PACKET_OUTGOING) &&
+            (hdr->tp_snaplen >= (ip->ihl*4 + sizeof(struct udphdr)))) {
+            udp = (struct udphdr *)((uint8_t *)ip + ip->ihl*4);
+            payload = (uint8_t *)udp + sizeof(struct udphdr);
+            len = ntohs(udp->len) - (int)sizeof(struct udphdr);
+
+            if ((len == CU40MMXS_PACKET_SIZE) &&
+                (hdr->tp_snaplen >= (ip->ihl*4 + sizeof(struct udphdr) + len)) &&
+                (n < rx->max_pkts)) {
+                rx->pkts[n].data = (uint16_t *)payload;
+                rx->pkts[n].len = len;
+                rx->pkts[n].rx_ns = (int64_t)hdr->tp_sec*1000000000LL + hdr->tp_nsec;
+                n++;
+            } else {
+                rx->runts++;
+            }
+            rx->datagrams++;
+        }
+
+        hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+    }
+
+    rx->calls++;
+    rx->packets += n;
+    rx->hist[hist_bin(n > 0 ? n : 1)]++;
+
+    return n;
+}
+
+/* Drain up to one batch of datagrams. Returns the number of packets
+   in rx->pkts, 0 if the socket was empty, or -1 on error. */
+int tmif_rx_recv(tmif_rx_t *rx) {
+    struct msghdr *hdr;
+    int64_t fallback_ns = 0;
+    int nbytes = 0;
+    int nmsgs = 0;
+    int n = 0;
+    int i = 0;
+
+    if (rx->mode == TMIF_RX_RING) {
+        return ring_recv(rx);
+    }
+    if (rx->mode == TMIF_RX_URING) {
+        n = tmif_uring_recv(rx);
+        if (n <= 0) {
+            rx->empty_calls++;
+            return n;
+        }
+        rx->calls++;
+        rx->packets += n;
+        rx->hist[hist_bin(n)]++;
+        return n;
+    }
+
+    for (i = 0; i < rx->batch; i++) {
+        rx->msgs[i].msg_hdr.msg_control = rx->cmsgs + i*rx->cmsg_size;
+        rx->msgs[i].msg_hdr.msg_controllen = rx->cmsg_size;
+        rx->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    /* One datagram per call, recvmsg() rather than recvfrom() so the
+       timestamp comes along */
+    if (rx->mode == TMIF_RX_RECVFROM) {
+        hdr = &rx->msgs[0].msg_hdr;
+        hdr->msg_name = &rx->from_addr;
+        hdr->msg_namelen = sizeof(rx->from_addr);
+        nbytes = recvmsg(rx->fd, hdr, 0);
+        if (nbytes < 0) {
+            rx->empty_calls++;
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+        }
+        rx->calls++;
+        rx->datagrams++;
+        rx->hist[0]++;
+        n = split_datagram(rx, rx->slots, nbytes, hdr,
+                           datagram_ns(rx, hdr, &fallback_ns), rx->pkts);
+        rx->packets += n;
+        return n;
+    }
+
+    nmsgs = recvmmsg(rx->fd, rx->msgs, rx->batch, MSG_DONTWAIT, NULL);
+    if (nmsgs <= 0) {
+        rx->empty_calls++;
+        if ((nmsgs < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    rx->calls++;
+    rx->datagrams += nmsgs;
+    rx->hist[hist_bin(nmsgs)]++;
+
+    for (i = 0; i < nmsgs; i++) {
+        hdr = &rx->msgs[i].msg_hdr;
+        n += split_datagram(rx, rx->slots + i*rx->slot_size, rx->msgs[i].msg_len,
+                            hdr, datagram_ns(rx, hdr, &fallback_ns), rx->pkts + n);
+    }
+    rx->packets += n;
+
+    return n;
+}
+
+void tmif_rx_print_stats(tmif_rx_t *rx) {
+    struct tpacket_stats_v3 tp_stats;
+    socklen_t optlen = sizeof(tp_stats);
+    int i = 0;
+
+    if ((rx->mode == TMIF_RX_RING) && (rx->fd >= 0)) {
+        if (getsockopt(rx->fd, SOL_PACKET, PACKET_STATISTICS, &tp_stats, &optlen) == 0) {
+            printf("ring packets: %u, drops: %u, queue freezes: %u\n",
+                   tp_stats.tp_packets, tp_stats.tp_drops, tp_stats.tp_freeze_q_cnt);
+        }
+    }
+    if (rx->mode == TMIF_RX_URING) {
+        tmif_uring_print_stats(rx);
+    }
+
+    printf("rx calls: %llu (empty: %llu)\n",
+           (unsigned long long)rx->calls, (unsigned long long)rx->empty_calls);
+    printf("rx datagrams: %llu, packets: %llu, runts: %llu\n",
+           (unsigned long long)rx->datagrams, (unsigned long long)rx->packets,
+           (unsigned long long)rx->runts);
+    if (rx->no_tstamp) {
+        printf("rx datagrams without kernel timestamp: %llu\n",
+               (unsigned long long)rx->no_tstamp);
+    }
+    if (rx->calls) {
+        printf("rx packets per call: %.2f\n", (double)rx->packets/(double)rx->calls);
+    }
+    printf("rx batch size histogram:\n");
+    for (i = 0; i < TMIF_RX_HIST_BINS; i++) {
+        if (i < (TMIF_RX_HIST_BINS - 1)) {
+            printf("  %3d-%-3d: %llu\n", 1 << i, (2 << i) - 1,
+                   (unsigned long long)rx->hist[i]);
+        } else {
+            printf("  %3d+   : %llu\n", 1 << i, (unsigned long long)rx->hist[i]);
+        }
+    }
+}
+
+int tmif_rx_close(tmif_rx_t *rx) {
+    int status = 0;
+
+    if (rx->uring) {
+        tmif_uring_close(rx);
+    }
+    if (rx->ring) {
+        munmap(rx->ring, rx->ring_size);
+        rx->ring = NULL;
+    }
+    if (rx->udp_fd >= 0) {
+        close(rx->udp_fd);
+        rx->udp_fd = -1;
+    }
+
+    if (rx->fd >= 0) {
+        status = close(rx->fd);
+        if (status < 0) {
+            printf("error closing socket: %d\n", status);
+        }
+    }
+    rx->fd = -1;
+
+    free(rx->slots);
+    free(rx->msgs);
+    free(rx->iovs);
+    free(rx->cmsgs);
+    free(rx->pkts);
+    rx->slots = NULL;
+    rx->msgs = NULL;
+    rx->iovs = NULL;
+    rx->cmsgs = NULL;
+    rx->pkts = NULL;
+
+    return status;
+}
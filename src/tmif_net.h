@@ -0,0 +1,125 @@
+#ifndef TMIF_NET_H_
+#define TMIF_NET_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   tmif UDP ingest for the CU40MMXS packet stream
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define CU40MMXS_PORT 60000
+#define CU40MMXS_PACKET_SIZE 1470
+
+/* Most datagrams pulled per recvmmsg() call */
+#define TMIF_RX_BATCH_MAX 64
+/* Default datagrams per recvmmsg() call */
+#define TMIF_RX_BATCH_DEFAULT 32
+/* Slot size when UDP_GRO may hand us a coalesced super-datagram */
+#define TMIF_RX_GRO_SLOT_SIZE 65535
+/* Most CU40MMXS packets that fit in one GRO slot */
+#define TMIF_RX_GRO_SEGS (TMIF_RX_GRO_SLOT_SIZE / CU40MMXS_PACKET_SIZE)
+/* Batch size histogram bins: 1, 2-3, 4-7, ... 64+ */
+#define TMIF_RX_HIST_BINS 7
+
+/* TPACKET_V3 ring geometry: 256 x 256 kB blocks, handed to us when full
+   or after the retire timeout, whichever comes first. */
+#define TMIF_RING_BLOCK_SIZE (1 << 18)
+#define TMIF_RING_BLOCK_NR 256
+#define TMIF_RING_FRAME_SIZE 2048
+#define TMIF_RING_RETIRE_MS 2
+
+/* io_uring provided buffers: 32768 x 1470 bytes is ~3 s of packets
+   at 10k packets/s (must be a power of two, at most 32768) */
+#define TMIF_URING_NBUFS 32768
+/* Most completions handed back per tmif_rx_recv() */
+#define TMIF_URING_BATCH 256
+/* Completion queue size, multishot recv posts one CQE per datagram */
+#define TMIF_URING_CQ_ENTRIES 4096
+
+typedef enum {
+    TMIF_RX_RECVFROM = 0,
+    TMIF_RX_MMSG,
+    TMIF_RX_RING,
+    TMIF_RX_URING
+} tmif_rx_mode_t;
+
+/* Local addresses below are IPv4 in network byte order, INADDR_ANY
+   for all interfaces. */
+
+/* One received CU40MMXS packet. data points into a receive slot (or
+   straight into the mmap ring) and is only valid until the next
+   tmif_rx_recv() call. rx_ns is the kernel receive timestamp in ns
+   since the epoch (CLOCK_REALTIME). */
+typedef struct {
+    uint16_t *data;
+    int len;
+    int64_t rx_ns;
+} tmif_pkt_t;
+
+typedef struct {
+    int fd;
+    tmif_rx_mode_t mode;
+    /* local address and port this source listens on */
+    uint32_t addr;
+    uint16_t port;
+    /* datagrams per recvmmsg() */
+    int batch;
+    int gro;
+
+    /* preallocated receive slots */
+    uint8_t *slots;
+    size_t slot_size;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *cmsgs;
+    size_t cmsg_size;
+    struct sockaddr_storage from_addr;
+
+    /* UDP socket when fd is a packet ring or io_uring */
+    int udp_fd;
+
+    /* TPACKET_V3 ring */
+    uint8_t *ring;
+    size_t ring_size;
+    unsigned int block;
+    int block_held;
+
+    /* io_uring state, see tmif_uring.c */
+    struct tmif_uring *uring;
+
+    /* packets handed back by the last tmif_rx_recv() */
+    tmif_pkt_t *pkts;
+    int max_pkts;
+
+    /* stats */
+    uint64_t calls;
+    uint64_t empty_calls;
+    uint64_t datagrams;
+    uint64_t packets;
+    uint64_t runts;
+    /* packets stamped in userspace because the kernel gave no time */
+    uint64_t no_tstamp;
+    uint64_t hist[TMIF_RX_HIST_BINS];
+} tmif_rx_t;
+
+
+int tmif_rx_open(tmif_rx_t *, tmif_rx_mode_t, uint32_t, uint16_t, int, int);
+int tmif_rx_open_ring(tmif_rx_t *, const char *, uint32_t, uint16_t);
+int tmif_rx_open_uring(tmif_rx_t *, uint32_t, uint16_t, int);
+int tmif_rx_socket(uint32_t, uint16_t);
+int64_t tmif_rx_cmsg_ns(struct msghdr *);
+int64_t tmif_rx_now_ns(void);
+
+/* io_uring backend hooks (tmif_uring.c) */
+int tmif_uring_recv(tmif_rx_t *);
+void tmif_uring_print_stats(tmif_rx_t *);
+void tmif_uring_close(tmif_rx_t *);
+int tmif_rx_recv(tmif_rx_t *);
+void tmif_rx_print_stats(tmif_rx_t *);
+int tmif_rx_close(tmif_rx_t *);
+
+#endif /* TMIF_NET_H_ */
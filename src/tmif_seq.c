@@ -0,0 +1,320 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   Reorder window for the CU40MMXS packet counter. Packets that arrive
+   in order go straight through without a copy. Anything ahead of the
+   next expected packet is copied into the window and held until the
+   gap fills, the window is full, or it has waited hold_ns. Whatever
+   is still missing then is declared lost. Packets behind the window
+   are dropped as duplicates or late arrivals so the archive and
+   telemetry only ever see each packet once and in order. A jump back
+   further than the history, or TMIF_SEQ_RESET_RUN packets in order
+   behind, is the counter starting over (instrument reset): the window
+   is released and a new run starts there. The new
+   run is numbered on from two counter wraps ahead, so the extended
+   numbers stay unique and increasing and the archive index sees a
+   jump too long to be a gap.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmif_seq.h"
+
+#define SEQ_MASK (TMIF_SEQ_WINDOW_MAX - 1)
+
+
+static int gap_bin(uint64_t n) {
+    int bin = 0;
+
+    while ((n >>= 1) && (bin < (TMIF_SEQ_GAP_BINS - 1))) {
+        bin++;
+    }
+    return bin;
+}
+
+static void seen_set(tmif_seq_t *s, uint64_t seq, int received) {
+    uint64_t bit = 1ULL << (seq & 63);
+    uint64_t *word = &s->seen[(seq & (TMIF_SEQ_HISTORY - 1)) >> 6];
+
+    if (received) {
+        *word |= bit;
+    } else {
+        *word &= ~bit;
+    }
+}
+
+static int seen_get(tmif_seq_t *s, uint64_t seq) {
+    return (s->seen[(seq & (TMIF_SEQ_HISTORY - 1)) >> 6] >> (seq & 63)) & 1;
+}
+
+/* Hand one packet on, closing off any gap in front of it */
+static void deliver(tmif_seq_t *s, tmif_pkt_t *pkt, uint64_t seq) {
+    if (s->gap_run) {
+        s->gaps++;
+        s->lost += s->gap_run;
+        s->gap_hist[gap_bin(s->gap_run)]++;
+        s->gap_run = 0;
+    }
+    seen_set(s, seq, 1);
+    s->released++;
+    s->release(s->ctx, pkt, seq);
+}
+
+static void bump_next(tmif_seq_t *s, uint64_t to) {
+    s->wraps += (to >> 16) - (s->next >> 16);
+    s->next = to;
+}
+
+/* Release the held packet at next, or count it missing, and move on */
+static void step(tmif_seq_t *s) {
+    int idx = s->next & SEQ_MASK;
+    tmif_pkt_t pkt;
+
+    if (s->slot_full[idx] && (s->slot_seq[idx] == s->next)) {
+        pkt.data = (uint16_t *)(s->slots + (size_t)idx*CU40MMXS_PACKET_SIZE);
+        pkt.len = CU40MMXS_PACKET_SIZE;
+        pkt.rx_ns = s->slot_ns[idx];
+        s->slot_full[idx] = 0;
+        s->n_held--;
+        deliver(s, &pkt, s->next);
+    } else {
+        seen_set(s, s->next, 0);
+        s->gap_run++;
+    }
+    bump_next(s, s->next + 1);
+}
+
+/* Give up on everything before target */
+static void advance(tmif_seq_t *s, uint64_t target) {
+    uint64_t skip = 0;
+    uint64_t seq = 0;
+
+    while (s->next < target) {
+        if (s->n_held == 0) {
+            /* Nothing to release on the way, jump straight there */
+            skip = target - s->next;
+            if (skip >= TMIF_SEQ_HISTORY) {
+                memset(s->seen, 0, sizeof(s->seen));
+            } else {
+                for (seq = s->next; seq < target; seq++) {
+                    seen_set(s, seq, 0);
+                }
+            }
+            s->gap_run += skip;
+            bump_next(s, target);
+            break;
+        }
+        step(s);
+    }
+}
+
+/* Release held packets that now follow on from next */
+static void release_ready(tmif_seq_t *s) {
+    int idx = 0;
+
+    while (s->n_held) {
+        idx = s->next & SEQ_MASK;
+        if (!s->slot_full[idx] || (s->slot_seq[idx] != s->next)) {
+            break;
+        }
+        step(s);
+    }
+}
+
+/* Counter started over at seq16, let go of what is held and pick up
+   from there */
+static void restart(tmif_seq_t *s, uint16_t seq16) {
+    tmif_seq_flush(s);
+    memset(s->seen, 0, sizeof(s->seen));
+    s->gap_run = 0;
+    s->behind_run = 0;
+    s->next = ((((s->next >> 16) + 2) << 16) | seq16);
+    s->resets++;
+}
+
+/* depth is how many packets may be held waiting on a missing one (0
+   turns reordering off), hold_us how long each may wait. release is
+   called with ctx for every packet in order. */
+int tmif_seq_init(tmif_seq_t *s, int depth, int hold_us,
+                  tmif_seq_release_t release, void *ctx) {
+    memset(s, 0, sizeof(tmif_seq_t));
+
+    if (depth < 0) {
+        depth = 0;
+    } else if (depth > TMIF_SEQ_WINDOW_MAX) {
+        depth = TMIF_SEQ_WINDOW_MAX;
+    }
+    s->depth = depth;
+    s->hold_ns = (int64_t)hold_us*1000;
+    s->release = release;
+    s->ctx = ctx;
+
+    s->slots = calloc(TMIF_SEQ_WINDOW_MAX, CU40MMXS_PACKET_SIZE);
+    if (!s->slots) {
+        printf("Failed to allocate reorder window\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Feed one received packet in. Its data is copied if it has to wait. */
+void tmif_seq_push(tmif_seq_t *s, tmif_pkt_t *pkt) {
+    uint16_t seq16 = pkt->data[1];
+    uint64_t reach = (uint64_t)s->depth;
+    int64_t ext = 0;
+    int idx = 0;
+
+    if (!s->started) {
+        s->next = seq16;
+        s->started = 1;
+    }
+
+    /* Nearest 64-bit sequence number to next with these low 16 bits */
+    ext = (int64_t)s->next + (int16_t)(seq16 - (uint16_t)s->next);
+
+    if (ext < (int64_t)s->next) {
+        if ((s->behind_run > 0) && (ext == s->behind_next)) {
+            s->behind_run++;
+        } else {
+            s->behind_run = 1;
+        }
+        s->behind_next = ext + 1;
+    } else {
+        s->behind_run = 0;
+    }
+
+    if (((ext + TMIF_SEQ_HISTORY) < (int64_t)s->next) ||
+        (s->behind_run >= TMIF_SEQ_RESET_RUN)) {
+        restart(s, seq16);
+        ext = (int64_t)s->next;
+    }
+
+    if (ext < (int64_t)s->next) {
+        if (seen_get(s, (uint64_t)ext)) {
+            s->duplicates++;
+        } else {
+            s->late++;
+        }
+        return;
+    }
+
+    /* No room in the window, whatever is missing in front is lost */
+    if ((uint64_t)ext > (s->next + reach)) {
+        advance(s, (uint64_t)ext - reach);
+    }
+
+    idx = ext & SEQ_MASK;
+    if (s->slot_full[idx] && (s->slot_seq[idx] == (uint64_t)ext)) {
+        s->duplicates++;
+        return;
+    }
+
+    if ((uint64_t)ext == s->next) {
+        deliver(s, pkt, s->next);
+        bump_next(s, s->next + 1);
+        release_ready(s);
+        return;
+    }
+
+    memcpy(s->slots + (size_t)idx*CU40MMXS_PACKET_SIZE, pkt->data, CU40MMXS_PACKET_SIZE);
+    s->slot_seq[idx] = (uint64_t)ext;
+    s->slot_ns[idx] = pkt->rx_ns;
+    s->slot_full[idx] = 1;
+    s->n_held++;
+    s->reordered++;
+}
+
+/* Stop waiting for gaps in front of packets received before
+   now_ns - hold_ns (same clock as tmif_pkt_t rx_ns) */
+void tmif_seq_expire(tmif_seq_t *s, int64_t now_ns) {
+    uint64_t last = 0;
+    int found = 0;
+    int i = 0;
+
+    if (s->n_held == 0) {
+        return;
+    }
+
+    for (i = 0; i < TMIF_SEQ_WINDOW_MAX; i++) {
+        if (s->slot_full[i] && ((now_ns - s->slot_ns[i]) >= s->hold_ns)) {
+            if (!found || (s->slot_seq[i] > last)) {
+                last = s->slot_seq[i];
+            }
+            found = 1;
+        }
+    }
+
+    if (found) {
+        s->expired++;
+        advance(s, last + 1);
+        release_ready(s);
+    }
+}
+
+/* When the oldest held packet stops waiting (rx_ns clock), -1 if
+   nothing is held */
+int64_t tmif_seq_deadline(tmif_seq_t *s) {
+    int64_t oldest = 0;
+    int found = 0;
+    int i = 0;
+
+    if (s->n_held == 0) {
+        return -1;
+    }
+    for (i = 0; i < TMIF_SEQ_WINDOW_MAX; i++) {
+        if (s->slot_full[i] && (!found || (s->slot_ns[i] < oldest))) {
+            oldest = s->slot_ns[i];
+            found = 1;
+        }
+    }
+    return found ? (oldest + s->hold_ns) : -1;
+}
+
+/* Release everything still held, e.g. on shutdown */
+void tmif_seq_flush(tmif_seq_t *s) {
+    uint64_t last = 0;
+    int i = 0;
+
+    if (s->n_held == 0) {
+        return;
+    }
+    for (i = 0; i < TMIF_SEQ_WINDOW_MAX; i++) {
+        if (s->slot_full[i] && (s->slot_seq[i] > last)) {
+            last = s->slot_seq[i];
+        }
+    }
+    advance(s, last + 1);
+}
+
+void tmif_seq_print_stats(tmif_seq_t *s) {
+    int i = 0;
+
+    printf("seq: released %llu, reordered %llu, held %d (depth %d, hold %lld us)\n",
+           (unsigned long long)s->released, (unsigned long long)s->reordered,
+           s->n_held, s->depth, (long long)(s->hold_ns/1000));
+    printf("seq: gaps %llu (%llu packets lost), hold timeouts %llu, duplicates %llu, "
+           "late %llu, resets %llu, wraps %llu\n",
+           (unsigned long long)s->gaps, (unsigned long long)s->lost,
+           (unsigned long long)s->expired, (unsigned long long)s->duplicates,
+           (unsigned long long)s->late, (unsigned long long)s->resets,
+           (unsigned long long)s->wraps);
+    if (s->gaps) {
+        printf("seq gap length histogram:\n");
+        for (i = 0; i < TMIF_SEQ_GAP_BINS; i++) {
+            if (i < (TMIF_SEQ_GAP_BINS - 1)) {
+                printf("  %3d-%-3d: %llu\n", 1 << i, (2 << i) - 1,
+                       (unsigned long long)s->gap_hist[i]);
+            } else {
+                printf("  %3d+   : %llu\n", 1 << i, (unsigned long long)s->gap_hist[i]);
+            }
+        }
+    }
+}
+
+void tmif_seq_free(tmif_seq_t *s) {
+    free(s->slots);
+    s->slots = NULL;
+}
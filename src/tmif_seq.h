@@ -0,0 +1,85 @@
+#ifndef TMIF_SEQ_H_
+#define TMIF_SEQ_H_
+
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   CU40MMXS sequence tracking for tmif. Extends the 16-bit packet
+   counter (word 1) to 64 bits across wraps and puts packets back in
+   order through a small reorder window before the archive and
+   telemetry encoders see them.
+*/
+
+#include <stdint.h>
+
+#include "tmif_net.h"
+
+/* Most packets the reorder window can hold (power of two) */
+#define TMIF_SEQ_WINDOW_MAX 256
+/* Default reorder depth in packets */
+#define TMIF_SEQ_DEPTH_DEFAULT 32
+/* Default longest a packet waits for a missing predecessor */
+#define TMIF_SEQ_HOLD_US_DEFAULT 2000
+/* Released sequence numbers remembered to tell duplicates from late
+   arrivals (power of two, multiple of 64) */
+#define TMIF_SEQ_HISTORY 1024
+/* Packets in a row, in order, behind the next expected one that are
+   taken as the counter starting over */
+#define TMIF_SEQ_RESET_RUN 8
+/* Gap length histogram bins: 1, 2-3, 4-7, ... 64+ */
+#define TMIF_SEQ_GAP_BINS 7
+
+/* Called with each packet in sequence order. The packet is only valid
+   for the duration of the call. */
+typedef void (*tmif_seq_release_t)(void *, tmif_pkt_t *, uint64_t);
+
+typedef struct {
+    /* next sequence number owed to the release callback */
+    uint64_t next;
+    int started;
+    /* packets held back waiting on next */
+    int depth;
+    int64_t hold_ns;
+    int n_held;
+
+    /* window slots, indexed by seq % TMIF_SEQ_WINDOW_MAX */
+    uint8_t *slots;
+    uint64_t slot_seq[TMIF_SEQ_WINDOW_MAX];
+    int64_t slot_ns[TMIF_SEQ_WINDOW_MAX];
+    uint8_t slot_full[TMIF_SEQ_WINDOW_MAX];
+
+    /* one bit per sequence number behind next, set if it was received */
+    uint64_t seen[TMIF_SEQ_HISTORY/64];
+    /* missing packets since the last release */
+    uint64_t gap_run;
+    /* packets in order behind next, and the one that would carry on
+       the run */
+    int behind_run;
+    int64_t behind_next;
+
+    tmif_seq_release_t release;
+    void *ctx;
+
+    /* stats */
+    uint64_t released;
+    uint64_t reordered;
+    uint64_t gaps;
+    uint64_t lost;
+    uint64_t duplicates;
+    uint64_t late;
+    uint64_t resets;
+    uint64_t wraps;
+    uint64_t expired;
+    uint64_t gap_hist[TMIF_SEQ_GAP_BINS];
+} tmif_seq_t;
+
+
+int tmif_seq_init(tmif_seq_t *, int, int, tmif_seq_release_t, void *);
+void tmif_seq_push(tmif_seq_t *, tmif_pkt_t *);
+void tmif_seq_expire(tmif_seq_t *, int64_t);
+int64_t tmif_seq_deadline(tmif_seq_t *);
+void tmif_seq_flush(tmif_seq_t *);
+void tmif_seq_print_stats(tmif_seq_t *);
+void tmif_seq_free(tmif_seq_t *);
+
+#endif /* TMIF_SEQ_H_ */
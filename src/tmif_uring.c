@@ -0,0 +1,446 @@
+/* Author: Nicholas Nell
+   email: nicholas.nell@colorado.edu
+
+   io_uring ingest backend for tmif. One multishot recvmsg stays armed
+   on the CU40MMXS socket and the kernel picks receive buffers out of a
+   registered provided-buffer ring, so datagrams land without a
+   syscall per packet. recvmsg rather than recv so the SO_TIMESTAMPNS
+   control message lands in the buffer ahead of the payload. Talks to
+   the kernel directly (no liburing) and falls back to the recvmmsg
+   path when io_uring, provided buffer rings or multishot recv are
+   missing.
+*/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "tmif_net.h"
+
+/* Provided buffer group used for the CU40MMXS socket */
+#define TMIF_URING_BGID 0
+/* Control space in each buffer, enough for the receive timestamp */
+#define TMIF_URING_CTRL_SIZE CMSG_SPACE(sizeof(struct timespec))
+/* Payload room, keeps every payload 16-bit aligned */
+#define TMIF_URING_PAYLOAD_SIZE 1472
+/* Receive buffer stride: recvmsg header, control, payload */
+#define TMIF_URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + \
+                             TMIF_URING_CTRL_SIZE + TMIF_URING_PAYLOAD_SIZE)
+/* user_data tag on the multishot recv */
+#define TMIF_URING_RECV_TAG 1
+
+
+struct tmif_uring {
+    int ring_fd;
+
+    /* submission queue */
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* completion queue */
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* provided buffer ring and the buffers behind it */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_tail;
+    uint8_t *bufs;
+    size_t bufs_size;
+
+    /* recvmsg template, read by the kernel on every shot */
+    struct msghdr msg;
+
+    /* buffer ids handed out by the last recv, recycled on the next */
+    uint16_t held[TMIF_URING_BATCH];
+    int n_held;
+
+    int armed;
+    uint64_t rearms;
+    uint64_t nobufs;
+    uint64_t errors;
+};
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(struct tmif_uring *u) {
+    if (u->br) {
+        munmap(u->br, u->br_size);
+    }
+    if (u->bufs) {
+        munmap(u->bufs, u->bufs_size);
+    }
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ptr && (u->cq_ptr != u->sq_ptr)) {
+        munmap(u->cq_ptr, u->cq_size);
+    }
+    if (u->sq_ptr) {
+        munmap(u->sq_ptr, u->sq_size);
+    }
+    if (u->ring_fd >= 0) {
+        close(u->ring_fd);
+    }
+    free(u);
+}
+
+/* Map the SQ/CQ rings of a freshly set up io_uring */
+static int uring_map(struct tmif_uring *u, struct io_uring_params *p) {
+    u->sq_size = p->sq_off.array + p->sq_entries*sizeof(unsigned);
+    u->cq_size = p->cq_off.cqes + p->cq_entries*sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size) {
+            u->sq_size = u->cq_size;
+        }
+        u->cq_size = u->sq_size;
+    }
+
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        u->sq_ptr = NULL;
+        return -1;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            u->cq_ptr = NULL;
+            return -1;
+        }
+    }
+
+    u->sqes_size = p->sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.head);
+    u->sq_tail = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.tail);
+    u->sq_mask = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.ring_mask);
+    u->sq_flags = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.flags);
+    u->sq_array = (unsigned *)((uint8_t *)u->sq_ptr + p->sq_off.array);
+    u->cq_head = (unsigned *)((uint8_t *)u->cq_ptr + p->cq_off.head);
+    u->cq_tail = (unsigned *)((uint8_t *)u->cq_ptr + p->cq_off.tail);
+    u->cq_mask = (unsigned *)((uint8_t *)u->cq_ptr + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ptr + p->cq_off.cqes);
+
+    return 0;
+}
+
+/* Put a receive buffer back on the provided buffer ring. The new tail
+   is published by uring_publish_bufs(). */
+static void uring_add_buf(struct tmif_uring *u, uint16_t bid) {
+    struct io_uring_buf *buf;
+
+    buf = &u->br->bufs[u->br_tail & (TMIF_URING_NBUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid*TMIF_URING_BUF_SIZE);
+    buf->len = TMIF_URING_BUF_SIZE;
+    buf->bid = bid;
+    u->br_tail++;
+}
+
+static void uring_publish_bufs(struct tmif_uring *u) {
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Register the provided buffer ring and fill it with every buffer */
+static int uring_setup_bufs(struct tmif_uring *u) {
+    struct io_uring_buf_reg reg;
+    int i = 0;
+
+    u->br_size = TMIF_URING_NBUFS*sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        return -1;
+    }
+
+    u->bufs_size = (size_t)TMIF_URING_NBUFS*TMIF_URING_BUF_SIZE;
+    u->bufs = mmap(NULL, u->bufs_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (u->bufs == MAP_FAILED) {
+        u->bufs = NULL;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = TMIF_URING_NBUFS;
+    reg.bgid = TMIF_URING_BGID;
+    if (sys_io_uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register(PBUF_RING)");
+        return -1;
+    }
+
+    u->br_tail = 0;
+    for (i = 0; i < TMIF_URING_NBUFS; i++) {
+        uring_add_buf(u, (uint16_t)i);
+    }
+    uring_publish_bufs(u);
+
+    return 0;
+}
+
+/* Queue and submit the multishot recvmsg on the socket */
+static int uring_arm(struct tmif_uring *u, int sock_fd) {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    memset(&u->msg, 0, sizeof(u->msg));
+    u->msg.msg_controllen = TMIF_URING_CTRL_SIZE;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TMIF_URING_BGID;
+    sqe->user_data = TMIF_URING_RECV_TAG;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (sys_io_uring_enter(u->ring_fd, 1, 0, 0) < 0) {
+        perror("io_uring_enter()");
+        return -1;
+    }
+    u->armed = 1;
+
+    return 0;
+}
+
+/* Open the CU40MMXS socket on addr:port and drive it through io_uring.
+   Falls back to recvmmsg (batch datagrams per call) if the kernel
+   can't. */
+int tmif_rx_open_uring(tmif_rx_t *rx, uint32_t addr, uint16_t port, int batch) {
+    struct io_uring_params params;
+    struct tmif_uring *u;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    memset(rx, 0, sizeof(tmif_rx_t));
+    rx->fd = -1;
+    rx->udp_fd = -1;
+    rx->mode = TMIF_RX_URING;
+
+    u = calloc(1, sizeof(struct tmif_uring));
+    if (!u) {
+        return -1;
+    }
+    u->ring_fd = -1;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = TMIF_URING_CQ_ENTRIES;
+    u->ring_fd = sys_io_uring_setup(8, &params);
+    if (u->ring_fd < 0) {
+        perror("io_uring_setup()");
+        goto fallback;
+    }
+
+    if (uring_map(u, &params) < 0) {
+        perror("mmap() io_uring");
+        goto fallback;
+    }
+
+    if (uring_setup_bufs(u) < 0) {
+        goto fallback;
+    }
+
+    rx->udp_fd = tmif_rx_socket(addr, port);
+    if (rx->udp_fd < 0) {
+        goto fallback;
+    }
+
+    if (uring_arm(u, rx->udp_fd) < 0) {
+        goto fallback;
+    }
+
+    /* Kernels without multishot recvmsg fail the request straight away */
+    head = *u->cq_head;
+    if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        if ((cqe->res < 0) && (cqe->res != -ENOBUFS)) {
+            printf("multishot recvmsg not supported: %s\n", strerror(-cqe->res));
+            goto fallback;
+        }
+    }
+
+    rx->uring = u;
+    rx->fd = u->ring_fd;
+    rx->max_pkts = TMIF_URING_BATCH;
+    rx->pkts = calloc(rx->max_pkts, sizeof(tmif_pkt_t));
+    if (!rx->pkts) {
+        tmif_rx_close(rx);
+        return -1;
+    }
+
+    printf("rx: io_uring multishot recvmsg, %d x %d byte provided buffers\n",
+           TMIF_URING_NBUFS, (int)TMIF_URING_BUF_SIZE);
+    rx->addr = addr;
+    rx->port = port;
+
+    return 0;
+
+ fallback:
+    printf("io_uring ingest unavailable, falling back to recvmmsg\n");
+    if (rx->udp_fd >= 0) {
+        close(rx->udp_fd);
+        rx->udp_fd = -1;
+    }
+    uring_free(u);
+    return tmif_rx_open(rx, TMIF_RX_MMSG, addr, port, batch, 0);
+}
+
+/* Recycle the previous batch's buffers and reap up to TMIF_URING_BATCH
+   completions. Returns the number of packets in rx->pkts. */
+int tmif_uring_recv(tmif_rx_t *rx) {
+    struct tmif_uring *u = rx->uring;
+    struct io_uring_cqe *cqe;
+    struct io_uring_recvmsg_out *out;
+    struct msghdr ctrl;
+    uint8_t *buf;
+    int64_t rx_ns = 0;
+    int64_t fallback_ns = 0;
+    unsigned head;
+    unsigned tail;
+    uint16_t bid;
+    int n = 0;
+    int i = 0;
+
+    /* The caller is done with last time's packets */
+    if (u->n_held) {
+        for (i = 0; i < u->n_held; i++) {
+            uring_add_buf(u, u->held[i]);
+        }
+        uring_publish_bufs(u);
+        u->n_held = 0;
+    }
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    while ((head != tail) && (u->n_held < TMIF_URING_BATCH)) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        head++;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            u->held[u->n_held++] = bid;
+
+            if (cqe->res >= (int)sizeof(*out)) {
+                buf = u->bufs + (size_t)bid*TMIF_URING_BUF_SIZE;
+                out = (struct io_uring_recvmsg_out *)buf;
+                rx->datagrams++;
+                if ((out->payloadlen == CU40MMXS_PACKET_SIZE) && !(out->flags & MSG_TRUNC)) {
+                    /* Control data follows the header, payload follows
+                       the full control space */
+                    memset(&ctrl, 0, sizeof(ctrl));
+                    ctrl.msg_control = buf + sizeof(*out);
+                    ctrl.msg_controllen = out->controllen;
+                    rx_ns = tmif_rx_cmsg_ns(&ctrl);
+                    if (rx_ns == 0) {
+                        if (fallback_ns == 0) {
+                            fallback_ns = tmif_rx_now_ns();
+                        }
+                        rx_ns = fallback_ns;
+                        rx->no_tstamp++;
+                    }
+                    rx->pkts[n].data = (uint16_t *)(buf + sizeof(*out) + TMIF_URING_CTRL_SIZE);
+                    rx->pkts[n].len = out->payloadlen;
+                    rx->pkts[n].rx_ns = rx_ns;
+                    n++;
+                } else {
+                    rx->runts++;
+                }
+            }
+        } else if (cqe->res == -ENOBUFS) {
+            u->nobufs++;
+        } else if (cqe->res < 0) {
+            u->errors++;
+        }
+
+        /* Kernel dropped the multishot request (ran out of buffers or
+           the CQ overflowed), it has to be armed again */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            u->armed = 0;
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    /* Completions that did not fit in the CQ are parked in the kernel
+       until we ask for them */
+    if (__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+        sys_io_uring_enter(u->ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+    }
+
+    if (!u->armed) {
+        u->rearms++;
+        uring_arm(u, rx->udp_fd);
+    }
+
+    return n;
+}
+
+void tmif_uring_print_stats(tmif_rx_t *rx) {
+    struct tmif_uring *u = rx->uring;
+
+    if (u) {
+        printf("io_uring rearms: %llu, out of buffers: %llu, errors: %llu\n",
+               (unsigned long long)u->rearms, (unsigned long long)u->nobufs,
+               (unsigned long long)u->errors);
+    }
+}
+
+void tmif_uring_close(tmif_rx_t *rx) {
+    if (rx->uring) {
+        /* rx->fd is the ring fd, uring_free() closes it */
+        if (rx->fd == rx->uring->ring_fd) {
+            rx->fd = -1;
+        }
+        uring_free(rx->uring);
+        rx->uring = NULL;
+    }
+}